@@ -0,0 +1,1122 @@
+////
+// Throughput benchmark of pg_logical_cdc without PostgreSQL
+//
+// A fake walsender listens on a unix socket and streams synthetic
+// XLogData messages, and a fake consumer reads the output of
+// pg_logical_cdc and acknowledges records with F commands. The benchmark
+// reports how many records and bytes per second pg_logical_cdc relays
+// from the socket to the consumer. With -R, the consumer reads the shared
+// memory ring of --ring instead of a pipe.
+//
+#include "../src/postgres_func.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT "5432"
+#define RECORD_HEADER_SIZE (1 + 4 + 1 + 8 + 8 + 8)  // 'd', Int32, 'w', 3 x Int64
+#define SEND_BUFSIZ (256*1024)
+#define RECV_BUFSIZ (1024*1024)
+#define START_LSN ((int64_t) 0x1000000)
+#define LSN_STEP (0x100)
+
+#define RING_HEADER_SIZE (4096)
+#define RING_CACHE_LINE (64)
+
+#define PROTOCOL_SSL_REQUEST (80877103)
+#define PROTOCOL_GSS_REQUEST (80877104)
+
+struct Buffer {
+    char* buf;
+    size_t len;
+    size_t cap;
+};
+
+// Header of the --ring file (see README)
+struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    char pad0[RING_CACHE_LINE - 16];
+    uint64_t write_pos;
+    char pad1[RING_CACHE_LINE - 8];
+    uint64_t read_pos;
+    int64_t ack_lsn;
+    char pad2[RING_CACHE_LINE - 16];
+    uint32_t consumer_waiting;
+    uint32_t producer_waiting;
+};
+
+// State shared by the walsender thread and the consumer
+struct Walsender {
+    int listen_fd;
+    int fd;
+    pthread_t thread;
+    int64_t last_lsn;
+    int64_t started_at;       // monotonic usec when streaming started
+    int64_t acked_at;         // monotonic usec when last_lsn was confirmed
+    long feedback_count;
+    bool failed;
+};
+
+static const char* cfg_exe = "../src/pg_logical_cdc";
+static long cfg_count = 1000000;
+static size_t cfg_size = 200;
+static double cfg_rate = 0;            // records per second, 0 is unlimited
+static long cfg_ack_every = 1000;      // 0 acks only the last record
+static long cfg_consumer_cost = 0;     // nanoseconds per record
+static bool cfg_binary_header = false;
+static bool cfg_binary_commands = false;
+static bool cfg_compress = false;
+static size_t cfg_ring_size = 0;       // data area of --ring, 0 uses a pipe
+static bool cfg_verbose = false;
+
+static int64_t monotonicMicros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static char* reserveBuffer(struct Buffer* b, size_t size)
+{
+    if (b->len + size > b->cap) {
+        size_t new_cap = b->cap == 0 ? 4096 : b->cap * 2;
+        while (new_cap < b->len + size) {
+            new_cap *= 2;
+        }
+        b->buf = realloc(b->buf, new_cap);
+        b->cap = new_cap;
+    }
+    return b->buf + b->len;
+}
+
+static void putInt32(char* p, int32_t v)
+{
+    uint32_t n32 = htonl((uint32_t) v);
+    memcpy(p, &n32, 4);
+}
+
+static void putInt16(char* p, int16_t v)
+{
+    uint16_t n16 = htons((uint16_t) v);
+    memcpy(p, &n16, 2);
+}
+
+static void appendMessage(struct Buffer* b, char type, const char* body, size_t len)
+{
+    char* p = reserveBuffer(b, 1 + 4 + len);
+    p[0] = type;
+    putInt32(p + 1, (int32_t) (len + 4));
+    if (len > 0) {
+        memcpy(p + 5, body, len);
+    }
+    b->len += 1 + 4 + len;
+}
+
+static int sendAll(int fd, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recvAll(int fd, char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads a message of the frontend protocol. Body is stored in b.
+static int recvMessage(int fd, char* r_type, struct Buffer* b)
+{
+    char head[5];
+    if (recvAll(fd, head, sizeof(head)) < 0) {
+        return -1;
+    }
+    uint32_t n32;
+    memcpy(&n32, head + 1, 4);
+    size_t len = ntohl(n32) - 4;
+    b->len = 0;
+    if (recvAll(fd, reserveBuffer(b, len + 1), len) < 0) {
+        return -1;
+    }
+    b->buf[len] = '\0';
+    b->len = len;
+    *r_type = head[0];
+    return 0;
+}
+
+////
+// Fake walsender
+//
+
+static int acceptStartup(struct Walsender* ws)
+{
+    struct Buffer b = {0};
+
+    while (true) {
+        char lenbuf[4];
+        if (recvAll(ws->fd, lenbuf, 4) < 0) {
+            return -1;
+        }
+        uint32_t n32;
+        memcpy(&n32, lenbuf, 4);
+        size_t len = ntohl(n32) - 4;
+        if (recvAll(ws->fd, reserveBuffer(&b, len), len) < 0) {
+            return -1;
+        }
+        memcpy(&n32, b.buf, 4);
+        if (ntohl(n32) == PROTOCOL_SSL_REQUEST || ntohl(n32) == PROTOCOL_GSS_REQUEST) {
+            // Encryption is not supported
+            if (sendAll(ws->fd, "N", 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        break;
+    }
+
+    // AuthenticationOk, ParameterStatus, BackendKeyData, ReadyForQuery
+    static const char* params[][2] = {
+        { "server_version", "16.0" },
+        { "integer_datetimes", "on" },
+        { "client_encoding", "UTF8" },
+        { "server_encoding", "UTF8" },
+    };
+    b.len = 0;
+    char body[64];
+    putInt32(body, 0);
+    appendMessage(&b, 'R', body, 4);
+    for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+        size_t klen = strlen(params[i][0]) + 1;
+        size_t vlen = strlen(params[i][1]) + 1;
+        memcpy(body, params[i][0], klen);
+        memcpy(body + klen, params[i][1], vlen);
+        appendMessage(&b, 'S', body, klen + vlen);
+    }
+    putInt32(body, 1);
+    putInt32(body + 4, 1);
+    appendMessage(&b, 'K', body, 8);
+    appendMessage(&b, 'Z', "I", 1);
+
+    int r = sendAll(ws->fd, b.buf, b.len);
+    free(b.buf);
+    return r;
+}
+
+static void appendIdentifySystem(struct Buffer* b)
+{
+    static const char* names[] = { "systemid", "timeline", "xlogpos", "dbname" };
+    static const char* values[] = { "1", "1", "0/1000000", "bench" };
+
+    // RowDescription: all columns are text
+    struct Buffer row = {0};
+    char* p = reserveBuffer(&row, 2);
+    putInt16(p, 4);
+    row.len += 2;
+    for (int i = 0; i < 4; i++) {
+        size_t nlen = strlen(names[i]) + 1;
+        p = reserveBuffer(&row, nlen + 18);
+        memcpy(p, names[i], nlen);
+        p += nlen;
+        putInt32(p, 0);       // table OID
+        putInt16(p + 4, 0);   // column number
+        putInt32(p + 6, 25);  // type OID (text)
+        putInt16(p + 10, -1); // type size
+        putInt32(p + 12, -1); // type modifier
+        putInt16(p + 16, 0);  // format code
+        row.len += nlen + 18;
+    }
+    appendMessage(b, 'T', row.buf, row.len);
+
+    // DataRow
+    row.len = 0;
+    p = reserveBuffer(&row, 2);
+    putInt16(p, 4);
+    row.len += 2;
+    for (int i = 0; i < 4; i++) {
+        size_t vlen = strlen(values[i]);
+        p = reserveBuffer(&row, 4 + vlen);
+        putInt32(p, (int32_t) vlen);
+        memcpy(p + 4, values[i], vlen);
+        row.len += 4 + vlen;
+    }
+    appendMessage(b, 'D', row.buf, row.len);
+    free(row.buf);
+
+    appendMessage(b, 'C', "IDENTIFY_SYSTEM", strlen("IDENTIFY_SYSTEM") + 1);
+    appendMessage(b, 'Z', "I", 1);
+}
+
+// Answers queries until START_REPLICATION
+static int serveQueries(struct Walsender* ws)
+{
+    struct Buffer in = {0};
+    struct Buffer out = {0};
+    int r = -1;
+
+    while (true) {
+        char type;
+        if (recvMessage(ws->fd, &type, &in) < 0) {
+            goto done;
+        }
+        if (type == 'X') {
+            errno = ECONNRESET;
+            goto done;
+        }
+        if (type != 'Q') {
+            continue;
+        }
+        if (cfg_verbose) {
+            fprintf(stderr, "walsender: %s\n", in.buf);
+        }
+
+        out.len = 0;
+        if (strncmp(in.buf, "IDENTIFY_SYSTEM", 15) == 0) {
+            appendIdentifySystem(&out);
+        }
+        else if (strncmp(in.buf, "START_REPLICATION", 17) == 0) {
+            // CopyBothResponse with text format and no columns
+            char body[3] = { 0, 0, 0 };
+            appendMessage(&out, 'W', body, sizeof(body));
+            r = sendAll(ws->fd, out.buf, out.len);
+            goto done;
+        }
+        else {
+            appendMessage(&out, 'I', NULL, 0);
+            appendMessage(&out, 'Z', "I", 1);
+        }
+        if (sendAll(ws->fd, out.buf, out.len) < 0) {
+            goto done;
+        }
+    }
+
+done:
+    free(in.buf);
+    free(out.buf);
+    return r;
+}
+
+static void appendRecord(struct Buffer* b, const char* payload, int64_t lsn)
+{
+    char* p = reserveBuffer(b, RECORD_HEADER_SIZE + cfg_size);
+    p[0] = 'd';
+    putInt32(p + 1, (int32_t) (4 + 1 + 8 + 8 + 8 + cfg_size));
+    p[5] = 'w';
+    fe_sendint64(lsn, p + 6);                     // dataStart
+    fe_sendint64(lsn, p + 14);                    // walEnd
+    fe_sendint64(feGetCurrentTimestamp(), p + 22);  // sendTime
+    memcpy(p + RECORD_HEADER_SIZE, payload, cfg_size);
+    b->len += RECORD_HEADER_SIZE + cfg_size;
+}
+
+// Payload is a JSON string so that --transcode works: "rec0000000001xxx..."
+static void formatPayload(char* payload, long seq)
+{
+    char digits[16];
+    snprintf(digits, sizeof(digits), "%010ld", seq % 10000000000L);
+    memcpy(payload + 4, digits, 10);
+}
+
+// Parses standby status updates in in. Returns false when the stream ends.
+static bool processFeedback(struct Walsender* ws, struct Buffer* in)
+{
+    size_t pos = 0;
+    bool open = true;
+    while (in->len - pos >= 5) {
+        uint32_t n32;
+        memcpy(&n32, in->buf + pos + 1, 4);
+        size_t len = ntohl(n32);
+        if (in->len - pos < 1 + len) {
+            break;
+        }
+        char type = in->buf[pos];
+        const char* body = in->buf + pos + 5;
+        if (type == 'd' && body[0] == 'r' && len - 4 >= 1 + 8 + 8 + 8 + 8 + 1) {
+            int64_t flush_lsn = fe_recvint64((char*) body + 9);
+            __atomic_add_fetch(&ws->feedback_count, 1, __ATOMIC_RELAXED);
+            if (flush_lsn >= ws->last_lsn && ws->acked_at == 0) {
+                __atomic_store_n(&ws->acked_at, monotonicMicros(), __ATOMIC_RELEASE);
+            }
+        }
+        else if (type == 'c' || type == 'X') {
+            open = false;
+        }
+        pos += 1 + len;
+    }
+    memmove(in->buf, in->buf + pos, in->len - pos);
+    in->len -= pos;
+    return open;
+}
+
+static int streamRecords(struct Walsender* ws)
+{
+    struct Buffer out = {0};
+    struct Buffer in = {0};
+    size_t out_pos = 0;
+    long seq = 0;
+    int64_t lsn = START_LSN;
+    int r = -1;
+
+    char* payload = malloc(cfg_size);
+    memset(payload, 'x', cfg_size);
+    memcpy(payload, "\"rec", 4);
+    payload[cfg_size - 1] = '"';
+
+    fcntl(ws->fd, F_SETFL, fcntl(ws->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    int64_t started_at = monotonicMicros();
+    __atomic_store_n(&ws->started_at, started_at, __ATOMIC_RELEASE);
+
+    while (true) {
+        // Generate records that are due
+        if (out_pos == out.len) {
+            out.len = 0;
+            out_pos = 0;
+            long due = cfg_count;
+            if (cfg_rate > 0) {
+                due = (long) ((monotonicMicros() - started_at) * cfg_rate / 1000000.0);
+                if (due > cfg_count) due = cfg_count;
+            }
+            while (seq < due && out.len < SEND_BUFSIZ) {
+                lsn += LSN_STEP;
+                formatPayload(payload, seq);
+                appendRecord(&out, payload, lsn);
+                seq++;
+            }
+        }
+
+        struct pollfd pfd;
+        pfd.fd = ws->fd;
+        pfd.events = POLLIN | (out_pos < out.len ? POLLOUT : 0);
+        int timeout = (seq < cfg_count && out_pos == out.len) ? 1 : 100;
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto done;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(ws->fd, out.buf + out_pos, out.len - out_pos, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                goto done;
+            }
+            if (n > 0) {
+                out_pos += n;
+            }
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(ws->fd, reserveBuffer(&in, 65536), 65536, 0);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                goto done;
+            }
+            if (n == 0) {
+                // pg_logical_cdc exited
+                r = 0;
+                goto done;
+            }
+            if (n > 0) {
+                in.len += n;
+                if (!processFeedback(ws, &in)) {
+                    r = 0;
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+    free(payload);
+    free(out.buf);
+    free(in.buf);
+    return r;
+}
+
+static void* walsenderMain(void* arg)
+{
+    struct Walsender* ws = arg;
+
+    ws->fd = accept(ws->listen_fd, NULL, NULL);
+    if (ws->fd < 0 || acceptStartup(ws) < 0 || serveQueries(ws) < 0 || streamRecords(ws) < 0) {
+        perror("walsender");
+        __atomic_store_n(&ws->failed, true, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static int listenUnixSocket(const char* dir)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/.s.PGSQL.%s", dir, BENCH_PORT);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+////
+// Fake consumer
+//
+
+struct Consumer {
+    int out_fd;  // stdout of pg_logical_cdc
+    int cmd_fd;  // stdin of pg_logical_cdc
+    struct RingHeader* ring;  // with --ring
+    char* ring_data;
+    int notify_fd;  // written by pg_logical_cdc when ring->consumer_waiting is set
+    int wait_fd;    // written to wake up pg_logical_cdc
+    long records;
+    size_t bytes;
+    int64_t last_lsn;
+    int64_t finished_at;
+    int64_t acked_last_at;
+    bool in_payload;
+    size_t skip;         // bytes of the current payload not received yet
+    size_t plain_bytes;  // decompressed bytes with --compress
+};
+
+static void spend(long nanos)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t until = (int64_t) ts.tv_sec * 1000000000L + ts.tv_nsec + nanos;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    } while ((int64_t) ts.tv_sec * 1000000000L + ts.tv_nsec < until);
+}
+
+// Wakes up pg_logical_cdc if it waits for the ring
+static int wakeProducer(struct Consumer* c)
+{
+    if (__atomic_load_n(&c->ring->producer_waiting, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&c->ring->producer_waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(c->wait_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int sendAck(struct Consumer* c)
+{
+    char cmd[32];
+    int len;
+    if (c->ring != NULL) {
+        // The ring header replaces F commands
+        __atomic_store_n(&c->ring->ack_lsn, c->last_lsn, __ATOMIC_RELEASE);
+        return wakeProducer(c);
+    }
+    if (cfg_binary_commands) {
+        // Byte1('F'), Byte7, UInt64 LSN (little endian)
+        memset(cmd, 0, 16);
+        cmd[0] = 'F';
+        for (int i = 0; i < 8; i++) {
+            cmd[8 + i] = (char) ((uint64_t) c->last_lsn >> (i * 8));
+        }
+        len = 16;
+    }
+    else {
+        len = snprintf(cmd, sizeof(cmd), "F %X/%X\n",
+                (uint32_t) (c->last_lsn >> 32), (uint32_t) c->last_lsn);
+    }
+    const char* p = cmd;
+    while (len > 0) {
+        ssize_t n = write(c->cmd_fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int64_t parseLsn(const char* p, const char* end)
+{
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+    uint64_t* v = &hi;
+    for (; p < end; p++) {
+        char ch = *p;
+        if (ch == '/') {
+            v = &lo;
+        }
+        else {
+            *v = *v * 16 + (ch <= '9' ? ch - '0' : (ch | 0x20) - 'a' + 10);
+        }
+    }
+    return (int64_t) (hi << 32 | lo);
+}
+
+// Parses headers and payloads of records in buf and returns the number of
+// bytes consumed, or -1 on errors
+static ssize_t parseRecords(struct Consumer* c, const char* buf, size_t len)
+{
+    size_t pos = 0;
+    while (true) {
+        if (c->in_payload) {
+            size_t k = len - pos < c->skip ? len - pos : c->skip;
+            pos += k;
+            c->skip -= k;
+            if (c->skip > 0) {
+                break;
+            }
+            c->in_payload = false;
+            if (cfg_consumer_cost > 0) {
+                spend(cfg_consumer_cost);
+            }
+            c->records++;
+            if (c->records == cfg_count) {
+                c->finished_at = monotonicMicros();
+            }
+            if (c->records == cfg_count ||
+                    (cfg_ack_every > 0 && c->records % cfg_ack_every == 0)) {
+                if (sendAck(c) < 0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+        if (cfg_binary_header) {
+            if (len - pos < 32) {
+                break;
+            }
+            const unsigned char* h = (const unsigned char*) buf + pos;
+            uint64_t lsn = 0;
+            uint32_t size = 0;
+            for (int i = 7; i >= 0; i--) lsn = lsn << 8 | h[i];
+            for (int i = 3; i >= 0; i--) size = size << 8 | h[24 + i];
+            c->last_lsn = (int64_t) lsn;
+            c->skip = size;
+            pos += 32;
+        }
+        else {
+            // w <LSN> <LENGTH>\n
+            const char* nl = memchr(buf + pos, '\n', len - pos);
+            if (nl == NULL) {
+                break;
+            }
+            const char* lsn_end = memchr(buf + pos + 2, ' ', nl - (buf + pos + 2));
+            if (buf[pos] != 'w' || lsn_end == NULL) {
+                fprintf(stderr, "Unexpected output. Give -H or -B to pg_logical_cdc.\n");
+                return -1;
+            }
+            c->last_lsn = parseLsn(buf + pos + 2, lsn_end);
+            c->skip = strtoul(lsn_end + 1, NULL, 10);
+            pos = nl + 1 - buf;
+        }
+        c->in_payload = true;
+    }
+    return pos;
+}
+
+static uint32_t getLE32(const unsigned char* p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// Decompresses an LZ4 block and returns the size, or -1 if it's invalid
+static ssize_t decompressLz4(const unsigned char* src, size_t n, char* dst, size_t cap)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < n) {
+        unsigned token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned b;
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > n - ip || lit > cap - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n) {
+            break;  // last literals
+        }
+        if (n - ip < 2) {
+            return -1;
+        }
+        size_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        size_t ml = token & 15;
+        if (ml == 15) {
+            unsigned b;
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                ml += b;
+            } while (b == 255);
+        }
+        ml += 4;
+        if (offset == 0 || offset > op || ml > cap - op) {
+            return -1;
+        }
+        // Copy bytes one by one since the match may overlap the output
+        for (size_t i = 0; i < ml; i++) {
+            dst[op + i] = dst[op - offset + i];
+        }
+        op += ml;
+    }
+    return op;
+}
+
+// Decompresses complete frames of --compress in buf, and parses records
+// in them. Returns the number of bytes consumed, or -1 on errors.
+static ssize_t parseFrames(struct Consumer* c, const char* buf, size_t len, char* plain)
+{
+    size_t pos = 0;
+    while (len - pos >= 32) {
+        const unsigned char* h = (const unsigned char*) buf + pos;
+        uint32_t raw_len = getLE32(h + 20);
+        uint32_t size = getLE32(h + 24);
+        uint32_t method = getLE32(h + 28);
+        if (size > RECV_BUFSIZ - 32 || raw_len > RECV_BUFSIZ) {
+            fprintf(stderr, "Too large frame. Use --compress-block up to %dK.\n", RECV_BUFSIZ / 1024 - 1);
+            return -1;
+        }
+        if (len - pos < 32 + size) {
+            break;
+        }
+        ssize_t n;
+        if (method == 0) {
+            memcpy(plain, h + 32, size);
+            n = size;
+        }
+        else {
+            n = decompressLz4(h + 32, size, plain, RECV_BUFSIZ);
+        }
+        if (n != (ssize_t) raw_len) {
+            fprintf(stderr, "Invalid frame\n");
+            return -1;
+        }
+        // A frame holds complete records
+        if (parseRecords(c, plain, n) != n || c->in_payload) {
+            fprintf(stderr, "Invalid records in a frame\n");
+            return -1;
+        }
+        c->plain_bytes += n;
+        pos += 32 + size;
+    }
+    return pos;
+}
+
+// Copies up to cap bytes of the ring to buf. Returns 0 if pg_logical_cdc
+// exited (its STDIN is closed) while the ring is empty.
+static ssize_t readRing(struct Consumer* c, char* buf, size_t cap)
+{
+    struct RingHeader* hdr = c->ring;
+    uint64_t read_pos = hdr->read_pos;
+    uint64_t write_pos;
+    while (true) {
+        write_pos = __atomic_load_n(&hdr->write_pos, __ATOMIC_ACQUIRE);
+        if (write_pos != read_pos) {
+            break;
+        }
+        __atomic_store_n(&hdr->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&hdr->write_pos, __ATOMIC_SEQ_CST) != read_pos) {
+            __atomic_store_n(&hdr->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        struct pollfd fds[2] = {
+            { .fd = c->notify_fd, .events = POLLIN },
+            { .fd = c->cmd_fd, .events = 0 },
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            if (read(c->notify_fd, drain, sizeof(drain)) < 0 && errno != EAGAIN) {
+                return -1;
+            }
+        }
+        else if (fds[1].revents & (POLLERR | POLLHUP)) {
+            return 0;
+        }
+    }
+
+    uint64_t capacity = hdr->capacity;
+    size_t n = write_pos - read_pos < cap ? write_pos - read_pos : cap;
+    size_t offset = read_pos % capacity;
+    size_t first = n < capacity - offset ? n : capacity - offset;
+    memcpy(buf, c->ring_data + offset, first);
+    memcpy(buf + first, c->ring_data, n - first);
+    __atomic_store_n(&hdr->read_pos, read_pos + n, __ATOMIC_SEQ_CST);
+    if (wakeProducer(c) < 0) {
+        return -1;
+    }
+    return n;
+}
+
+// Reads records until cfg_count records are received
+static int consume(struct Consumer* c)
+{
+    char* buf = malloc(RECV_BUFSIZ);
+    char* plain = cfg_compress ? malloc(RECV_BUFSIZ) : NULL;
+    size_t len = 0;
+    int r = -1;
+
+    while (c->records < cfg_count) {
+        ssize_t n = c->ring != NULL ? readRing(c, buf + len, RECV_BUFSIZ - len) :
+            read(c->out_fd, buf + len, RECV_BUFSIZ - len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto done;
+        }
+        if (n == 0) {
+            fprintf(stderr, "pg_logical_cdc closed the output after %ld records\n", c->records);
+            goto done;
+        }
+        c->bytes += n;
+        len += n;
+
+        ssize_t pos = cfg_compress ? parseFrames(c, buf, len, plain) : parseRecords(c, buf, len);
+        if (pos < 0) {
+            goto done;
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+    }
+    r = 0;
+
+done:
+    free(buf);
+    free(plain);
+    return r;
+}
+
+////
+// Main
+//
+
+static void showUsage(void)
+{
+    printf("Usage: pg_logical_cdc_bench [OPTION]... [-- PG_LOGICAL_CDC_OPTION...]\n");
+    printf("Options:\n");
+    printf("  -?, --help                 show usage\n");
+    printf("  -v, --verbose              show verbose messages\n");
+    printf("  -e, --exe PATH             pg_logical_cdc executable (default: %s)\n", cfg_exe);
+    printf("  -n, --count N              number of records (default: %ld)\n", cfg_count);
+    printf("  -s, --size BYTES           size of a record (default: %zu)\n", cfg_size);
+    printf("  -r, --rate N               records per second sent by the server (default: unlimited)\n");
+    printf("  -a, --ack-every N          send F command every N records; 0 acks only the last record (default: %ld)\n", cfg_ack_every);
+    printf("  -c, --consumer-cost NANOS  time the consumer spends for each record (default: 0)\n");
+    printf("  -B, --binary-header        pass --binary-header instead of --write-header\n");
+    printf("  -b, --binary-commands      send binary commands and pass --binary-commands\n");
+    printf("  -z, --compress             pass --compress lz4 and decompress the output\n");
+    printf("  -R, --ring SIZE            read output from a --ring of SIZE bytes instead of a pipe\n");
+}
+
+int main(int argc, char** argv)
+{
+    struct option longopts[] = {
+        { "help",           no_argument,       NULL, '?' },
+        { "verbose",        no_argument,       NULL, 'v' },
+        { "exe",            required_argument, NULL, 'e' },
+        { "count",          required_argument, NULL, 'n' },
+        { "size",           required_argument, NULL, 's' },
+        { "rate",           required_argument, NULL, 'r' },
+        { "ack-every",      required_argument, NULL, 'a' },
+        { "consumer-cost",  required_argument, NULL, 'c' },
+        { "binary-header",  no_argument,       NULL, 'B' },
+        { "binary-commands", no_argument,      NULL, 'b' },
+        { "compress",       no_argument,       NULL, 'z' },
+        { "ring",           required_argument, NULL, 'R' },
+        { 0,                0,                 0,     0  },
+    };
+
+    int opt;
+    int longindex;
+    while ((opt = getopt_long(argc, argv, "?ve:n:s:r:a:c:BbzR:", longopts, &longindex)) != -1) {
+        switch (opt) {
+        case '?':
+            showUsage();
+            return 0;
+        case 'v':
+            cfg_verbose = true;
+            break;
+        case 'e':
+            cfg_exe = optarg;
+            break;
+        case 'n':
+            cfg_count = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            cfg_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            cfg_rate = strtod(optarg, NULL);
+            break;
+        case 'a':
+            cfg_ack_every = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            cfg_consumer_cost = strtol(optarg, NULL, 10);
+            break;
+        case 'B':
+            cfg_binary_header = true;
+            break;
+        case 'b':
+            cfg_binary_commands = true;
+            break;
+        case 'z':
+            cfg_compress = true;
+            break;
+        case 'R':
+            cfg_ring_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (cfg_count <= 0 || cfg_size < 16 || cfg_ack_every < 0 || cfg_rate < 0) {
+        fprintf(stderr, "Invalid options. Size must be at least 16 bytes.\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/pg_logical_cdc_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    struct Walsender ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.fd = -1;
+    ws.last_lsn = START_LSN + (int64_t) cfg_count * LSN_STEP;
+    ws.listen_fd = listenUnixSocket(dir);
+    if (ws.listen_fd < 0) {
+        perror("Failed to listen on a unix socket");
+        rmdir(dir);
+        return 1;
+    }
+
+    // Start pg_logical_cdc with pipes for STDIN and STDOUT
+    int out_pipe[2];
+    int cmd_pipe[2];
+    if (pipe(out_pipe) < 0 || pipe(cmd_pipe) < 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    // The ring file and NOTIFY and WAIT pipes are passed as fds 3, 4 and 5
+    int ring_fd = -1;
+    int notify_pipe[2] = {-1, -1};
+    int wait_pipe[2] = {-1, -1};
+    void* ring_map = NULL;
+    size_t ring_map_size = RING_HEADER_SIZE + cfg_ring_size;
+    if (cfg_ring_size > 0) {
+        char path[sizeof(dir) + 8];
+        snprintf(path, sizeof(path), "%s/ring", dir);
+        ring_fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (ring_fd < 0 || unlink(path) < 0 || ftruncate(ring_fd, ring_map_size) < 0 ||
+                pipe(notify_pipe) < 0 || pipe(wait_pipe) < 0) {
+            perror("Failed to create a ring");
+            return 1;
+        }
+        ring_map = mmap(NULL, ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+        if (ring_map == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(wait_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        dup2(cmd_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        close(cmd_pipe[0]);
+        close(cmd_pipe[1]);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        if (cfg_ring_size > 0) {
+            // Move the fds out of the way before placing them at 3, 4 and 5
+            int fds[3] = { ring_fd, notify_pipe[1], wait_pipe[0] };
+            for (int i = 0; i < 3; i++) {
+                fds[i] = fcntl(fds[i], F_DUPFD, 16);
+            }
+            for (int i = 0; i < 3; i++) {
+                dup2(fds[i], 3 + i);
+                close(fds[i]);
+            }
+        }
+        char** args = calloc(argc - optind + 16, sizeof(char*));
+        int n = 0;
+        args[n++] = (char*) cfg_exe;
+        args[n++] = "--host";
+        args[n++] = dir;
+        args[n++] = "--port";
+        args[n++] = BENCH_PORT;
+        args[n++] = "--slot";
+        args[n++] = "bench";
+        args[n++] = cfg_binary_header ? "--binary-header" : "--write-header";
+        if (cfg_binary_commands) {
+            args[n++] = "--binary-commands";
+        }
+        if (cfg_compress) {
+            args[n++] = "--compress";
+            args[n++] = "lz4";
+        }
+        if (cfg_ring_size > 0) {
+            args[n++] = "--ring";
+            args[n++] = "3,4,5";
+        }
+        if (cfg_verbose) {
+            args[n++] = "--verbose";
+        }
+        for (int i = optind; i < argc; i++) {
+            args[n++] = argv[i];
+        }
+        execv(cfg_exe, args);
+        perror(cfg_exe);
+        _exit(127);
+    }
+    close(cmd_pipe[0]);
+    close(out_pipe[1]);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pthread_create(&ws.thread, NULL, walsenderMain, &ws) != 0) {
+        perror("pthread_create");
+        return 1;
+    }
+
+    struct Consumer c;
+    memset(&c, 0, sizeof(c));
+    c.out_fd = out_pipe[0];
+    c.cmd_fd = cmd_pipe[1];
+    if (ring_map != NULL) {
+        c.ring = ring_map;
+        c.ring_data = (char*) ring_map + RING_HEADER_SIZE;
+        c.notify_fd = notify_pipe[0];
+        c.wait_fd = wait_pipe[1];
+        close(notify_pipe[1]);
+        close(wait_pipe[0]);
+        close(ring_fd);
+        // pg_logical_cdc sets the magic when the ring is ready
+        while (__atomic_load_n(&c.ring->magic, __ATOMIC_ACQUIRE) == 0 &&
+                waitpid(pid, NULL, WNOHANG) == 0) {
+            usleep(100);
+        }
+    }
+    int r = consume(&c);
+
+    // Wait for the server to receive feedback of the last record
+    if (r == 0) {
+        while (__atomic_load_n(&ws.acked_at, __ATOMIC_ACQUIRE) == 0 &&
+                !__atomic_load_n(&ws.failed, __ATOMIC_ACQUIRE)) {
+            if (waitpid(pid, NULL, WNOHANG) != 0) {
+                r = -1;
+                break;
+            }
+            usleep(100);
+        }
+    }
+
+    // Quit pg_logical_cdc
+    if (write(c.cmd_fd, "q\n", 2) < 0) {
+        // already exited
+    }
+    close(c.cmd_fd);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    // Wake up accept(2) if pg_logical_cdc exited without connecting
+    shutdown(ws.listen_fd, SHUT_RDWR);
+    pthread_join(ws.thread, NULL);
+    close(out_pipe[0]);
+    if (ring_map != NULL) {
+        munmap(ring_map, ring_map_size);
+        close(notify_pipe[0]);
+        close(wait_pipe[1]);
+    }
+    if (ws.fd >= 0) close(ws.fd);
+    close(ws.listen_fd);
+    char path[sizeof(dir) + 32];
+    snprintf(path, sizeof(path), "%s/.s.PGSQL.%s", dir, BENCH_PORT);
+    unlink(path);
+    rmdir(dir);
+
+    if (r < 0 || ws.failed) {
+        fprintf(stderr, "Benchmark failed (pg_logical_cdc exit status %d)\n",
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return 1;
+    }
+
+    double elapsed = (c.finished_at - ws.started_at) / 1000000.0;
+    printf("records:          %ld x %zu bytes\n", c.records, cfg_size);
+    printf("elapsed:          %.3f s\n", elapsed);
+    printf("records/s:        %.0f\n", c.records / elapsed);
+    printf("output MB/s:      %.1f\n", c.bytes / elapsed / 1000000.0);
+    if (cfg_compress) {
+        printf("decompressed MB/s: %.1f (ratio %.2f)\n", c.plain_bytes / elapsed / 1000000.0,
+                c.bytes > 0 ? (double) c.plain_bytes / c.bytes : 0.0);
+    }
+    printf("feedback msgs:    %ld\n", ws.feedback_count);
+    printf("last ack latency: %.3f ms\n", (ws.acked_at - c.finished_at) / 1000.0);
+    return 0;
+}
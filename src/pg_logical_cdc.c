@@ -9,10 +9,25 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/select.h>
 #include <signal.h>
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
 #include <libpq-fe.h>
 #include <getopt.h>
 
@@ -20,8 +35,92 @@
 #define SQLSTATE_ERRCODE_UNDEFINED_OBJECT "42704"
 #define SQLSTATE_ERRCODE_DUPLICATE_OBJECT "42710"
 
-#define OUT_BUFSIZ (32*1024)
-#define CMD_BUFSIZ (4096)
+#define OUT_BUFSIZ (256*1024)
+#define OUT_IOVCNT (512)
+#define OUT_HEADER_MAX (64)
+
+// Compressed frames written by --compress
+#define COMPRESS_FRAME_HEADER_SIZE (8 + 8 + 4 + 4 + 4 + 4)
+#define COMPRESS_METHOD_STORED (0)
+#define COMPRESS_METHOD_LZ4 (1)
+#define COMPRESS_LEVEL_MAX (12)
+#define COMPRESS_BLOCK_MAX (64*1024*1024)
+#define LZ4_HASH_BITS (16)
+#define LZ4_WINDOW (65536)
+#define LZ4_MIN_MATCH (4)
+#define LZ4_LAST_LITERALS (5)  // a block ends with literals
+#define LZ4_MATCH_SAFE (12)    // a match starts at least this before the end
+
+// Disk spill area of --spill
+#define SPILL_SEGMENT_SIZE (16*1024*1024)
+#define SPILL_SIZE_DEFAULT (1024UL*1024*1024)
+#define SPILL_SPARE_SEGMENTS (2)  // drained segments kept for reuse
+
+// Line of "%X/%X" padded with spaces, written by --checkpoint. A write
+// this small doesn't straddle a disk sector, so a crash can't tear it.
+#define CHECKPOINT_SIZE (32)
+
+// Binary frame header written by --binary-header
+#define FRAME_HEADER_SIZE (8 + 8 + 8 + 4 + 4)
+#define FRAME_FLAG_NL (1U << 0)  // record is followed by a new line
+#define FRAME_FLAG_RESTART (1U << 1)  // restart marker written by --reconnect
+
+#define SLOT_LOCK_CLASS_ID "1886151523"  // first key of --slot-lock advisory locks ("pglc")
+
+#define RECONNECT_BACKOFF_MIN (10)    // milliseconds
+#define RECONNECT_BACKOFF_MAX (1000)  // milliseconds
+
+#define JSON_DEPTH_MAX (256)
+#define CMD_BUFSIZ (64*1024)  // power of 2 and a multiple of CMD_FRAME_SIZE
+#define CMD_LINE_MAX (4096)
+
+// Binary command frame read by --binary-commands
+#define CMD_FRAME_SIZE (8 + 8)
+#define EVENT_SOURCES_MAX (32)
+
+// Event bits reported by waitEvents
+#define EVENT_PQ   (1U << 0)
+#define EVENT_CMD  (1U << 1)
+#define EVENT_RING (1U << 2)
+#define EVENT_OUT  (1U << 3)  // an output with spooled data is writable
+#define EVENT_FEEDBACK_TIMER (1U << 30)  // internal to waitEvents
+#define EVENT_STATUS_TIMER   (1U << 31)  // internal to waitEvents
+
+#define NO_DEADLINE INT64_MAX
+
+// Histograms of the stats command keep values below HISTOGRAM_SUB_BUCKETS
+// exactly and larger values with 5 significant bits (~3% error)
+#define HISTOGRAM_SUB_BITS (5)
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+#define STATS_WRITES_MAX (1024)
+#define STATS_LINE_MAX (2048)
+#define METRICS_SIZE_MAX (8192)
+
+// Shared memory ring written by --ring
+#define RING_MAGIC (0x52434c50U)  // "PLCR" in little endian
+#define RING_VERSION (1)
+#define RING_HEADER_SIZE (4096)
+#define RING_CACHE_LINE (64)
+
+#define SHARDS_MAX (8)
+#define EVENT_SHARD(i) (1U << (8 + (i)))
+#define SHARD_KEEPALIVE_REQUEST_INTERVAL (20)  // milliseconds
+#define SHARD_BUFFER_MAX (64 * 1024 * 1024)  // bytes of complete transactions
+
+#define PARTITIONS_MAX (8)
+#define EVENT_PARTITION(i) (1U << (16 + (i)))
+
+// Actions of change records selected by --filter-actions
+#define FILTER_ACTION_INSERT   (1U << 0)
+#define FILTER_ACTION_UPDATE   (1U << 1)
+#define FILTER_ACTION_DELETE   (1U << 2)
+#define FILTER_ACTION_TRUNCATE (1U << 3)
+#define FILTER_ACTION_ALL      (0xfU)
+
+// FNV-1a hash of the partition key and filtered table names
+#define FNV_OFFSET_BASIS (0xcbf29ce484222325ULL)
+#define FNV_PRIME (0x100000001b3ULL)
 
 struct ConfigParams {
     int count;
@@ -35,12 +134,494 @@ struct QueryBuffer {
     size_t bufsiz;
 };
 
+typedef enum {
+    TRANSCODE_NONE,
+    TRANSCODE_MSGPACK,
+    TRANSCODE_CBOR,
+} TranscodeFormat;
+
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_LZ4,
+} CompressFormat;
+
+// Condition that makes isFeedbackNeeded send a status update
+typedef enum {
+    FEEDBACK_NONE,
+    FEEDBACK_REQUESTED,  // replyRequested of a keepalive, or before quit
+    FEEDBACK_INTERVAL,   // acknowledged LSN advanced (--feedback-interval)
+    FEEDBACK_STATUS,     // --status-interval
+    FEEDBACK_REASONS,
+} FeedbackReason;
+
+typedef enum {
+    JSON_NULL,
+    JSON_FALSE,
+    JSON_TRUE,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT,
+} JsonType;
+
+struct JsonToken {
+    JsonType type;
+    size_t start;  // offset in the document
+    size_t len;    // length in the document
+    size_t count;  // elements of an array or object, or decoded length of a string
+};
+
+struct JsonTokens {
+    struct JsonToken* tokens;
+    size_t count;
+    size_t cap;
+};
+
+struct ByteBuffer {
+    char* buf;
+    size_t len;
+    size_t cap;
+};
+
+struct Histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+};
+
+typedef enum {
+    PG_VALUE_STRING,
+    PG_VALUE_NUMBER,
+    PG_VALUE_BOOL,
+} PgValueKind;
+
+struct PgColumn {
+    bool key;  // part of replica identity
+    PgValueKind kind;
+    char* prefix;  // {"name":"...","type":"...","value":
+    size_t prefix_len;
+};
+
+// Relation of pgoutput cached by OID
+struct PgRelation {
+    uint32_t oid;
+    char* prefix;  // "schema":"...","table":"..."
+    size_t prefix_len;
+    int natts;
+    struct PgColumn* columns;
+    bool has_key;  // some columns are part of replica identity
+};
+
+struct PgReader {
+    const char* p;
+    const char* end;
+    bool error;
+};
+
+// Streamed in-progress transactions of --pgoutput-streaming. Records of
+// a stream block are written with ack_lsn instead of their own LSN, so
+// that F commands don't go past the last transaction that ended.
+struct PgStream {
+    bool active;      // between Stream Start and Stream Stop
+    uint32_t xid;     // top-level transaction of the block
+    int64_t ack_lsn;  // highest LSN of messages outside stream blocks
+};
+
+// Open addressing hash table keyed by OID
+struct OidMap {
+    uint32_t* keys;  // 0 is empty
+    void** values;
+    size_t count;
+    size_t cap;  // power of 2
+};
+
+// Rows written by one flush, waiting for an acknowledgement
+struct WrittenBatch {
+    int64_t last_wal_pos;
+    int64_t written_at;
+    uint32_t rows;
+};
+
+// A record written with --unordered-feedback or --partition and not
+// acknowledged yet
+struct InflightRecord {
+    int64_t lsn;
+    uint64_t prev;     // sequence + 1 of the previous record in the same hash bucket
+    uint32_t pending;  // acknowledgements still needed
+};
+
+// Records written with --unordered-feedback or --partition, indexed by
+// sequence number modulo cap. With --unordered-feedback, an F command
+// acknowledges one record found through a hash of LSNs. Records sharing a
+// LSN (e.g. tables of a pgoutput truncate) are acknowledged oldest first.
+// With --partition, a record written to all partitions needs an
+// acknowledgement from each. The flush LSN advances over the prefix of
+// acknowledged records.
+struct Inflight {
+    struct InflightRecord* records;
+    uint64_t* buckets;  // sequence + 1 of the latest record of each bucket, 0 is empty
+    size_t cap;         // power of 2, also the number of buckets
+    uint64_t head;      // oldest record not acknowledged
+    uint64_t tail;      // sequence of the next record
+    int64_t flushed_lsn;  // highest LSN of the acknowledged prefix
+};
+
+// Statistics dumped by the S command. Latencies are in microseconds.
+// Counters are never reset and are also written by --metrics.
+struct Stats {
+    struct Histogram send_to_receive;   // sendTime of XLogData to receipt
+    struct Histogram receive_to_write;  // receipt to write to the output
+    struct Histogram write_to_ack;      // write to acknowledgement by F command
+    struct Histogram byte_lag;          // walEnd - dataStart of XLogData
+    uint64_t rows;
+    uint64_t received_bytes;
+    uint64_t written_rows;
+    uint64_t written_bytes;  // before --compress
+    uint64_t keepalives;
+    uint64_t feedbacks[FEEDBACK_REASONS];
+    uint64_t wakeups;        // returns of waitEvents
+    int64_t wait_time;       // in waitEvents
+    int64_t flush_time;      // writing output batches
+    int64_t wal_end;       // latest walEnd of XLogData or keepalive messages
+    int64_t received_lsn;
+    int64_t acked_lsn;
+    int64_t flushed_lsn;   // flushLSN of the last status update
+    struct WrittenBatch writes[STATS_WRITES_MAX];  // ring buffer
+    size_t writes_head;
+    size_t writes_count;
+};
+
+// Hash chains of the LZ4 compressor. Positions are counted from base
+// which moves forward every block, so that tables aren't cleared.
+struct Lz4State {
+    uint32_t* head;   // last position of each hash
+    uint16_t* chain;  // distance to the previous position with the same hash
+    uint32_t base;    // position of the current block
+};
+
+// Segment of the --spill area: a preallocated file mapped to memory.
+// Segments are appended and drained in order, and recycled as soon as
+// they are drained since nothing reads them again.
+struct SpillSegment {
+    int fd;
+    char* map;
+    size_t len;      // bytes appended
+    size_t drained;  // bytes written to the output
+};
+
+// Spool of an output on disk, used after the in-memory spool has --spool
+// bytes
+struct Spill {
+    struct SpillSegment* segs;       // in use, oldest first
+    int nsegs;
+    struct SpillSegment* free_segs;  // recycled, up to SPILL_SPARE_SEGMENTS
+    int nfree;
+    int cap;          // entries allocated to each array
+    size_t pending;   // bytes not drained yet
+};
+
+// Batch of output data written by one writev(2) call. Payloads are not
+// copied; iovecs point into buffers returned by PQgetCopyData or the
+// CopyData reader which are kept in bufs and released after the batch is
+// written. Headers and transcoded records are stored in data, and their
+// iovecs hold offsets until the batch is written because data may be
+// reallocated.
+struct OutBatch {
+    int fd;
+    struct iovec* iov;
+    bool* iov_in_data;
+    int iovcnt;
+    size_t bytes;
+    char** bufs;
+    int bufcnt;
+    struct ByteBuffer data;
+    int64_t* receive_times;  // of rows in the batch
+    int rowcnt;
+    int64_t last_wal_pos;
+    int64_t min_wal_pos;      // of rows in the batch
+    int64_t max_wal_pos;
+    struct ByteBuffer raw;    // batch data to be compressed (--compress)
+    struct ByteBuffer spool;  // written data the fd didn't accept (--spool)
+    size_t spool_head;        // offset of unwritten data in spool
+    struct Spill spill;       // data behind the spool (--spill)
+};
+
+// Header of the shared memory ring at the beginning of the --ring file.
+// Data area follows at RING_HEADER_SIZE. Positions are total bytes
+// written or consumed since the ring was created; they never wrap and
+// the offset in the data area is position % capacity. Fields written by
+// pg_logical_cdc and by the consumer are on separate cache lines.
+struct RingHeader {
+    uint32_t magic;             // set when the ring is ready
+    uint32_t version;
+    uint64_t capacity;          // size of the data area
+    char pad0[RING_CACHE_LINE - 16];
+    uint64_t write_pos;         // written by pg_logical_cdc
+    char pad1[RING_CACHE_LINE - 8];
+    uint64_t read_pos;          // written by the consumer
+    int64_t ack_lsn;            // written by the consumer
+    char pad2[RING_CACHE_LINE - 16];
+    uint32_t consumer_waiting;  // consumer is waiting on the notify fd
+    uint32_t producer_waiting;  // pg_logical_cdc is waiting on the wait fd
+};
+
+struct Ring {
+    struct RingHeader* header;
+    char* data;
+    uint64_t capacity;
+    size_t map_size;
+    int notify_fd;  // written to wake up the consumer
+    int wait_fd;    // written by the consumer to wake up pg_logical_cdc
+    int64_t last_ack_lsn;
+    struct ByteBuffer backlog;  // output the ring didn't have space for
+    size_t backlog_head;        // offset of data not copied to the ring
+};
+
+#ifdef USE_IO_URING
+#define URING_ENTRIES (64)
+#define URING_WRITE (1ULL << 63)  // user_data of output writes
+
+// io_uring(7) instance of --io-uring. The rings are mapped with raw system
+// calls since liburing isn't required.
+struct Uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pos;    // tail including SQEs not submitted yet
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    uint32_t loop_id;   // of the current event loop
+    uint64_t deferred[EVENT_SOURCES_MAX];  // polls completed while writing
+    int deferred_count;
+};
+#endif
+
+#define COPY_CHUNK_SIZE (1024*1024)
+#define COPY_READ_SIZE (64*1024)     // minimum free space for a read
+#define COPY_MESSAGE_MAX (0x40000000)
+
+// Buffer of the CopyData reader (--direct-read) holding received messages
+struct CopyChunk {
+    struct CopyChunk* next;
+    size_t size;
+    int views;  // rows not released by freeRowBuffer
+    char data[];
+};
+
+typedef enum {
+    COPY_WHOLE,        // a complete message
+    COPY_FIRST_PIECE,  // XLogData header and the payload received so far
+    COPY_NEXT_PIECE,   // payload following the previous piece
+} CopyPiece;
+
+struct CopyReader {
+    int fd;                     // -1 unless the reader receives the stream
+    struct CopyChunk* chunk;    // receiving messages
+    size_t start;               // first byte not parsed in chunk
+    size_t end;                 // end of received bytes in chunk
+    size_t need;                // bytes from start to complete a message
+    struct CopyChunk* retired;  // chunks with views not released
+    struct CopyChunk* spare;    // chunks to reuse
+    bool lost;                  // the connection is closed or failed
+    CopyPiece piece;            // of the last returned message
+    size_t stream_left;         // payload bytes of the piece not returned yet
+    char sqlstate[6];
+    char error[256];
+};
+
+// XLogData message written in pieces (--stream-threshold)
+struct StreamedRow {
+    int64_t wal_pos;
+    int64_t wal_end;
+    int64_t receive_time;
+};
+
+// Ring buffer of command input. Positions are total bytes read or consumed;
+// the offset in buf is position % CMD_BUFSIZ. Consumed bytes are never
+// moved, and binary frames never wrap because read_pos is a multiple of
+// CMD_FRAME_SIZE.
+struct CmdBuffer {
+    char* buf;
+    size_t read_pos;   // consumed by processCommands
+    size_t scan_pos;   // no new line between read_pos and scan_pos
+    size_t write_pos;  // read from cfg_cmd_fd
+};
+
+struct EventSource {
+    int fd;
+    uint32_t event;
+    bool write;         // polled for writability
+    bool enabled;
+    bool always_ready;  // fd can't be polled (e.g. regular file)
+    bool armed;         // poll is submitted to io_uring
+};
+
+// Positions of a replication stream kept across reconnects
+struct ReplicationState {
+    int64_t last_feedback_sent_at;
+    int64_t last_sent_feedback_lsn;
+    int64_t next_feedback_lsn;  // acknowledged by the consumer
+    int64_t received_lsn;
+};
+
+// File of --checkpoint holding the LSN acknowledged by the consumer
+struct Checkpoint {
+    int fd;
+    int64_t lsn;          // written and synced
+    int64_t written_at;
+};
+
+// Waits for readability of registered file descriptors or deadlines of
+// feedback timers. Uses epoll(7) and timerfd on Linux, select(2) otherwise.
+struct EventLoop {
+    struct EventSource sources[EVENT_SOURCES_MAX];
+    int count;
+    int64_t feedback_deadline;
+    int64_t status_deadline;
+#ifdef USE_EPOLL
+    int epoll_fd;
+    int feedback_timer_fd;
+    int status_timer_fd;
+#endif
+#ifdef USE_IO_URING
+    bool uring;         // polled with s_uring instead of epoll
+    uint32_t uring_id;
+#endif
+};
+
+// A row received from a shard and not written to the output yet
+struct PendingRow {
+    char* buf;  // allocated by PQgetCopyData
+    const char* data;
+    size_t size;
+    int64_t wal_pos;
+    int64_t wal_end;
+    int64_t send_time;
+    int64_t receive_time;
+};
+
+// A transaction received from a shard. Rows of a transaction are the
+// first nrows rows in the row queue of the shard.
+struct PendingTxn {
+    int64_t commit_lsn;
+    size_t nrows;
+};
+
+// A replication connection and a slot of shard mode. Each shard decodes
+// a subset of tables and its transactions are merged by commit LSN.
+struct Shard {
+    const char* slot_name;
+    struct ConfigParams plugin_params;
+    PGconn* conn;
+    bool pq_ready;
+    bool feedback_requested;
+    int64_t received_lsn;
+    int64_t next_feedback_lsn;
+    int64_t last_sent_feedback_lsn;
+    int64_t last_feedback_sent_at;
+    // No transaction committed at or before watermark will be received
+    int64_t watermark;
+    int64_t keepalive_requested_at;
+    bool in_txn;
+    struct PendingRow* rows;  // ring buffer
+    size_t rows_head;
+    size_t rows_count;
+    size_t rows_cap;
+    size_t rows_bytes;
+    size_t open_rows;  // rows of the last incomplete transaction
+    struct PendingTxn* txns;  // ring buffer
+    size_t txns_head;
+    size_t txns_count;
+    size_t txns_cap;
+};
+
+// An output of --partition with its own command fd. seqs holds sequence
+// numbers in s_inflight of records written to the partition and not
+// acknowledged by it yet.
+struct Partition {
+    int out_fd;
+    int cmd_fd;
+    struct OutBatch out;
+    struct CmdBuffer cmd;
+    bool cmd_ready;
+    uint64_t* seqs;  // ring buffer
+    size_t seqs_head;
+    size_t seqs_count;
+    size_t seqs_cap;
+};
+
+// Filter settings of a table given by --filter-tables or --filter-columns
+struct FilterTable {
+    char* name;  // SCHEMA.TABLE
+    size_t name_len;
+    uint64_t hash;
+    bool included;  // listed by --filter-tables
+    bool exclude_columns;
+    int ncolumns;  // 0 writes all columns
+    char** columns;
+    size_t* column_lens;
+};
+
+// Filter of format-version=2 records. Tables are looked up in an open
+// addressing hash table keyed by a hash of "SCHEMA.TABLE". A B record is
+// held until a record of its transaction passes, so that a transaction
+// with no records left is dropped with its B and C records.
+struct Filter {
+    bool enabled;
+    struct FilterTable** tables;  // NULL is empty
+    size_t table_count;
+    size_t table_cap;  // power of 2
+    bool has_table_list;
+    uint32_t actions;  // FILTER_ACTION_* bits of change records to write
+    struct ByteBuffer record;  // record with projected columns
+    struct ByteBuffer begin;   // held B record
+    bool has_begin;
+    int64_t begin_wal_pos;
+    int64_t begin_wal_end;
+    int64_t begin_send_time;
+    int64_t begin_receive_time;
+    int64_t written_lsn;   // LSN of the last record written
+    bool written_acked;    // the consumer acknowledged written_lsn
+    int64_t dropped_lsn;   // highest LSN of dropped records
+};
+
 static volatile sig_atomic_t sig_abort_req = false;
 
 static int cfg_cmd_fd = STDIN_FILENO;
 static int cfg_out_fd = STDOUT_FILENO;
 static int s_cmd_fd_set_flags = 0;
-static FILE* s_out_file = NULL;
+static struct OutBatch s_out;
+static size_t cfg_spool_size = 0;
+static const char* cfg_spill_dir = NULL;
+static size_t cfg_spill_size = SPILL_SIZE_DEFAULT;
+static size_t cfg_spill_segment_size = SPILL_SEGMENT_SIZE;
+static CompressFormat cfg_compress = COMPRESS_NONE;
+static int cfg_compress_level = 1;
+static size_t cfg_compress_block = OUT_BUFSIZ;
+static struct Lz4State s_lz4;
+static struct ByteBuffer s_frame;
+static int cfg_ring_fd = -1;
+static int cfg_ring_notify_fd = -1;
+static int cfg_ring_wait_fd = -1;
+static struct Ring s_ring;
+static bool cfg_io_uring = false;
+static bool cfg_direct_read = false;
+static struct CopyReader s_reader = {.fd = -1};
+static size_t cfg_stream_threshold = 0;
+static struct StreamedRow s_streamed_row;
+#ifdef USE_IO_URING
+static struct Uring s_uring = {.fd = -1};
+#endif
 
 static bool cfg_verbose = false;
 static const char* cfg_slot_name = NULL;
@@ -54,16 +635,55 @@ static bool cfg_poll_mode = false;
 static bool cfg_poll_has_duration = false;
 static long cfg_poll_duration = 0;
 static long cfg_poll_interval = 1000;
+static bool cfg_slot_lock = false;
+static bool cfg_standby = false;
 
 static bool cfg_write_header = false;
+static bool cfg_binary_header = false;
 static bool cfg_write_nl = false;
 static bool cfg_auto_feedback = false;
+static bool cfg_unordered_feedback = false;
+static struct Inflight s_inflight;
+static TranscodeFormat cfg_transcode = TRANSCODE_NONE;
+static struct JsonTokens s_json_tokens;
+
+static bool cfg_pgoutput = false;
+static bool cfg_pgoutput_streaming = false;
+static struct PgStream s_pg_stream;
+static struct OidMap s_pg_relations;
+static struct OidMap s_pg_types;
+static struct ByteBuffer s_pg_record;
+static struct ByteBuffer s_pg_identity;
+
+static int cfg_stats_fd = STDERR_FILENO;
+static struct Stats s_stats;
+static const char* cfg_metrics_path = NULL;
+static char* s_metrics_tmp_path = NULL;
+static long cfg_metrics_interval = 5000;
+static int64_t s_metrics_written_at = 0;
+
+static struct Shard cfg_shards[SHARDS_MAX];
+static int cfg_shard_count = 0;
+
+static bool cfg_reconnect = false;
+static long cfg_reconnect_timeout = 0;
+
+static int64_t cfg_start_lsn = InvalidXLogRecPtr;
+static const char* cfg_checkpoint_path = NULL;
+static long cfg_checkpoint_interval = 1000;
+static struct Checkpoint s_checkpoint = { .fd = -1 };
 
 static long cfg_standby_message_interval = 5000;
 static long cfg_feedback_interval = 0;
 
-static char* s_cmdbuf = NULL;
-static size_t s_cmdbf_len = 0;
+static bool cfg_binary_commands = false;
+static struct CmdBuffer s_cmd;
+
+static struct Filter cfg_filter = { .actions = FILTER_ACTION_ALL, .written_acked = true };
+
+static struct Partition cfg_partitions[PARTITIONS_MAX];
+static int cfg_partition_count = 0;
+static bool cfg_partition_key = false;
 
 typedef enum {
     ECODE_SUCCESS        = 0,
@@ -153,337 +773,6619 @@ static void setupSignalHandlers(void)
     signal(SIGINT, sigintHandler);
 }
 
-static int writeRow(
-        int64_t wal_pos, int64_t wal_end, int64_t send_time,
-        const char* data, size_t size)
+static void initByteBuffer(struct ByteBuffer* bb, size_t cap)
 {
-    int r;
+    bb->buf = malloc(cap);
+    bb->len = 0;
+    bb->cap = cap;
+}
 
-    if (cfg_write_header) {
-        r = fprintf(s_out_file, "w %X/%X %lu\n",
-                (uint32_t) (wal_pos >> 32), (uint32_t) wal_pos,
-                size + (cfg_write_nl ? 1 : 0));
-        if (r < 0) {
-            return -1;
+// Returns a pointer to write size bytes at the end of the buffer. Caller
+// adds the written length to len.
+static char* reserveByteBuffer(struct ByteBuffer* bb, size_t size)
+{
+    if (bb->len + size > bb->cap) {
+        size_t new_cap = bb->cap * 2;
+        while (new_cap < bb->len + size) {
+            new_cap *= 2;
         }
+        bb->buf = realloc(bb->buf, new_cap);
+        bb->cap = new_cap;
     }
+    return bb->buf + bb->len;
+}
 
-    r = fwrite(data, 1, size, s_out_file);
-    if (r < size) {
-        return -1;
-    }
+static void appendBytes(struct ByteBuffer* bb, const char* data, size_t len)
+{
+    memcpy(reserveByteBuffer(bb, len), data, len);
+    bb->len += len;
+}
 
-    if (cfg_write_nl) {
-        r = fputc('\n', s_out_file);
-        if (r == EOF) {
-            return -1;
-        }
+// Skips len written bytes of iov
+static void advanceIov(struct iovec** iov, int* iovcnt, size_t len)
+{
+    // skip fully written iovecs then adjust the partially written one
+    while (*iovcnt > 0 && len >= (*iov)->iov_len) {
+        len -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char*) (*iov)->iov_base + len;
+        (*iov)->iov_len -= len;
     }
-
-    return 0;
 }
 
-static int flushOut()
+////
+// Statistics
+//
+
+static int histogramIndex(uint64_t v)
 {
-    int r = fflush(s_out_file);
-    if (r == EOF) {
-        return -1;
+    if (v < HISTOGRAM_SUB_BUCKETS) {
+        return (int) v;
     }
-    return 0;
+    int shift = 63 - __builtin_clzll(v) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int) ((v >> shift) - HISTOGRAM_SUB_BUCKETS);
 }
 
-static int processRow(char* copybuf, int buflen,
-        bool* r_feedback_requested, int64_t* r_received_lsn, int64_t* r_next_feedback_lsn)
+// Returns the highest value counted in the bucket at index
+static uint64_t histogramBucketMax(int index)
 {
-    if (copybuf[0] == 'k') {
-        // Primary keepalive message (B)
-        //   Byte1('k'), Int64, Int64, Byte1
-        if (buflen < 1 + 8 + 8 + 1) {
-            // Protocol error
-            fprintf(stderr, "streaming header too small: %d\n", buflen);
-            return -1;
-        }
-        int64_t wal_pos = fe_recvint64(&copybuf[1]);        // Int64 walEnd
-        //int64_t send_time = fe_recvint64(&copybuf[1 + 8]);  // Int64 sendTime
-        bool reply_requested = copybuf[1 + 8 + 8];          // Byte1 replyRequested
-        if (reply_requested) {
-            *r_feedback_requested = true;
-        }
-        if (*r_next_feedback_lsn == InvalidXLogRecPtr) {
-            // Sending feedback can't happen with InvalidXLogRecPtr but keepalive
-            // message is done by a feedback message.
-            // Here needs to update next_feedback_lsn so that keepalive message
-            // can be sent even when next_feedback_lsn is not set ever yet.
-            *r_next_feedback_lsn = wal_pos;
-        }
-        // OK
-        return 0;
-    }
-    else if (copybuf[0] == 'w') {
-        // XLogData (B)
-        //   Byte1('w'), Int64, Int64, Int64, ByteN
-        if (buflen < 1 + 8 + 8 + 8) {
-            // Protocol error
-            fprintf(stderr, "streaming header too small: %d\n", buflen);
-            return -1;
-        }
-        int64_t wal_pos = fe_recvint64(&copybuf[1]);            // Int64 dataStart
-        int64_t wal_end = fe_recvint64(&copybuf[1 + 8]);        // Int64 walEnd
-        int64_t send_time = fe_recvint64(&copybuf[1 + 8 + 8]);  // Int64 sendTime
-        char* data = copybuf + (1 + 8 + 8 + 8);
-        size_t size = buflen - (1 + 8 + 8 + 8);
-        int r = writeRow(wal_pos, wal_end, send_time, data, size);
-        if (r < 0) {
-            // Failed to write output
-            perror("failed to write data to output");
-            return -2;
-        }
-        if (cfg_auto_feedback && *r_next_feedback_lsn < wal_end) {
-            *r_next_feedback_lsn = wal_end;
-        }
-        if (*r_received_lsn < wal_pos) {
-            *r_received_lsn = wal_pos;
-        }
-        // OK
-        return 2;
-    }
-    else {
-        // Protocol error
-        fprintf(stderr, "unrecognized streaming header '%c', size=%d bytes\n",
-                copybuf[0], buflen);
-        return -1;
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
     }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t mantissa = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
 }
 
-static int getCmdData(void)
+static void recordHistogram(struct Histogram* h, int64_t value, uint64_t n)
 {
-    if (s_cmd_fd_set_flags) {
-        // set non-blocking flag if necessary
-        if (fcntl(cfg_cmd_fd, F_SETFL, s_cmd_fd_set_flags) < 0) {
-            return -1;
-        }
+    // Negative latencies happen if clocks of the server and the client differ
+    uint64_t v = value < 0 ? 0 : (uint64_t) value;
+    h->counts[histogramIndex(v)] += n;
+    h->count += n;
+    if (h->max < v) {
+        h->max = v;
     }
+}
 
-    int retval;
-    int len = read(cfg_cmd_fd, s_cmdbuf + s_cmdbf_len, CMD_BUFSIZ - s_cmdbf_len);
-    if (len < 0) {
-        if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK) {
-            retval = 0;  // not ready to read
-        }
-        else {
-            retval = -1;  // read error
+static uint64_t histogramPercentile(const struct Histogram* h, double percentile)
+{
+    uint64_t target = (uint64_t) (h->count * percentile / 100.0);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total += h->counts[i];
+        if (total >= target) {
+            uint64_t v = histogramBucketMax(i);
+            return v < h->max ? v : h->max;
         }
-        goto done;
     }
-    else if (len == 0) {
-        retval = -2;  // closed
-        goto done;
+    return h->max;
+}
+
+static void recordReceived(struct Stats* st, int64_t now,
+        int64_t wal_pos, int64_t wal_end, int64_t send_time, size_t size)
+{
+    recordHistogram(&st->send_to_receive, now - send_time, 1);
+    recordHistogram(&st->byte_lag, wal_end - wal_pos, 1);
+    st->rows++;
+    st->received_bytes += size;
+    if (st->wal_end < wal_end) {
+        st->wal_end = wal_end;
     }
-    else {
-        s_cmdbf_len += len;
-        retval = len;  // OK
-        goto done;
+    if (st->received_lsn < wal_pos) {
+        st->received_lsn = wal_pos;
     }
+}
 
-done:
-    if (s_cmd_fd_set_flags) {
-        // Restore flags back
-        if (fcntl(cfg_cmd_fd, F_SETFL, s_cmd_fd_set_flags | ~O_NONBLOCK) < 0) {
-            return -1;
-        }
+static void recordKeepalive(struct Stats* st, int64_t wal_end)
+{
+    st->keepalives++;
+    if (st->wal_end < wal_end) {
+        st->wal_end = wal_end;
     }
-    return retval;
 }
 
-static int processOneCommand(const char* cmd, size_t len,
-        int64_t* r_next_feedback_lsn, bool* r_quit_requested)
+static void recordWritten(struct Stats* st, int64_t now,
+        const int64_t* receive_times, int rowcnt, int64_t last_wal_pos)
 {
-    if (len == 0 || cmd[0] == '#') {
-        // NOP
-        return 0;
+    for (int i = 0; i < rowcnt; i++) {
+        recordHistogram(&st->receive_to_write, now - receive_times[i], 1);
     }
-    else if (cmd[0] == 'F') {
-        uint32_t high32;
-        uint32_t low32;
-        int r = sscanf(cmd, "F %X/%X", &high32, &low32);
-        if (r != 2) {
-            fprintf(stderr, "Invalid F command: %s\n", cmd);
-            return -1;
-        }
-        *r_next_feedback_lsn = (((int64_t) high32) << 32) | ((int64_t) low32);
-        return 0;
-    }
-    else if (cmd[0] == 'q') {
-        *r_quit_requested = true;
-        return 0;
+    st->written_rows += rowcnt;
+
+    // Batches that are never acknowledged are dropped when the ring is full
+    if (st->writes_count == STATS_WRITES_MAX) {
+        st->writes_head = (st->writes_head + 1) % STATS_WRITES_MAX;
+        st->writes_count--;
     }
-    fprintf(stderr, "Invalid command: %s\n", cmd);
-    return -1;
+    struct WrittenBatch* w = &st->writes[(st->writes_head + st->writes_count) % STATS_WRITES_MAX];
+    w->last_wal_pos = last_wal_pos;
+    w->written_at = now;
+    w->rows = rowcnt;
+    st->writes_count++;
 }
 
-static int processCommands(int64_t* r_next_feedback_lsn, bool* r_quit_requested)
+static void recordAck(struct Stats* st, int64_t acked_lsn)
 {
-    size_t pos = 0;
-
-    while (true) {
-        // find the next \n character from the pos
-        char* next_cmd_begin = s_cmdbuf + pos;
-        char* next_cmd_end = memchr(next_cmd_begin, '\n', s_cmdbf_len - pos);
-        if (next_cmd_end == NULL) {
+    int64_t now = feGetCurrentTimestamp();
+    st->acked_lsn = acked_lsn;
+    while (st->writes_count > 0) {
+        struct WrittenBatch* w = &st->writes[st->writes_head];
+        if (w->last_wal_pos > acked_lsn) {
             break;
         }
-        *next_cmd_end = '\0';
-        size_t next_cmd_len = next_cmd_end - next_cmd_begin;
-
-        int r = processOneCommand(next_cmd_begin, next_cmd_len,
-                r_next_feedback_lsn, r_quit_requested);
-        if (r < 0) {
-            return -1;
-        }
-        pos += next_cmd_len + 1;
+        recordHistogram(&st->write_to_ack, now - w->written_at, w->rows);
+        st->writes_head = (st->writes_head + 1) % STATS_WRITES_MAX;
+        st->writes_count--;
     }
+}
 
-    // bytes from 0 to pos are consumed. Move data from the pos
-    // to remove consumed data.
-    memmove(s_cmdbuf, s_cmdbuf + pos, s_cmdbf_len - pos);
-    s_cmdbf_len -= pos;
-
-    return 0;
+static void recordFeedback(struct Stats* st, FeedbackReason reason, int64_t flushed_lsn)
+{
+    st->feedbacks[reason]++;
+    st->flushed_lsn = flushed_lsn;
 }
 
-static int sendFeedback(PGconn* conn, int64_t now, int64_t received_lsn, int64_t next_feedback_lsn)
+static int formatHistogram(char* p, size_t size, const char* name, const struct Histogram* h)
 {
-    if (received_lsn < next_feedback_lsn) {
-        received_lsn = next_feedback_lsn;
-    }
+    return snprintf(p, size, " %s=count:%llu,p50:%llu,p90:%llu,p99:%llu,p999:%llu,max:%llu",
+            name, (unsigned long long) h->count,
+            (unsigned long long) histogramPercentile(h, 50.0),
+            (unsigned long long) histogramPercentile(h, 90.0),
+            (unsigned long long) histogramPercentile(h, 99.0),
+            (unsigned long long) histogramPercentile(h, 99.9),
+            (unsigned long long) h->max);
+}
 
-    if (cfg_verbose) {
-        fprintf(stderr, "Sending feedback: write_LSN=%X/%X flush_LSN=%X/%X\n",
-                (uint32_t) (received_lsn >> 32),
-                (uint32_t) received_lsn,
-                (uint32_t) (next_feedback_lsn >> 32),
-                (uint32_t) next_feedback_lsn);
+// Writes a stats line to cfg_stats_fd then resets histograms so that the
+// next line shows latencies since this one.
+static int writeStats(struct Stats* st)
+{
+    char line[STATS_LINE_MAX];
+    size_t len = 0;
+
+    int64_t unacked = st->acked_lsn == InvalidXLogRecPtr ? 0 : st->wal_end - st->acked_lsn;
+    len += snprintf(line + len, sizeof(line) - len,
+            "S rows=%llu wal_end=%X/%X received=%X/%X acked=%X/%X unacked_bytes=%lld",
+            (unsigned long long) st->rows,
+            (uint32_t) (st->wal_end >> 32), (uint32_t) st->wal_end,
+            (uint32_t) (st->received_lsn >> 32), (uint32_t) st->received_lsn,
+            (uint32_t) (st->acked_lsn >> 32), (uint32_t) st->acked_lsn,
+            (long long) (unacked < 0 ? 0 : unacked));
+    len += formatHistogram(line + len, sizeof(line) - len, "send_to_receive_us", &st->send_to_receive);
+    len += formatHistogram(line + len, sizeof(line) - len, "receive_to_write_us", &st->receive_to_write);
+    len += formatHistogram(line + len, sizeof(line) - len, "write_to_ack_us", &st->write_to_ack);
+    len += formatHistogram(line + len, sizeof(line) - len, "byte_lag", &st->byte_lag);
+    line[len++] = '\n';
+
+    memset(&st->send_to_receive, 0, sizeof(st->send_to_receive));
+    memset(&st->receive_to_write, 0, sizeof(st->receive_to_write));
+    memset(&st->write_to_ack, 0, sizeof(st->write_to_ack));
+    memset(&st->byte_lag, 0, sizeof(st->byte_lag));
+
+    const char* p = line;
+    while (len > 0) {
+        ssize_t n = write(cfg_stats_fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
     }
+    return 0;
+}
 
-    // Standby status update (F)
-    //   Byte1('r'), Int64, Int64, Int64, Int64, Byte1
-    char replybuf[1 + 8 + 8 + 8 + 8 + 1];
-    char* p = replybuf;
-    *p = 'r';                            // 'r'
-    p += 1;
-    fe_sendint64(received_lsn, p);       // Int64 writeLSN
-    p += 8;
-    fe_sendint64(next_feedback_lsn, p);  // Int64 flushLSN
-    p += 8;
-    fe_sendint64(InvalidXLogRecPtr, p);  // Int64 applyLSN
-    p += 8;
-    fe_sendint64(now, p);                // Int64 sendTime
-    p += 8;
-    *p = 0;                              // Byte1 replyRequested
+////
+// Metrics
+//
+// With --metrics FILE, counters of s_stats are written to FILE in the
+// Prometheus text format every --metrics-interval (e.g. for the textfile
+// collector of node_exporter). The file is written to FILE.tmp then
+// renamed, so that a reader never sees a partial file.
 
-    if (PQputCopyData(conn, replybuf, sizeof(replybuf)) <= 0 || PQflush(conn)) {
-        fprintf(stderr, "Failed to send a standby status update: %s\n", PQerrorMessage(conn));
-        return -1;
-    }
+static int formatMetricHelp(char* p, size_t size, const char* name, const char* type, const char* help)
+{
+    return snprintf(p, size, "# HELP pg_logical_cdc_%s %s\n# TYPE pg_logical_cdc_%s %s\n",
+            name, help, name, type);
+}
 
-    return 0;
+static int formatMetric(char* p, size_t size, const char* name, const char* type, const char* help,
+        uint64_t value)
+{
+    int n = formatMetricHelp(p, size, name, type, help);
+    return n + snprintf(p + n, size - n, "pg_logical_cdc_%s %llu\n", name, (unsigned long long) value);
 }
 
-static long feTimestampDifferenceMillis(int64_t start_time, int64_t stop_time)
+static int formatSecondsMetric(char* p, size_t size, const char* name, const char* help, int64_t usecs)
 {
-    long sec;
-    int usec;
-    feTimestampDifference(start_time, stop_time, &sec, &usec);
-    return sec * 1000L + usec / 1000;
+    int n = formatMetricHelp(p, size, name, "counter", help);
+    return n + snprintf(p + n, size - n, "pg_logical_cdc_%s %.6f\n", name, usecs / 1000000.0);
 }
 
-static bool isFeedbackNeeded(int64_t now, bool feedback_requested,
-        int64_t next_feedback_lsn, int64_t last_sent_feedback_lsn,
-        int64_t last_feedback_sent_at)
+static int writeMetrics(const struct Stats* st)
 {
-    if (next_feedback_lsn == InvalidXLogRecPtr) {
-        // Feedback can't be sent with InvalidXLogRecPtr.
+    static const char* const reasons[FEEDBACK_REASONS] = {
+        NULL, "requested", "feedback_interval", "status_interval",
+    };
+    char buf[METRICS_SIZE_MAX];
+    size_t len = 0;
+
+    len += formatMetric(buf + len, sizeof(buf) - len, "received_records_total", "counter",
+            "XLogData messages received.", st->rows);
+    len += formatMetric(buf + len, sizeof(buf) - len, "received_bytes_total", "counter",
+            "Bytes of records received.", st->received_bytes);
+    len += formatMetric(buf + len, sizeof(buf) - len, "written_records_total", "counter",
+            "Records written to the output.", st->written_rows);
+    len += formatMetric(buf + len, sizeof(buf) - len, "written_bytes_total", "counter",
+            "Bytes of headers and records written to the output before compression.", st->written_bytes);
+    len += formatMetric(buf + len, sizeof(buf) - len, "keepalives_total", "counter",
+            "Primary keepalive messages received.", st->keepalives);
+    len += formatMetricHelp(buf + len, sizeof(buf) - len, "feedbacks_total", "counter",
+            "Standby status updates sent, by the condition that triggered them.");
+    for (int i = FEEDBACK_REQUESTED; i < FEEDBACK_REASONS; i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "pg_logical_cdc_feedbacks_total{reason=\"%s\"} %llu\n",
+                reasons[i], (unsigned long long) st->feedbacks[i]);
+    }
+    len += formatMetric(buf + len, sizeof(buf) - len, "wakeups_total", "counter",
+            "Returns from waiting for events.", st->wakeups);
+    len += formatSecondsMetric(buf + len, sizeof(buf) - len, "wait_seconds_total",
+            "Time spent waiting for events.", st->wait_time);
+    len += formatSecondsMetric(buf + len, sizeof(buf) - len, "flush_seconds_total",
+            "Time spent writing output batches.", st->flush_time);
+    len += formatMetric(buf + len, sizeof(buf) - len, "wal_end_lsn", "gauge",
+            "Latest walEnd reported by the server.", (uint64_t) st->wal_end);
+    len += formatMetric(buf + len, sizeof(buf) - len, "received_lsn", "gauge",
+            "LSN of the last record received.", (uint64_t) st->received_lsn);
+    len += formatMetric(buf + len, sizeof(buf) - len, "acked_lsn", "gauge",
+            "LSN acknowledged by the consumer.", (uint64_t) st->acked_lsn);
+    len += formatMetric(buf + len, sizeof(buf) - len, "flushed_lsn", "gauge",
+            "Flush LSN of the last standby status update.", (uint64_t) st->flushed_lsn);
+    int64_t lag = st->received_lsn == InvalidXLogRecPtr ? 0 : st->wal_end - st->received_lsn;
+    len += formatMetric(buf + len, sizeof(buf) - len, "lag_bytes", "gauge",
+            "walEnd minus the LSN of the last record received.", (uint64_t) (lag < 0 ? 0 : lag));
+    int64_t unflushed = st->flushed_lsn == InvalidXLogRecPtr ? 0 : st->wal_end - st->flushed_lsn;
+    len += formatMetric(buf + len, sizeof(buf) - len, "unflushed_bytes", "gauge",
+            "walEnd minus the flush LSN of the last standby status update.",
+            (uint64_t) (unflushed < 0 ? 0 : unflushed));
+
+    int fd = open(s_metrics_tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    if (close(fd) < 0) {
+        return -1;
+    }
+    return rename(s_metrics_tmp_path, cfg_metrics_path);
+}
+
+// Writes metrics if --metrics-interval passed since the last write.
+// Failures are reported but don't stop replication.
+static void updateMetrics(int64_t now)
+{
+    if (cfg_metrics_path == NULL ||
+            !feTimestampDifferenceExceeds(s_metrics_written_at, now, cfg_metrics_interval)) {
+        return;
+    }
+    if (writeMetrics(&s_stats) < 0) {
+        fprintf(stderr, "Failed to write metrics to %s: %s\n", cfg_metrics_path, strerror(errno));
+    }
+    s_metrics_written_at = now;
+}
+
+// Writes metrics once more before exit, so that counters of the last
+// --metrics-interval aren't lost
+static void finishMetrics(void)
+{
+    if (cfg_metrics_path != NULL && writeMetrics(&s_stats) < 0) {
+        fprintf(stderr, "Failed to write metrics to %s: %s\n", cfg_metrics_path, strerror(errno));
+    }
+}
+
+// Returns when updateMetrics writes metrics next, or NO_DEADLINE
+static int64_t metricsDeadline(void)
+{
+    if (cfg_metrics_path == NULL) {
+        return NO_DEADLINE;
+    }
+    return s_metrics_written_at + cfg_metrics_interval * 1000L;
+}
+
+////
+// Unordered feedback
+//
+
+static size_t inflightBucket(const struct Inflight* in, int64_t lsn)
+{
+    return (size_t) (((uint64_t) lsn * 0x9E3779B97F4A7C15ULL) >> 32) & (in->cap - 1);
+}
+
+static void linkInflight(struct Inflight* in, uint64_t seq)
+{
+    struct InflightRecord* rec = &in->records[seq & (in->cap - 1)];
+    size_t b = inflightBucket(in, rec->lsn);
+    rec->prev = in->buckets[b];
+    in->buckets[b] = seq + 1;
+}
+
+static void initInflight(struct Inflight* in, size_t cap)
+{
+    in->records = malloc(sizeof(struct InflightRecord) * cap);
+    in->buckets = calloc(cap, sizeof(uint64_t));
+    in->cap = cap;
+    in->head = 0;
+    in->tail = 0;
+    in->flushed_lsn = InvalidXLogRecPtr;
+}
+
+static void growInflight(struct Inflight* in)
+{
+    struct Inflight old = *in;
+    initInflight(in, old.cap * 2);
+    in->head = old.head;
+    in->tail = old.tail;
+    in->flushed_lsn = old.flushed_lsn;
+    for (uint64_t seq = old.head; seq < old.tail; seq++) {
+        in->records[seq & (in->cap - 1)] = old.records[seq & (old.cap - 1)];
+        linkInflight(in, seq);
+    }
+    free(old.records);
+    free(old.buckets);
+}
+
+// Returns the sequence number of the record
+static uint64_t pushInflight(struct Inflight* in, int64_t lsn, uint32_t pending)
+{
+    if (in->tail - in->head == in->cap) {
+        growInflight(in);
+    }
+    struct InflightRecord* rec = &in->records[in->tail & (in->cap - 1)];
+    rec->lsn = lsn;
+    rec->pending = pending;
+    linkInflight(in, in->tail);
+    return in->tail++;
+}
+
+// Forgets records not acknowledged. They are written again after a restart.
+static void resetInflight(struct Inflight* in)
+{
+    in->head = in->tail;
+}
+
+// Moves head over acknowledged records. Returns true if flushed_lsn advanced.
+static bool advanceInflight(struct Inflight* in)
+{
+    int64_t flushed_lsn = in->flushed_lsn;
+    while (in->head < in->tail) {
+        struct InflightRecord* rec = &in->records[in->head & (in->cap - 1)];
+        if (rec->pending > 0) {
+            break;
+        }
+        if (flushed_lsn < rec->lsn) {
+            flushed_lsn = rec->lsn;
+        }
+        in->head++;
+    }
+    if (flushed_lsn == in->flushed_lsn) {
+        return false;
+    }
+    in->flushed_lsn = flushed_lsn;
+    return true;
+}
+
+// Acknowledges the oldest unacknowledged record at lsn. Returns true if
+// flushed_lsn advanced.
+static bool ackInflight(struct Inflight* in, int64_t lsn)
+{
+    // Chains link records from newest to oldest. Records before head are
+    // stale because head never moves back.
+    struct InflightRecord* found = NULL;
+    uint64_t link = in->buckets[inflightBucket(in, lsn)];
+    while (link != 0 && link - 1 >= in->head) {
+        struct InflightRecord* rec = &in->records[(link - 1) & (in->cap - 1)];
+        if (rec->lsn == lsn && rec->pending > 0) {
+            found = rec;
+        }
+        link = rec->prev;
+    }
+    if (found == NULL) {
+        if (cfg_verbose) {
+            fprintf(stderr, "F command for unknown record: %X/%X\n",
+                    (uint32_t) (lsn >> 32), (uint32_t) lsn);
+        }
         return false;
     }
-    return feedback_requested ||  // send feedback if server requests reply with 'k' message
-        (
-            // send feedback every feedback interval if next_feedback_lsn is updated
-            next_feedback_lsn != last_sent_feedback_lsn &&
-            feTimestampDifferenceExceeds(last_feedback_sent_at, now, cfg_feedback_interval)
-        ) || (
-            // send feedback every standby message interval regardless of next_feedback_lsn
-            cfg_standby_message_interval != 0 &&
-            feTimestampDifferenceExceeds(last_feedback_sent_at, now, cfg_standby_message_interval)
-        );
+    found->pending = 0;
+    return advanceInflight(in);
+}
+
+// Called with an LSN acknowledged by the consumer. Records dropped by
+// --filter-* options are confirmed after all written records are
+// acknowledged (see confirmFiltered).
+static void filterAcked(int64_t ack_lsn)
+{
+    bool all_acked = cfg_unordered_feedback || cfg_partition_count > 0 ?
+        s_inflight.head == s_inflight.tail : ack_lsn == cfg_filter.written_lsn;
+    if (all_acked) {
+        cfg_filter.written_acked = true;
+    }
+}
+
+////
+// CopyData reader
+//
+// With --direct-read, START_REPLICATION is sent and the replication stream
+// is parsed on the socket of the connection instead of by libpq.
+// PQgetCopyData allocates and copies every message; the reader receives
+// messages into large chunks and passes rows on as views into them. A
+// chunk is reused after all its rows are released by freeRowBuffer.
+// Encrypted connections are left to libpq.
+//
+
+static bool inCopyChunk(const struct CopyChunk* c, const char* p)
+{
+    return (uintptr_t) p - (uintptr_t) c->data < c->size;
+}
+
+static struct CopyChunk* allocCopyChunk(struct CopyReader* rd, size_t size)
+{
+    struct CopyChunk* c;
+    if (size <= COPY_CHUNK_SIZE && rd->spare != NULL) {
+        c = rd->spare;
+        rd->spare = c->next;
+    }
+    else {
+        if (size < COPY_CHUNK_SIZE) {
+            size = COPY_CHUNK_SIZE;
+        }
+        c = malloc(sizeof(struct CopyChunk) + size);
+        c->size = size;
+    }
+    c->next = NULL;
+    c->views = 0;
+    return c;
+}
+
+// Keeps a chunk without views for reuse. Chunks grown for a large message
+// are freed.
+static void releaseCopyChunk(struct CopyReader* rd, struct CopyChunk* c)
+{
+    if (c->size == COPY_CHUNK_SIZE) {
+        c->next = rd->spare;
+        rd->spare = c;
+    }
+    else {
+        free(c);
+    }
+}
+
+// Releases a row buffer returned by PQgetCopyData or the CopyData reader
+static void freeRowBuffer(char* buf)
+{
+    struct CopyReader* rd = &s_reader;
+    if (rd->chunk != NULL && inCopyChunk(rd->chunk, buf)) {
+        rd->chunk->views--;
+        return;
+    }
+    for (struct CopyChunk** pc = &rd->retired; *pc != NULL; pc = &(*pc)->next) {
+        struct CopyChunk* c = *pc;
+        if (inCopyChunk(c, buf)) {
+            if (--c->views == 0) {
+                *pc = c->next;
+                releaseCopyChunk(rd, c);
+            }
+            return;
+        }
+    }
+    PQfreemem(buf);
+}
+
+// Starts reading the stream of a new connection from fd, or stops reading
+// if fd is -1. Data of the previous connection is discarded but its rows
+// stay valid until they are released. The last error is kept.
+static void resetCopyReader(struct CopyReader* rd, int fd)
+{
+    struct CopyChunk* c = rd->chunk;
+    if (c != NULL) {
+        if (c->views == 0) {
+            releaseCopyChunk(rd, c);
+        }
+        else {
+            c->next = rd->retired;
+            rd->retired = c;
+        }
+        rd->chunk = NULL;
+    }
+    rd->fd = fd;
+    rd->start = 0;
+    rd->end = 0;
+    rd->need = 0;
+    rd->lost = false;
+    rd->piece = COPY_WHOLE;
+    rd->stream_left = 0;
+}
+
+// Makes room for need bytes from rd->start in the chunk. Unparsed data
+// is moved to the front of the chunk, or copied to another chunk if rows
+// in the chunk are not released yet.
+static void reserveCopyReader(struct CopyReader* rd, size_t need)
+{
+    struct CopyChunk* c = rd->chunk;
+    if (c != NULL && rd->start + need <= c->size) {
+        return;
+    }
+    size_t len = rd->end - rd->start;
+    if (c != NULL && c->views == 0 && need <= c->size) {
+        memmove(c->data, c->data + rd->start, len);
+    }
+    else {
+        struct CopyChunk* n = allocCopyChunk(rd, need);
+        if (c != NULL) {
+            memcpy(n->data, c->data + rd->start, len);
+            if (c->views == 0) {
+                releaseCopyChunk(rd, c);
+            }
+            else {
+                c->next = rd->retired;
+                rd->retired = c;
+            }
+        }
+        rd->chunk = n;
+    }
+    rd->start = 0;
+    rd->end = len;
+}
+
+static void setCopyReaderError(struct CopyReader* rd, const char* message)
+{
+    snprintf(rd->error, sizeof(rd->error), "%s\n", message);
+}
+
+// Receives data available on the socket. Returns -1 if the connection is
+// closed or failed.
+static int fillCopyReader(struct CopyReader* rd)
+{
+    if (rd->start == rd->end && rd->chunk != NULL && rd->chunk->views == 0) {
+        rd->start = 0;
+        rd->end = 0;
+    }
+    size_t need = rd->end - rd->start + COPY_READ_SIZE;
+    reserveCopyReader(rd, rd->need > need ? rd->need : need);
+
+    struct CopyChunk* c = rd->chunk;
+    while (rd->end < c->size) {
+        ssize_t len = recv(rd->fd, c->data + rd->end, c->size - rd->end, 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            setCopyReaderError(rd, strerror(errno));
+            rd->lost = true;
+            return -1;
+        }
+        if (len == 0) {
+            setCopyReaderError(rd, "server closed the connection unexpectedly");
+            rd->lost = true;
+            return -1;
+        }
+        rd->end += len;
+    }
+    return 0;
+}
+
+// Copies severity, SQLSTATE and message of an ErrorResponse or
+// NoticeResponse to rd->error and rd->sqlstate
+static void parseCopyReaderError(struct CopyReader* rd, const char* body, size_t len)
+{
+    const char* severity = "ERROR";
+    const char* message = "";
+    const char* end = body + len;
+    const char* p = body;
+    rd->sqlstate[0] = '\0';
+    while (p < end && *p != '\0') {
+        char field = *p++;
+        const char* nul = memchr(p, '\0', end - p);
+        if (nul == NULL) {
+            break;
+        }
+        if (field == 'S') {
+            severity = p;
+        }
+        else if (field == 'C') {
+            snprintf(rd->sqlstate, sizeof(rd->sqlstate), "%s", p);
+        }
+        else if (field == 'M') {
+            message = p;
+        }
+        p = nul + 1;
+    }
+    // Formatted as libpq does
+    snprintf(rd->error, sizeof(rd->error), "%s:  %s\n", severity, message);
+}
+
+// Parses the next message. Returns 1 and sets its type and body, 0 if a
+// complete message hasn't been received, or -1 on protocol errors.
+static int nextCopyReaderMessage(struct CopyReader* rd, char* r_type, char** r_body, size_t* r_len)
+{
+    size_t avail = rd->end - rd->start;
+    if (avail < 5) {
+        rd->need = 5;
+        return 0;
+    }
+    char* p = rd->chunk->data + rd->start;
+    uint32_t len;
+    memcpy(&len, p + 1, 4);
+    len = ntohl(len);
+    if (len < 4 || len > COPY_MESSAGE_MAX) {
+        setCopyReaderError(rd, "invalid message length");
+        return -1;
+    }
+    if (avail < 1 + (size_t) len) {
+        // XLogData larger than --stream-threshold is returned in pieces
+        // once its header is received, so that it needs no buffer of its
+        // size
+        size_t header = 5 + 1 + 8 + 8 + 8;
+        bool stream = p[0] == 'd' && cfg_stream_threshold > 0 && len - 4 > cfg_stream_threshold;
+        if (stream && avail >= header && p[5] == 'w') {
+            rd->start = rd->end;
+            rd->need = 0;
+            rd->piece = COPY_FIRST_PIECE;
+            rd->stream_left = len - 4 - (avail - 5);
+            *r_type = p[0];
+            *r_body = p + 5;
+            *r_len = avail - 5;
+            return 1;
+        }
+        rd->need = stream && avail < header ? header : 1 + (size_t) len;
+        return 0;
+    }
+    rd->start += 1 + (size_t) len;
+    rd->need = 0;
+    rd->piece = COPY_WHOLE;
+    *r_type = p[0];
+    *r_body = p + 5;
+    *r_len = len - 4;
+    return 1;
+}
+
+// Sends a message of type with body. Waits until the socket accepts it.
+static int sendCopyReaderMessage(struct CopyReader* rd, char type, const char* body, size_t len)
+{
+    char header[5];
+    uint32_t n = htonl((uint32_t) (len + 4));
+    header[0] = type;
+    memcpy(header + 1, &n, 4);
+    struct iovec iov[2] = {
+        { header, sizeof(header) },
+        { (void*) body, len },
+    };
+    struct iovec* next = iov;
+    int iovcnt = 2;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    while (iovcnt > 0) {
+        msg.msg_iov = next;
+        msg.msg_iovlen = iovcnt;
+        ssize_t sent = sendmsg(rd->fd, &msg, flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { rd->fd, POLLOUT, 0 };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                    setCopyReaderError(rd, strerror(errno));
+                    return -1;
+                }
+                continue;
+            }
+            setCopyReaderError(rd, strerror(errno));
+            rd->lost = true;
+            return -1;
+        }
+        advanceIov(&next, &iovcnt, (size_t) sent);
+    }
+    return 0;
+}
+
+// Receives the next CopyData message like PQgetCopyData(conn, r_buf, true).
+// Returns its length and sets r_buf to a view released by freeRowBuffer, 0
+// if a complete message hasn't been received, -1 if the stream ended, or
+// -2 on errors. rd->piece tells if the view is a piece of a message.
+static int getCopyReaderData(struct CopyReader* rd, char** r_buf)
+{
+    if (rd->stream_left > 0) {
+        size_t len = rd->end - rd->start;
+        if (len == 0) {
+            return 0;
+        }
+        if (len > rd->stream_left) {
+            len = rd->stream_left;
+        }
+        *r_buf = rd->chunk->data + rd->start;
+        rd->start += len;
+        rd->stream_left -= len;
+        rd->piece = COPY_NEXT_PIECE;
+        rd->chunk->views++;
+        return (int) len;
+    }
+    while (true) {
+        char type;
+        char* body;
+        size_t len;
+        int r = nextCopyReaderMessage(rd, &type, &body, &len);
+        if (r <= 0) {
+            return r == 0 ? 0 : -2;
+        }
+        switch (type) {
+        case 'd':  // CopyData
+            if (len == 0) {
+                continue;
+            }
+            rd->chunk->views++;
+            *r_buf = body;
+            return (int) len;
+        case 'c':  // CopyDone
+            return -1;
+        case 'E':  // ErrorResponse
+            parseCopyReaderError(rd, body, len);
+            fprintf(stderr, "%s", rd->error);
+            return -1;
+        case 'N':  // NoticeResponse
+            parseCopyReaderError(rd, body, len);
+            fprintf(stderr, "%s", rd->error);
+            continue;
+        case 'S':  // ParameterStatus
+        case 'A':  // NotificationResponse
+            continue;
+        default:
+            snprintf(rd->error, sizeof(rd->error), "unexpected message type 0x%02x\n", (unsigned char) type);
+            return -2;
+        }
+    }
+}
+
+// Sends query and waits for CopyBothResponse. Returns 0 on success. On
+// errors, returns -1 with rd->error and rd->sqlstate set, and the reader
+// is stopped.
+static int startCopyReader(struct CopyReader* rd, int fd, const char* query)
+{
+    resetCopyReader(rd, fd);
+    rd->sqlstate[0] = '\0';
+    rd->error[0] = '\0';
+    if (sendCopyReaderMessage(rd, 'Q', query, strlen(query) + 1) < 0) {
+        resetCopyReader(rd, -1);
+        return -1;
+    }
+
+    bool failed = false;
+    while (true) {
+        char type;
+        char* body;
+        size_t len;
+        int r = nextCopyReaderMessage(rd, &type, &body, &len);
+        if (r < 0) {
+            break;
+        }
+        if (r == 0) {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if ((poll(&pfd, 1, -1) < 0 && errno != EINTR) || fillCopyReader(rd) < 0) {
+                break;
+            }
+            continue;
+        }
+        if (type == 'W' && !failed) {
+            // CopyBothResponse. The stream follows.
+            return 0;
+        }
+        if (type == 'E') {
+            parseCopyReaderError(rd, body, len);
+            failed = true;
+        }
+        else if (type == 'Z') {
+            // ReadyForQuery. libpq can run queries again.
+            break;
+        }
+    }
+    if (!failed && rd->error[0] == '\0') {
+        setCopyReaderError(rd, "unexpected response to START_REPLICATION");
+    }
+    resetCopyReader(rd, -1);
+    return -1;
+}
+
+static bool isDirectRead(PGconn* conn)
+{
+    return s_reader.fd >= 0 && s_reader.fd == PQsocket(conn);
+}
+
+// Receives data of the replication stream like PQconsumeInput. Returns 0
+// on errors.
+static int consumeCopyInput(PGconn* conn)
+{
+    if (isDirectRead(conn)) {
+        return fillCopyReader(&s_reader) == 0;
+    }
+    return PQconsumeInput(conn);
+}
+
+// Receives a CopyData message like PQgetCopyData(conn, r_buf, true).
+// r_buf is released by freeRowBuffer.
+static int getCopyData(PGconn* conn, char** r_buf)
+{
+    if (isDirectRead(conn)) {
+        return getCopyReaderData(&s_reader, r_buf);
+    }
+    return PQgetCopyData(conn, r_buf, true);
+}
+
+static const char* copyErrorMessage(PGconn* conn)
+{
+    return isDirectRead(conn) ? s_reader.error : PQerrorMessage(conn);
+}
+
+static void initOutBatch(struct OutBatch* ob, int fd)
+{
+    ob->fd = fd;
+    ob->iov = malloc(sizeof(struct iovec) * OUT_IOVCNT);
+    ob->iov_in_data = malloc(sizeof(bool) * OUT_IOVCNT);
+    ob->iovcnt = 0;
+    ob->bytes = 0;
+    ob->bufs = malloc(sizeof(char*) * OUT_IOVCNT);
+    ob->bufcnt = 0;
+    initByteBuffer(&ob->data, OUT_HEADER_MAX * OUT_IOVCNT);
+    ob->receive_times = malloc(sizeof(int64_t) * OUT_IOVCNT);
+    ob->rowcnt = 0;
+    if (cfg_spool_size > 0) {
+        initByteBuffer(&ob->spool, OUT_BUFSIZ);
+    }
+    ob->spool_head = 0;
+    memset(&ob->spill, 0, sizeof(ob->spill));
+    if (cfg_compress != COMPRESS_NONE) {
+        initByteBuffer(&ob->raw, OUT_BUFSIZ);
+    }
+}
+
+static void releaseOutBatch(struct OutBatch* ob)
+{
+    for (int i = 0; i < ob->bufcnt; i++) {
+        freeRowBuffer(ob->bufs[i]);
+    }
+    ob->iovcnt = 0;
+    ob->bytes = 0;
+    ob->bufcnt = 0;
+    ob->data.len = 0;
+    ob->rowcnt = 0;
+    ob->min_wal_pos = InvalidXLogRecPtr;
+    ob->max_wal_pos = InvalidXLogRecPtr;
+    ob->raw.len = 0;
+}
+
+static void appendOutBatch(struct OutBatch* ob, const char* data, size_t size)
+{
+    ob->iov[ob->iovcnt].iov_base = (void*) data;
+    ob->iov[ob->iovcnt].iov_len = size;
+    ob->iov_in_data[ob->iovcnt] = false;
+    ob->iovcnt++;
+    ob->bytes += size;
+}
+
+// Appends size bytes at offset of ob->data
+static void appendOutBatchData(struct OutBatch* ob, size_t offset, size_t size)
+{
+    ob->iov[ob->iovcnt].iov_base = (void*) (uintptr_t) offset;
+    ob->iov[ob->iovcnt].iov_len = size;
+    ob->iov_in_data[ob->iovcnt] = true;
+    ob->iovcnt++;
+    ob->bytes += size;
+}
+
+static char* putLE32(char* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        *p++ = (char) (v >> (i * 8));
+    }
+    return p;
+}
+
+static char* putLE64(char* p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) {
+        *p++ = (char) (v >> (i * 8));
+    }
+    return p;
+}
+
+// Resolves offsets of ob->data in iovecs to pointers
+static void resolveOutBatch(struct OutBatch* ob)
+{
+    for (int i = 0; i < ob->iovcnt; i++) {
+        if (ob->iov_in_data[i]) {
+            ob->iov[i].iov_base = ob->data.buf + (uintptr_t) ob->iov[i].iov_base;
+            ob->iov_in_data[i] = false;
+        }
+    }
+}
+
+////
+// Compression
+//
+// With --compress, each output batch is written as a frame holding an LZ4
+// block (see lz4_Block_format.md of the LZ4 project). Matches are found
+// through hash chains. --compress-level sets how many candidates are
+// tried, trading speed for ratio like levels of LZ4HC.
+//
+
+static void initLz4State(struct Lz4State* st)
+{
+    st->head = calloc(1 << LZ4_HASH_BITS, sizeof(uint32_t));
+    st->chain = calloc(LZ4_WINDOW, sizeof(uint16_t));
+    st->base = 1;
+}
+
+static size_t lz4Bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+static uint32_t lz4Hash(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static void insertLz4(struct Lz4State* st, const uint8_t* src, size_t pos)
+{
+    uint32_t h = lz4Hash(src + pos);
+    uint32_t g = st->base + (uint32_t) pos;
+    uint32_t prev = st->head[h];
+    st->chain[g & (LZ4_WINDOW - 1)] =
+        (uint16_t) (prev >= st->base && g - prev < LZ4_WINDOW ? g - prev : 0);
+    st->head[h] = g;
+}
+
+// Returns the length of the common prefix of a and b up to max bytes
+static size_t lz4MatchLength(const uint8_t* a, const uint8_t* b, size_t max)
+{
+    size_t len = 0;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len + 8 <= max) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        if (x != y) {
+            return len + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        len += 8;
+    }
+#endif
+    while (len < max && a[len] == b[len]) {
+        len++;
+    }
+    return len;
+}
+
+static uint8_t* putLz4Length(uint8_t* p, size_t len)
+{
+    while (len >= 255) {
+        *p++ = 255;
+        len -= 255;
+    }
+    *p++ = (uint8_t) len;
+    return p;
+}
+
+// Writes a sequence of literals and a match. match_len is 0 for the last
+// literals of a block.
+static uint8_t* putLz4Sequence(uint8_t* p, const uint8_t* literals, size_t lit_len,
+        uint32_t offset, size_t match_len)
+{
+    uint8_t* token = p++;
+    *token = (uint8_t) ((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) {
+        p = putLz4Length(p, lit_len - 15);
+    }
+    memcpy(p, literals, lit_len);
+    p += lit_len;
+    if (match_len == 0) {
+        return p;
+    }
+    *p++ = (uint8_t) offset;
+    *p++ = (uint8_t) (offset >> 8);
+    size_t ml = match_len - LZ4_MIN_MATCH;
+    *token |= (uint8_t) (ml < 15 ? ml : 15);
+    if (ml >= 15) {
+        p = putLz4Length(p, ml - 15);
+    }
+    return p;
+}
+
+// Compresses n bytes of src to dst which has lz4Bound(n) bytes, and
+// returns the compressed size
+static size_t compressLz4(struct Lz4State* st, const uint8_t* src, size_t n, uint8_t* dst, int level)
+{
+    if ((uint64_t) st->base + n + LZ4_WINDOW > UINT32_MAX) {
+        memset(st->head, 0, sizeof(uint32_t) << LZ4_HASH_BITS);
+        st->base = 1;
+    }
+    int attempts = 1 << (level - 1);
+    uint8_t* p = dst;
+    size_t anchor = 0;
+
+    if (n > LZ4_MATCH_SAFE) {
+        size_t limit = n - LZ4_MATCH_SAFE;
+        size_t match_end = n - LZ4_LAST_LITERALS;
+        size_t ip = 0;
+        while (ip < limit) {
+            uint32_t g = st->base + (uint32_t) ip;
+            uint32_t cand = st->head[lz4Hash(src + ip)];
+            size_t best_len = 0;
+            uint32_t best_offset = 0;
+            for (int i = 0; i < attempts && cand >= st->base && g - cand < LZ4_WINDOW; i++) {
+                size_t len = lz4MatchLength(src + (cand - st->base), src + ip, match_end - ip);
+                if (len > best_len) {
+                    best_len = len;
+                    best_offset = g - cand;
+                }
+                uint16_t d = st->chain[cand & (LZ4_WINDOW - 1)];
+                if (d == 0) {
+                    break;
+                }
+                cand -= d;
+            }
+            insertLz4(st, src, ip);
+            if (best_len < LZ4_MIN_MATCH) {
+                ip++;
+                continue;
+            }
+            p = putLz4Sequence(p, src + anchor, ip - anchor, best_offset, best_len);
+            // Level 1 indexes only the end of a match like LZ4 does
+            size_t pos = level > 1 ? ip + 1 : ip + best_len - 2;
+            for (; pos < ip + best_len && pos < limit; pos++) {
+                insertLz4(st, src, pos);
+            }
+            ip += best_len;
+            anchor = ip;
+        }
+    }
+    p = putLz4Sequence(p, src + anchor, n - anchor, 0, 0);
+
+    st->base += (uint32_t) n;
+    return p - dst;
+}
+
+// Moves data of the batch to ob->raw and releases buffers of rows, so
+// that a frame can hold more rows than iovecs of a batch
+static void stageOutBatch(struct OutBatch* ob)
+{
+    resolveOutBatch(ob);
+    for (int i = 0; i < ob->iovcnt; i++) {
+        appendBytes(&ob->raw, ob->iov[i].iov_base, ob->iov[i].iov_len);
+    }
+    for (int i = 0; i < ob->bufcnt; i++) {
+        freeRowBuffer(ob->bufs[i]);
+    }
+    ob->iovcnt = 0;
+    ob->bufcnt = 0;
+    ob->data.len = 0;
+}
+
+// Compresses the batch into a frame in s_frame. Frame header (little
+// endian):
+//   UInt64 startLsn, UInt64 endLsn (lowest and highest LSN of the rows),
+//   UInt32 rows, UInt32 rawLength, UInt32 length, UInt32 method
+// followed by length bytes that decompress to rawLength bytes of the
+// output.
+static void compressOutBatch(struct OutBatch* ob, struct iovec* r_iov)
+{
+    stageOutBatch(ob);
+    size_t n = ob->raw.len;
+    s_frame.len = 0;
+    char* header = reserveByteBuffer(&s_frame, COMPRESS_FRAME_HEADER_SIZE + lz4Bound(n));
+    char* body = header + COMPRESS_FRAME_HEADER_SIZE;
+    uint32_t method = COMPRESS_METHOD_LZ4;
+    size_t len = compressLz4(&s_lz4, (const uint8_t*) ob->raw.buf, n, (uint8_t*) body, cfg_compress_level);
+    if (len >= n) {
+        // Incompressible
+        memcpy(body, ob->raw.buf, n);
+        len = n;
+        method = COMPRESS_METHOD_STORED;
+    }
+    char* p = header;
+    p = putLE64(p, (uint64_t) ob->min_wal_pos);
+    p = putLE64(p, (uint64_t) ob->max_wal_pos);
+    p = putLE32(p, (uint32_t) ob->rowcnt);
+    p = putLE32(p, (uint32_t) n);
+    p = putLE32(p, (uint32_t) len);
+    p = putLE32(p, method);
+    s_frame.len = COMPRESS_FRAME_HEADER_SIZE + len;
+
+    r_iov->iov_base = s_frame.buf;
+    r_iov->iov_len = s_frame.len;
+}
+
+#ifdef USE_IO_URING
+////
+// io_uring
+//
+// With --io-uring, polls of the event loop, the wait for deadlines and
+// writes of the output and partitions are submitted to one io_uring(7)
+// instance, so an io_uring_enter(2) call replaces epoll_wait(2),
+// timerfd_settime(2) and writev(2) of every fd. The replication socket
+// is read by libpq, or with --direct-read by the CopyData reader calling
+// recv(2) directly, outside io_uring.
+//
+
+static void closeUring(struct Uring* u)
+{
+    if (u->sqes != NULL) munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != NULL) munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != NULL) munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0) close(u->fd);
+    u->sqes = NULL;
+    u->cq_ring = NULL;
+    u->sq_ring = NULL;
+    u->fd = -1;
+}
+
+static int openUring(struct Uring* u)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        // Waits with a timeout require Linux 5.11
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    u->fd = fd;
+
+    // Rings are mapped separately even if the kernel supports a single
+    // mapping
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    u->sq_ring = sq_ring != MAP_FAILED ? sq_ring : NULL;
+    u->cq_ring = cq_ring != MAP_FAILED ? cq_ring : NULL;
+    u->sqes = sqes != MAP_FAILED ? sqes : NULL;
+    if (u->sq_ring == NULL || u->cq_ring == NULL || u->sqes == NULL) {
+        int saved_errno = errno;
+        closeUring(u);
+        errno = saved_errno;
+        return -1;
+    }
+
+    char* sq = u->sq_ring;
+    u->sq_head = (unsigned*) (sq + params.sq_off.head);
+    u->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    u->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->sq_pos = *u->sq_tail;
+    char* cq = u->cq_ring;
+    u->cq_head = (unsigned*) (cq + params.cq_off.head);
+    u->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    u->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    // SQEs are submitted in the order of their slots
+    unsigned* array = (unsigned*) (sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    u->loop_id = 0;
+    u->deferred_count = 0;
+    return 0;
+}
+
+// Returns a cleared SQE submitted by the next enterUring call, or NULL if
+// the submission queue is full
+static struct io_uring_sqe* getUringSqe(struct Uring* u)
+{
+    if (u->sq_pos - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        errno = EBUSY;
+        return NULL;
+    }
+    struct io_uring_sqe* sqe = &u->sqes[u->sq_pos & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_pos++;
+    return sqe;
+}
+
+// Submits queued SQEs and waits for min_complete completions or timeout
+// microseconds (-1 waits without a timeout). Returns -1 with ETIME if
+// timed out.
+static int enterUring(struct Uring* u, unsigned min_complete, int64_t timeout)
+{
+    __atomic_store_n(u->sq_tail, u->sq_pos, __ATOMIC_RELEASE);
+    unsigned to_submit = u->sq_pos - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void* argp = NULL;
+    size_t argsz = 0;
+    if (min_complete > 0 && timeout >= 0) {
+        ts.tv_sec = timeout / USECS_PER_SEC;
+        ts.tv_nsec = (timeout % USECS_PER_SEC) * 1000L;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    if (to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+    return (int) syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, argp, argsz);
+}
+
+// Pops a completion. Returns false if there is none.
+static bool popUringCqe(struct Uring* u, uint64_t* r_data, int32_t* r_res)
+{
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    const struct io_uring_cqe* cqe = &u->cqes[head & u->cq_mask];
+    *r_data = cqe->user_data;
+    *r_res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Keeps a poll completion of the current event loop for the next
+// waitEvents call
+static void deferUringPoll(struct Uring* u, uint64_t data)
+{
+    // Each source has at most one poll, so the array doesn't overflow
+    if ((uint32_t) (data >> 32) == u->loop_id && u->deferred_count < EVENT_SOURCES_MAX) {
+        u->deferred[u->deferred_count++] = data;
+    }
+}
+#endif
+
+////
+// Shared memory ring
+//
+// Output is copied to a ring in a file mapped by both pg_logical_cdc and
+// the consumer, and the consumer publishes its acknowledged LSN in the
+// header instead of sending feedback commands. Each side sets its
+// waiting flag before sleeping, and the other side writes the eventfd
+// only when the flag is set. A busy consumer costs no system calls.
+//
+
+static int openRing(struct Ring* ring, int fd, int notify_fd, int wait_fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size < RING_HEADER_SIZE * 2) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    // Wakeups must not block when an eventfd counter saturates or a pipe
+    // is full or drained
+    if (fcntl(notify_fd, F_SETFL, fcntl(notify_fd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+            fcntl(wait_fd, F_SETFL, fcntl(wait_fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    ring->header = map;
+    ring->data = (char*) map + RING_HEADER_SIZE;
+    ring->capacity = st.st_size - RING_HEADER_SIZE;
+    ring->map_size = st.st_size;
+    ring->notify_fd = notify_fd;
+    ring->wait_fd = wait_fd;
+    ring->last_ack_lsn = __atomic_load_n(&ring->header->ack_lsn, __ATOMIC_ACQUIRE);
+
+    // Positions continue from the previous run if the ring is reused
+    struct RingHeader* hdr = ring->header;
+    uint64_t read_pos = __atomic_load_n(&hdr->read_pos, __ATOMIC_ACQUIRE);
+    if (hdr->write_pos - read_pos > ring->capacity) {
+        munmap(map, st.st_size);
+        ring->header = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    hdr->version = RING_VERSION;
+    hdr->capacity = ring->capacity;
+    __atomic_store_n(&hdr->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+    initByteBuffer(&ring->backlog, OUT_BUFSIZ);
+    ring->backlog_head = 0;
+    return 0;
+}
+
+static void closeRing(struct Ring* ring)
+{
+    if (ring->header != NULL) {
+        munmap(ring->header, ring->map_size);
+        ring->header = NULL;
+        free(ring->backlog.buf);
+        ring->backlog.buf = NULL;
+    }
+}
+
+static int signalFd(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0) {
+        if (errno == EAGAIN) {
+            // eventfd counter is saturated; the reader is awake anyway
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void drainFd(int fd)
+{
+    // eventfd returns the whole counter; a pipe may have more bytes
+    uint64_t buf[16];
+    while (read(fd, buf, sizeof(buf)) == sizeof(buf)) {
+    }
+}
+
+// Makes write_pos visible to the consumer and wakes it up if it sleeps
+static int publishRing(struct Ring* ring, uint64_t write_pos)
+{
+    struct RingHeader* hdr = ring->header;
+    if (hdr->write_pos == write_pos) {
+        return 0;
+    }
+    __atomic_store_n(&hdr->write_pos, write_pos, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->consumer_waiting, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&hdr->consumer_waiting, 0, __ATOMIC_SEQ_CST)) {
+        return signalFd(ring->notify_fd);
+    }
+    return 0;
+}
+
+// Sets producer_waiting so that the consumer writes the wait fd after
+// it consumes data or publishes an acknowledged LSN.
+static void setRingWaiting(struct Ring* ring, bool waiting)
+{
+    __atomic_store_n(&ring->header->producer_waiting, waiting ? 1 : 0, __ATOMIC_SEQ_CST);
+}
+
+static bool hasRingBacklog(const struct Ring* ring)
+{
+    return ring->backlog.len > ring->backlog_head;
+}
+
+static bool hasRingSpace(struct Ring* ring)
+{
+    struct RingHeader* hdr = ring->header;
+    return hdr->write_pos - __atomic_load_n(&hdr->read_pos, __ATOMIC_SEQ_CST) < ring->capacity;
+}
+
+// Blocks until the consumer frees space. Fails with EPIPE if the command
+// fd is closed, because then the consumer has exited. Used only before
+// exit; the event loop waits for space otherwise.
+static int waitRingSpace(struct Ring* ring, uint64_t write_pos)
+{
+    struct RingHeader* hdr = ring->header;
+    while (true) {
+        setRingWaiting(ring, true);
+        uint64_t read_pos = __atomic_load_n(&hdr->read_pos, __ATOMIC_SEQ_CST);
+        if (write_pos - read_pos < ring->capacity) {
+            break;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = ring->wait_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = cfg_cmd_fd;
+        fds[1].events = 0;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (fds[1].revents & (POLLHUP | POLLERR)) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (fds[0].revents & POLLIN) {
+            drainFd(ring->wait_fd);
+        }
+    }
+    setRingWaiting(ring, false);
+    return 0;
+}
+
+// Copies up to len bytes to the ring at *r_write_pos, and returns the
+// number of bytes copied. *r_space caches free space of the ring.
+static size_t copyToRing(struct Ring* ring, uint64_t* r_write_pos, uint64_t* r_space,
+        const char* src, size_t len)
+{
+    size_t copied = 0;
+    while (copied < len) {
+        if (*r_space == 0) {
+            // Load read_pos only when cached space is used up
+            uint64_t read_pos = __atomic_load_n(&ring->header->read_pos, __ATOMIC_ACQUIRE);
+            *r_space = ring->capacity - (*r_write_pos - read_pos);
+            if (*r_space == 0) {
+                break;
+            }
+        }
+        size_t offset = *r_write_pos % ring->capacity;
+        size_t n = len - copied;
+        if (n > *r_space) n = *r_space;
+        if (n > ring->capacity - offset) n = ring->capacity - offset;
+        memcpy(ring->data + offset, src + copied, n);
+        copied += n;
+        *r_space -= n;
+        *r_write_pos += n;
+    }
+    return copied;
+}
+
+// Copies the backlog to the ring as far as the consumer freed space
+static int drainRing(struct Ring* ring)
+{
+    if (!hasRingBacklog(ring)) {
+        return 0;
+    }
+    uint64_t write_pos = ring->header->write_pos;  // written only by this process
+    uint64_t space = 0;
+    ring->backlog_head += copyToRing(ring, &write_pos, &space,
+            ring->backlog.buf + ring->backlog_head, ring->backlog.len - ring->backlog_head);
+    if (!hasRingBacklog(ring)) {
+        ring->backlog.len = 0;
+        ring->backlog_head = 0;
+    }
+    return publishRing(ring, write_pos);
+}
+
+// Copies iovecs to the ring. What the ring has no space for is kept in the
+// backlog behind earlier data, and reading the replication stream pauses
+// until the consumer frees space (see pollSpools).
+static int writeRing(struct Ring* ring, const struct iovec* iov, int iovcnt)
+{
+    if (drainRing(ring) < 0) {
+        return -1;
+    }
+    uint64_t write_pos = ring->header->write_pos;
+    uint64_t space = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t n = 0;
+        if (!hasRingBacklog(ring)) {
+            n = copyToRing(ring, &write_pos, &space, iov[i].iov_base, iov[i].iov_len);
+        }
+        if (n < iov[i].iov_len) {
+            appendBytes(&ring->backlog, (const char*) iov[i].iov_base + n, iov[i].iov_len - n);
+        }
+    }
+    return publishRing(ring, write_pos);
+}
+
+// Copies the backlog blocking. Called before exit since nobody polls the
+// wait fd anymore.
+static int finishRing(struct Ring* ring)
+{
+    while (ring->header != NULL && hasRingBacklog(ring)) {
+        if (drainRing(ring) < 0) {
+            return -1;
+        }
+        if (hasRingBacklog(ring) && waitRingSpace(ring, ring->header->write_pos) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Sets the acknowledged LSN to r_next_feedback_lsn if the consumer
+// published a new one. Returns true if it changed.
+static bool pollRingAck(struct Ring* ring, int64_t* r_next_feedback_lsn)
+{
+    int64_t ack_lsn = __atomic_load_n(&ring->header->ack_lsn, __ATOMIC_ACQUIRE);
+    if (ack_lsn == ring->last_ack_lsn) {
+        return false;
+    }
+    ring->last_ack_lsn = ack_lsn;
+    *r_next_feedback_lsn = ack_lsn;
+    recordAck(&s_stats, ack_lsn);
+    filterAcked(ack_lsn);
+    return true;
+}
+
+// Prepares to sleep in waitEvents. Returns false if the consumer
+// published an acknowledged LSN or freed space for the backlog meanwhile
+// and the caller shouldn't sleep.
+static bool enterRingWait(struct Ring* ring, int64_t* r_next_feedback_lsn)
+{
+    setRingWaiting(ring, true);
+    if (pollRingAck(ring, r_next_feedback_lsn) || (hasRingBacklog(ring) && hasRingSpace(ring))) {
+        setRingWaiting(ring, false);
+        return false;
+    }
+    return true;
+}
+
+static void leaveRingWait(struct Ring* ring, uint32_t events)
+{
+    setRingWaiting(ring, false);
+    if (events & EVENT_RING) {
+        drainFd(ring->wait_fd);
+    }
+}
+
+static size_t spooledBytes(const struct OutBatch* ob)
+{
+    return ob->spool.len - ob->spool_head;
+}
+
+static void appendSpool(struct OutBatch* ob, const void* data, size_t size)
+{
+    // Move unwritten data to the front instead of growing the buffer
+    // once more than half of it has been written
+    if (ob->spool_head > 0 && ob->spool_head * 2 >= ob->spool.len) {
+        memmove(ob->spool.buf, ob->spool.buf + ob->spool_head, spooledBytes(ob));
+        ob->spool.len -= ob->spool_head;
+        ob->spool_head = 0;
+    }
+    appendBytes(&ob->spool, data, size);
+}
+
+// Creates a segment file in --spill. The file is unlinked at once so that
+// it's removed when pg_logical_cdc exits.
+static int createSpillSegment(struct SpillSegment* seg)
+{
+    static const char name[] = "/pg_logical_cdc.spill.XXXXXX";
+    size_t path_size = strlen(cfg_spill_dir) + sizeof(name);
+    char* path = malloc(path_size);
+    snprintf(path, path_size, "%s%s", cfg_spill_dir, name);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        free(path);
+        return -1;
+    }
+    unlink(path);
+    free(path);
+
+    // Allocate blocks now. Writing a page of a sparse file mapped to
+    // memory raises SIGBUS if the disk is full.
+#ifdef __linux__
+    int r = posix_fallocate(fd, 0, cfg_spill_segment_size);
+    if (r != 0) {
+        close(fd);
+        errno = r;
+        return -1;
+    }
+#else
+    if (ftruncate(fd, cfg_spill_segment_size) < 0) {
+        close(fd);
+        return -1;
+    }
+#endif
+    void* map = mmap(NULL, cfg_spill_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    seg->fd = fd;
+    seg->map = map;
+    return 0;
+}
+
+static struct SpillSegment* addSpillSegment(struct Spill* sp)
+{
+    if (sp->nsegs + sp->nfree == sp->cap) {
+        sp->cap = sp->cap == 0 ? 8 : sp->cap * 2;
+        sp->segs = realloc(sp->segs, sizeof(struct SpillSegment) * sp->cap);
+        sp->free_segs = realloc(sp->free_segs, sizeof(struct SpillSegment) * sp->cap);
+    }
+    struct SpillSegment* seg = &sp->segs[sp->nsegs];
+    if (sp->nfree > 0) {
+        *seg = sp->free_segs[--sp->nfree];
+    }
+    else if (createSpillSegment(seg) < 0) {
+        return NULL;
+    }
+    seg->len = 0;
+    seg->drained = 0;
+    sp->nsegs++;
+    return seg;
+}
+
+static int appendSpill(struct Spill* sp, const char* data, size_t size)
+{
+    while (size > 0) {
+        struct SpillSegment* seg = sp->nsegs > 0 ? &sp->segs[sp->nsegs - 1] : NULL;
+        if (seg == NULL || seg->len == cfg_spill_segment_size) {
+            seg = addSpillSegment(sp);
+            if (seg == NULL) {
+                return -1;
+            }
+        }
+        size_t n = cfg_spill_segment_size - seg->len;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(seg->map + seg->len, data, n);
+        seg->len += n;
+        sp->pending += n;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Keeps a drained segment for reuse, or unmaps and closes it if there
+// are enough spares or they would exceed --spill-size with the segments
+// in use
+static void releaseSpillSegment(struct Spill* sp, struct SpillSegment* seg)
+{
+    size_t live = (size_t) (sp->nsegs + sp->nfree + 1) * cfg_spill_segment_size;
+    if (sp->nfree < SPILL_SPARE_SEGMENTS && live <= cfg_spill_size) {
+        sp->free_segs[sp->nfree++] = *seg;
+        return;
+    }
+    munmap(seg->map, cfg_spill_segment_size);
+    close(seg->fd);
+}
+
+// Writes spilled data until the fd would block. Drained segments are
+// released at once, except for the last one which is still appended to.
+static int drainSpill(struct Spill* sp, int fd)
+{
+    int r = 0;
+    int n = 0;
+    for (; n < sp->nsegs && sp->pending > 0; n++) {
+        struct SpillSegment* seg = &sp->segs[n];
+        while (seg->drained < seg->len) {
+            ssize_t len = write(fd, seg->map + seg->drained, seg->len - seg->drained);
+            if (len < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    r = -1;
+                }
+                break;
+            }
+            seg->drained += len;
+            sp->pending -= len;
+        }
+        if (seg->drained < seg->len || seg->len < cfg_spill_segment_size) {
+            break;
+        }
+    }
+    if (n > 0) {
+        // nsegs is decremented first so that released segments count once
+        int nsegs = sp->nsegs;
+        sp->nsegs -= n;
+        for (int i = 0; i < n; i++) {
+            releaseSpillSegment(sp, &sp->segs[i]);
+        }
+        memmove(sp->segs, sp->segs + n, sizeof(struct SpillSegment) * (nsegs - n));
+    }
+    return r;
+}
+
+// Writes spooled data, then spilled data, until the fd would block
+static int drainSpool(struct OutBatch* ob)
+{
+    while (spooledBytes(ob) > 0) {
+        ssize_t len = write(ob->fd, ob->spool.buf + ob->spool_head, spooledBytes(ob));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        ob->spool_head += len;
+    }
+    ob->spool.len = 0;
+    ob->spool_head = 0;
+    return drainSpill(&ob->spill, ob->fd);
+}
+
+static bool hasSpooledData(const struct OutBatch* ob)
+{
+    return spooledBytes(ob) > 0 || ob->spill.pending > 0;
+}
+
+// Writes iovecs to the non-blocking fd and copies what the fd doesn't
+// accept to the spool, or to the spill once the spool has --spool bytes.
+// Data goes behind spooled data to keep the order.
+static int spoolOutBatch(struct OutBatch* ob, struct iovec* iov, int iovcnt)
+{
+    if (hasSpooledData(ob)) {
+        if (drainSpool(ob) < 0) {
+            return -1;
+        }
+    }
+    while (iovcnt > 0 && !hasSpooledData(ob)) {
+        ssize_t len = writev(ob->fd, iov, iovcnt);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        advanceIov(&iov, &iovcnt, (size_t) len);
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (cfg_spill_dir != NULL &&
+                (ob->spill.pending > 0 || spooledBytes(ob) >= cfg_spool_size)) {
+            if (appendSpill(&ob->spill, iov[i].iov_base, iov[i].iov_len) < 0) {
+                return -1;
+            }
+        }
+        else {
+            appendSpool(ob, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    return 0;
+}
+
+static int writeFully(int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t len = writev(fd, iov, iovcnt);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        advanceIov(&iov, &iovcnt, (size_t) len);
+    }
+    return 0;
+}
+
+static int writeOutBatch(struct OutBatch* ob)
+{
+    struct iovec* iov = ob->iov;
+    int iovcnt = ob->iovcnt;
+    struct iovec frame;
+
+    if (cfg_compress != COMPRESS_NONE) {
+        if (ob->iovcnt == 0 && ob->raw.len == 0) {
+            return 0;
+        }
+        compressOutBatch(ob, &frame);
+        iov = &frame;
+        iovcnt = 1;
+    }
+    else {
+        resolveOutBatch(ob);
+    }
+
+    if (s_ring.header != NULL) {
+        return writeRing(&s_ring, iov, iovcnt);
+    }
+    if (cfg_spool_size > 0) {
+        return spoolOutBatch(ob, iov, iovcnt);
+    }
+
+    return writeFully(ob->fd, iov, iovcnt);
+}
+
+static char* formatHex32(char* p, uint32_t v)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    int shift = 28;
+    while (shift > 0 && (v >> shift) == 0) {
+        shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4) {
+        *p++ = digits[(v >> shift) & 0xf];
+    }
+    return p;
+}
+
+static char* formatLsn(char* p, int64_t lsn)
+{
+    p = formatHex32(p, (uint32_t) (lsn >> 32));
+    *p++ = '/';
+    return formatHex32(p, (uint32_t) lsn);
+}
+
+static char* formatSize(char* p, size_t v)
+{
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+// Records statistics of the batch written at now then releases it
+static void finishOutBatch(struct OutBatch* ob, int r, int64_t now)
+{
+    if (r == 0) {
+        s_stats.written_bytes += ob->bytes;
+        if (ob->rowcnt > 0) {
+            recordWritten(&s_stats, now, ob->receive_times, ob->rowcnt, ob->last_wal_pos);
+        }
+    }
+    releaseOutBatch(ob);
+}
+
+static int flushOutBatch(struct OutBatch* ob)
+{
+    int64_t started_at = feGetCurrentTimestamp();
+    int r = writeOutBatch(ob);
+    int64_t now = feGetCurrentTimestamp();
+    s_stats.flush_time += now - started_at;
+    finishOutBatch(ob, r, now);
+    return r;
+}
+
+#ifdef USE_IO_URING
+// Writes the output batch and the batches of all partitions with one
+// io_uring_enter(2). Writes are linked so that they are done in order
+// even if partitions share a file. A short write cancels the following
+// ones, and the rest is written with writev(2).
+static int flushOutUring(void)
+{
+    int64_t started_at = feGetCurrentTimestamp();
+    struct OutBatch* batches[1 + PARTITIONS_MAX];
+    int32_t results[1 + PARTITIONS_MAX];
+    int count = 0;
+    batches[count++] = &s_out;
+    for (int i = 0; i < cfg_partition_count; i++) {
+        batches[count++] = &cfg_partitions[i].out;
+    }
+
+    struct io_uring_sqe* prev = NULL;
+    unsigned pending = 0;
+    for (int i = 0; i < count; i++) {
+        struct OutBatch* ob = batches[i];
+        resolveOutBatch(ob);
+        results[i] = 0;
+        if (ob->iovcnt == 0) {
+            continue;
+        }
+        struct io_uring_sqe* sqe = getUringSqe(&s_uring);
+        if (sqe == NULL) {
+            // Written by writev(2) below
+            results[i] = -EBUSY;
+            continue;
+        }
+        if (prev != NULL) {
+            prev->flags |= IOSQE_IO_LINK;
+        }
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = ob->fd;
+        sqe->addr = (uint64_t) (uintptr_t) ob->iov;
+        sqe->len = (uint32_t) ob->iovcnt;
+        sqe->off = (uint64_t) -1;  // current file position
+        sqe->user_data = URING_WRITE | (uint64_t) i;
+        prev = sqe;
+        pending++;
+    }
+
+    while (pending > 0) {
+        if (enterUring(&s_uring, pending, -1) < 0 && errno != EINTR) {
+            // Writes may still refer to the batches, so they are not
+            // released
+            perror("io_uring_enter(2)");
+            return -1;
+        }
+        uint64_t data;
+        int32_t res;
+        while (popUringCqe(&s_uring, &data, &res)) {
+            if (data & URING_WRITE) {
+                results[data & ~URING_WRITE] = res;
+                pending--;
+            }
+            else {
+                deferUringPoll(&s_uring, data);
+            }
+        }
+    }
+
+    int r = 0;
+    for (int i = 0; i < count; i++) {
+        struct OutBatch* ob = batches[i];
+        struct iovec* iov = ob->iov;
+        int iovcnt = ob->iovcnt;
+        int br = 0;
+        if (results[i] >= 0) {
+            advanceIov(&iov, &iovcnt, (size_t) results[i]);
+        }
+        else if (results[i] != -ECANCELED && results[i] != -EINTR &&
+                results[i] != -EAGAIN && results[i] != -EBUSY) {
+            errno = -results[i];
+            br = -1;
+        }
+        if (br == 0 && writeFully(ob->fd, iov, iovcnt) < 0) {
+            br = -1;
+        }
+        if (br < 0) {
+            r = -1;
+        }
+        finishOutBatch(ob, br, feGetCurrentTimestamp());
+    }
+    s_stats.flush_time += feGetCurrentTimestamp() - started_at;
+    return r;
+}
+#endif
+
+// Writes the output batch and the batches of all partitions
+static int flushOut()
+{
+#ifdef USE_IO_URING
+    if (s_uring.fd >= 0 && s_ring.header == NULL && cfg_spool_size == 0 &&
+            cfg_compress == COMPRESS_NONE) {
+        return flushOutUring();
+    }
+#endif
+    int r = flushOutBatch(&s_out);
+    for (int i = 0; i < cfg_partition_count; i++) {
+        if (flushOutBatch(&cfg_partitions[i].out) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+// Writes spooled data of the output and partitions that became writable
+static int drainSpools(void)
+{
+    int r = drainSpool(&s_out);
+    for (int i = 0; i < cfg_partition_count; i++) {
+        if (drainSpool(&cfg_partitions[i].out) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+static bool isOutBatchFull(const struct OutBatch* ob)
+{
+    if (cfg_spill_dir != NULL) {
+        // Bytes in segments in use count, including the drained part of
+        // the first one, so that no segment is added past --spill-size.
+        // Spares are kept only while they fit too.
+        const struct Spill* sp = &ob->spill;
+        size_t used = sp->nsegs == 0 ? 0 :
+            (size_t) (sp->nsegs - 1) * cfg_spill_segment_size + sp->segs[sp->nsegs - 1].len;
+        return used >= cfg_spill_size;
+    }
+    return spooledBytes(ob) >= cfg_spool_size;
+}
+
+// Returns true if the output or a partition has spooled --spool bytes,
+// or filled --spill-size with --spill. Reading the replication stream
+// pauses until the consumer catches up.
+static bool isSpoolFull(void)
+{
+    if (isOutBatchFull(&s_out)) {
+        return true;
+    }
+    for (int i = 0; i < cfg_partition_count; i++) {
+        if (isOutBatchFull(&cfg_partitions[i].out)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes all spooled data blocking, and leaves the fd in blocking mode.
+// Called before exit since nobody polls the fd anymore.
+static int finishSpool(struct OutBatch* ob)
+{
+    int flags = fcntl(ob->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(ob->fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        return -1;
+    }
+    return drainSpool(ob);
+}
+
+static int finishSpools(void)
+{
+    if (cfg_spool_size == 0) {
+        return 0;
+    }
+    int r = finishSpool(&s_out);
+    for (int i = 0; i < cfg_partition_count; i++) {
+        if (finishSpool(&cfg_partitions[i].out) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+// Counts a row appended to an output batch
+static void countRow(struct OutBatch* ob, int64_t wal_pos, int64_t receive_time)
+{
+    ob->receive_times[ob->rowcnt++] = receive_time;
+    ob->last_wal_pos = wal_pos;
+    if (ob->min_wal_pos == InvalidXLogRecPtr || wal_pos < ob->min_wal_pos) {
+        ob->min_wal_pos = wal_pos;
+    }
+    if (wal_pos > ob->max_wal_pos) {
+        ob->max_wal_pos = wal_pos;
+    }
+}
+
+// Appends the header of a row of size bytes to an output batch
+static void appendRowHeader(struct OutBatch* ob,
+        int64_t wal_pos, int64_t wal_end, int64_t send_time, size_t size)
+{
+    if (cfg_binary_header) {
+        // Frame header (little endian)
+        //   UInt64 dataStart, UInt64 walEnd, Int64 sendTime (microseconds since
+        //   UNIX epoch), UInt32 length, UInt32 flags
+        char* header = reserveByteBuffer(&ob->data, OUT_HEADER_MAX);
+        char* p = header;
+        p = putLE64(p, (uint64_t) wal_pos);
+        p = putLE64(p, (uint64_t) wal_end);
+        p = putLE64(p, (uint64_t) (send_time +
+                    ((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC)));
+        p = putLE32(p, (uint32_t) (size + (cfg_write_nl ? 1 : 0)));
+        p = putLE32(p, cfg_write_nl ? FRAME_FLAG_NL : 0);
+        appendOutBatchData(ob, ob->data.len, p - header);
+        ob->data.len += p - header;
+    }
+    else if (cfg_write_header) {
+        char* header = reserveByteBuffer(&ob->data, OUT_HEADER_MAX);
+        char* p = header;
+        *p++ = 'w';
+        *p++ = ' ';
+        p = formatLsn(p, wal_pos);
+        *p++ = ' ';
+        p = formatSize(p, size + (cfg_write_nl ? 1 : 0));
+        *p++ = '\n';
+        appendOutBatchData(ob, ob->data.len, p - header);
+        ob->data.len += p - header;
+    }
+}
+
+// Appends a row to an output batch. Ownership of buf (allocated by
+// PQgetCopyData) moves to the batch even if this function fails. If data
+// is NULL, the row is the last size bytes of ob->data.
+static int appendRow(struct OutBatch* ob,
+        int64_t wal_pos, int64_t wal_end, int64_t send_time, int64_t receive_time,
+        const char* data, size_t size, char* buf)
+{
+    size_t data_offset = ob->data.len - (data == NULL ? size : 0);
+
+    if (buf != NULL) {
+        ob->bufs[ob->bufcnt++] = buf;
+    }
+    countRow(ob, wal_pos, receive_time);
+    appendRowHeader(ob, wal_pos, wal_end, send_time, size);
+
+    if (data == NULL) {
+        appendOutBatchData(ob, data_offset, size);
+    }
+    else {
+        appendOutBatch(ob, data, size);
+    }
+
+    if (cfg_write_nl) {
+        appendOutBatch(ob, "\n", 1);
+    }
+
+    if (cfg_compress != COMPRESS_NONE) {
+        // A frame holds up to --compress-block bytes. Data is moved out
+        // of iovecs to add more rows.
+        if (ob->bytes >= cfg_compress_block || ob->rowcnt >= OUT_IOVCNT) {
+            return flushOutBatch(ob);
+        }
+        if (ob->iovcnt + 3 > OUT_IOVCNT) {
+            stageOutBatch(ob);
+        }
+        return 0;
+    }
+
+    // Write the batch if it may not have space for another row
+    if (ob->iovcnt + 3 > OUT_IOVCNT || ob->bytes >= OUT_BUFSIZ) {
+        return flushOutBatch(ob);
+    }
+
+    return 0;
+}
+
+// Appends a piece of a row whose header is appended by appendRowHeader.
+// Ownership of buf moves to the batch. The batch is written when it's
+// full, so the row doesn't need to fit in memory; the row is counted as
+// written with its last piece.
+static int appendRowPiece(struct OutBatch* ob, int64_t wal_pos, int64_t receive_time,
+        const char* data, size_t size, char* buf, bool last)
+{
+    ob->bufs[ob->bufcnt++] = buf;
+    appendOutBatch(ob, data, size);
+    if (last) {
+        if (cfg_write_nl) {
+            appendOutBatch(ob, "\n", 1);
+        }
+        countRow(ob, wal_pos, receive_time);
+    }
+    if (ob->iovcnt + 3 > OUT_IOVCNT || ob->bytes >= OUT_BUFSIZ) {
+        return flushOutBatch(ob);
+    }
+    return 0;
+}
+
+static void appendRestartMarker(struct OutBatch* ob, int64_t lsn)
+{
+    char* header = reserveByteBuffer(&ob->data, OUT_HEADER_MAX);
+    char* p = header;
+    if (cfg_binary_header) {
+        p = putLE64(p, (uint64_t) lsn);
+        p = putLE64(p, (uint64_t) lsn);
+        p = putLE64(p, (uint64_t) (feGetCurrentTimestamp() +
+                    ((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC)));
+        p = putLE32(p, 0);
+        p = putLE32(p, FRAME_FLAG_RESTART);
+    }
+    else {
+        *p++ = 'r';
+        *p++ = ' ';
+        p = formatLsn(p, lsn);
+        *p++ = ' ';
+        *p++ = '0';
+        *p++ = '\n';
+    }
+    appendOutBatchData(ob, ob->data.len, p - header);
+    ob->data.len += p - header;
+}
+
+// Writes a header with no record telling the consumer that the stream
+// restarted from lsn after a reconnect, or from --start-lsn or the
+// --checkpoint. Rows after lsn may be written again.
+// With --partition, every partition gets the marker.
+static int writeRestartMarker(int64_t lsn)
+{
+    if (cfg_unordered_feedback || cfg_partition_count > 0) {
+        resetInflight(&s_inflight);
+    }
+    // The transaction of a held B record is sent again
+    cfg_filter.has_begin = false;
+    // So are streamed transactions that didn't end, from their first change
+    s_pg_stream.active = false;
+
+    if (cfg_partition_count == 0) {
+        appendRestartMarker(&s_out, lsn);
+    }
+    for (int i = 0; i < cfg_partition_count; i++) {
+        cfg_partitions[i].seqs_count = 0;
+        appendRestartMarker(&cfg_partitions[i].out, lsn);
+    }
+    return flushOut();
+}
+
+////
+// Transcoder
+//
+// Converts JSON records to MessagePack or CBOR. A record is tokenized into
+// s_json_tokens first so that lengths of arrays, objects and strings are
+// known before their headers are written. Numbers become integers, or
+// floats if a double prints back as the same text; other numbers are
+// written as strings not to lose precision or scale (e.g. 1.50).
+//
+
+static void addJsonToken(struct JsonTokens* tokens, JsonType type, size_t start, size_t len, size_t count)
+{
+    if (tokens->count == tokens->cap) {
+        tokens->cap = tokens->cap == 0 ? 256 : tokens->cap * 2;
+        tokens->tokens = realloc(tokens->tokens, sizeof(struct JsonToken) * tokens->cap);
+    }
+    struct JsonToken* token = &tokens->tokens[tokens->count++];
+    token->type = type;
+    token->start = start;
+    token->len = len;
+    token->count = count;
+}
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int parseHex4(const char* p, const char* end, uint32_t* r_value)
+{
+    if (end - p < 4) {
+        return -1;
+    }
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        int h = hexValue(p[i]);
+        if (h < 0) {
+            return -1;
+        }
+        v = (v << 4) | h;
+    }
+    *r_value = v;
+    return 0;
+}
+
+static char* putUtf8(char* p, uint32_t cp)
+{
+    if (cp < 0x80) {
+        *p++ = (char) cp;
+    }
+    else if (cp < 0x800) {
+        *p++ = (char) (0xc0 | (cp >> 6));
+        *p++ = (char) (0x80 | (cp & 0x3f));
+    }
+    else if (cp < 0x10000) {
+        *p++ = (char) (0xe0 | (cp >> 12));
+        *p++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *p++ = (char) (0x80 | (cp & 0x3f));
+    }
+    else {
+        *p++ = (char) (0xf0 | (cp >> 18));
+        *p++ = (char) (0x80 | ((cp >> 12) & 0x3f));
+        *p++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *p++ = (char) (0x80 | (cp & 0x3f));
+    }
+    return p;
+}
+
+// Decodes contents of a JSON string (without quotes) into out, and returns
+// the decoded length. If out is NULL, only computes the length. Returns -1
+// if an escape sequence is invalid.
+static ssize_t decodeJsonString(const char* src, size_t len, char* out)
+{
+    const char* end = src + len;
+    char utf8[4];
+    char* p = out;
+    ssize_t decoded = 0;
+    while (src < end) {
+        const char* esc = memchr(src, '\\', end - src);
+        size_t plain = (esc == NULL ? end : esc) - src;
+        if (out != NULL) {
+            memcpy(p, src, plain);
+            p += plain;
+        }
+        decoded += plain;
+        if (esc == NULL) {
+            break;
+        }
+        src = esc + 1;
+        if (src >= end) {
+            return -1;
+        }
+        char c;
+        switch (*src++) {
+        case '"':  c = '"';  break;
+        case '\\': c = '\\'; break;
+        case '/':  c = '/';  break;
+        case 'b':  c = '\b'; break;
+        case 'f':  c = '\f'; break;
+        case 'n':  c = '\n'; break;
+        case 'r':  c = '\r'; break;
+        case 't':  c = '\t'; break;
+        case 'u':
+            {
+                uint32_t cp;
+                if (parseHex4(src, end, &cp) < 0) {
+                    return -1;
+                }
+                src += 4;
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    // Surrogate pair
+                    uint32_t low;
+                    if (end - src >= 6 && src[0] == '\\' && src[1] == 'u' &&
+                            parseHex4(src + 2, end, &low) == 0 &&
+                            low >= 0xdc00 && low <= 0xdfff) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                        src += 6;
+                    }
+                    else {
+                        cp = 0xfffd;
+                    }
+                }
+                else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                    cp = 0xfffd;
+                }
+                size_t n = putUtf8(utf8, cp) - utf8;
+                if (out != NULL) {
+                    memcpy(p, utf8, n);
+                    p += n;
+                }
+                decoded += n;
+            }
+            continue;
+        default:
+            return -1;
+        }
+        if (out != NULL) {
+            *p++ = c;
+        }
+        decoded++;
+    }
+    return decoded;
+}
+
+static size_t skipJsonSpace(const char* json, size_t size, size_t pos)
+{
+    while (pos < size && (json[pos] == ' ' || json[pos] == '\t' ||
+                json[pos] == '\n' || json[pos] == '\r')) {
+        pos++;
+    }
+    return pos;
+}
+
+static int parseJsonString(const char* json, size_t size, size_t* r_pos, struct JsonTokens* tokens)
+{
+    size_t start = *r_pos + 1;  // skip '"'
+    size_t pos = start;
+    while (true) {
+        const char* q = memchr(json + pos, '"', size - pos);
+        if (q == NULL) {
+            return -1;
+        }
+        pos = q - json;
+        // The quote is escaped if it follows an odd number of backslashes
+        size_t bs = 0;
+        while (pos - bs > start && json[pos - bs - 1] == '\\') {
+            bs++;
+        }
+        if (bs % 2 == 0) {
+            break;
+        }
+        pos++;
+    }
+    ssize_t decoded = decodeJsonString(json + start, pos - start, NULL);
+    if (decoded < 0) {
+        return -1;
+    }
+    addJsonToken(tokens, JSON_STRING, start, pos - start, decoded);
+    *r_pos = pos + 1;
+    return 0;
+}
+
+static bool isJsonDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Returns the end of a number at pos, or 0 if it doesn't follow the JSON
+// grammar: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+static size_t scanJsonNumber(const char* json, size_t size, size_t pos)
+{
+    if (pos < size && json[pos] == '-') {
+        pos++;
+    }
+    if (pos >= size || !isJsonDigit(json[pos])) {
+        return 0;
+    }
+    if (json[pos] == '0') {
+        pos++;
+    }
+    else {
+        while (pos < size && isJsonDigit(json[pos])) {
+            pos++;
+        }
+    }
+    if (pos < size && json[pos] == '.') {
+        pos++;
+        if (pos >= size || !isJsonDigit(json[pos])) {
+            return 0;
+        }
+        while (pos < size && isJsonDigit(json[pos])) {
+            pos++;
+        }
+    }
+    if (pos < size && (json[pos] == 'e' || json[pos] == 'E')) {
+        pos++;
+        if (pos < size && (json[pos] == '+' || json[pos] == '-')) {
+            pos++;
+        }
+        if (pos >= size || !isJsonDigit(json[pos])) {
+            return 0;
+        }
+        while (pos < size && isJsonDigit(json[pos])) {
+            pos++;
+        }
+    }
+    return pos;
+}
+
+static int parseJsonValue(const char* json, size_t size, size_t* r_pos,
+        struct JsonTokens* tokens, int depth)
+{
+    size_t pos = skipJsonSpace(json, size, *r_pos);
+    if (pos >= size || depth > JSON_DEPTH_MAX) {
+        return -1;
+    }
+
+    char c = json[pos];
+    if (c == '{' || c == '[') {
+        bool is_object = c == '{';
+        char close = is_object ? '}' : ']';
+        size_t index = tokens->count;
+        addJsonToken(tokens, is_object ? JSON_OBJECT : JSON_ARRAY, pos, 0, 0);
+        pos = skipJsonSpace(json, size, pos + 1);
+        if (pos < size && json[pos] == close) {
+            *r_pos = pos + 1;
+            return 0;
+        }
+        while (true) {
+            if (is_object) {
+                pos = skipJsonSpace(json, size, pos);
+                if (pos >= size || json[pos] != '"' ||
+                        parseJsonString(json, size, &pos, tokens) < 0) {
+                    return -1;
+                }
+                pos = skipJsonSpace(json, size, pos);
+                if (pos >= size || json[pos] != ':') {
+                    return -1;
+                }
+                pos++;
+            }
+            if (parseJsonValue(json, size, &pos, tokens, depth + 1) < 0) {
+                return -1;
+            }
+            tokens->tokens[index].count++;
+            pos = skipJsonSpace(json, size, pos);
+            if (pos < size && json[pos] == ',') {
+                pos++;
+            }
+            else if (pos < size && json[pos] == close) {
+                *r_pos = pos + 1;
+                return 0;
+            }
+            else {
+                return -1;
+            }
+        }
+    }
+    else if (c == '"') {
+        *r_pos = pos;
+        return parseJsonString(json, size, r_pos, tokens);
+    }
+    else if (c == '-' || (c >= '0' && c <= '9')) {
+        size_t end = scanJsonNumber(json, size, pos);
+        if (end == 0) {
+            return -1;
+        }
+        addJsonToken(tokens, JSON_NUMBER, pos, end - pos, 0);
+        *r_pos = end;
+        return 0;
+    }
+    else if (size - pos >= 4 && memcmp(json + pos, "null", 4) == 0) {
+        addJsonToken(tokens, JSON_NULL, pos, 4, 0);
+        *r_pos = pos + 4;
+        return 0;
+    }
+    else if (size - pos >= 4 && memcmp(json + pos, "true", 4) == 0) {
+        addJsonToken(tokens, JSON_TRUE, pos, 4, 0);
+        *r_pos = pos + 4;
+        return 0;
+    }
+    else if (size - pos >= 5 && memcmp(json + pos, "false", 5) == 0) {
+        addJsonToken(tokens, JSON_FALSE, pos, 5, 0);
+        *r_pos = pos + 5;
+        return 0;
+    }
+    return -1;
+}
+
+static char* putBE(char* p, uint64_t v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--) {
+        *p++ = (char) (v >> (i * 8));
+    }
+    return p;
+}
+
+static char* putCborHead(char* p, int major, uint64_t n)
+{
+    uint8_t mt = (uint8_t) (major << 5);
+    if (n < 24) {
+        *p++ = (char) (mt | n);
+    }
+    else if (n <= 0xff) {
+        *p++ = (char) (mt | 24);
+        p = putBE(p, n, 1);
+    }
+    else if (n <= 0xffff) {
+        *p++ = (char) (mt | 25);
+        p = putBE(p, n, 2);
+    }
+    else if (n <= 0xffffffff) {
+        *p++ = (char) (mt | 26);
+        p = putBE(p, n, 4);
+    }
+    else {
+        *p++ = (char) (mt | 27);
+        p = putBE(p, n, 8);
+    }
+    return p;
+}
+
+// Writes a header of MessagePack with a fix type (up to fix_max) or one of
+// 8/16/32-bit types. type8 is 0 if the type doesn't have the 8-bit type.
+static char* putMsgpackHead(char* p, uint8_t fix, uint64_t fix_max,
+        uint8_t type8, uint8_t type16, uint8_t type32, uint64_t n)
+{
+    if (n <= fix_max) {
+        *p++ = (char) (fix | n);
+    }
+    else if (type8 != 0 && n <= 0xff) {
+        *p++ = (char) type8;
+        p = putBE(p, n, 1);
+    }
+    else if (n <= 0xffff) {
+        *p++ = (char) type16;
+        p = putBE(p, n, 2);
+    }
+    else {
+        *p++ = (char) type32;
+        p = putBE(p, n, 4);
+    }
+    return p;
+}
+
+static char* putStringHead(char* p, TranscodeFormat format, size_t n)
+{
+    if (format == TRANSCODE_CBOR) {
+        return putCborHead(p, 3, n);
+    }
+    return putMsgpackHead(p, 0xa0, 31, 0xd9, 0xda, 0xdb, n);
+}
+
+static char* putUint(char* p, TranscodeFormat format, uint64_t v)
+{
+    if (format == TRANSCODE_CBOR) {
+        return putCborHead(p, 0, v);
+    }
+    if (v < 0x80) {
+        *p++ = (char) v;
+    }
+    else if (v <= 0xff) {
+        *p++ = (char) 0xcc;
+        p = putBE(p, v, 1);
+    }
+    else if (v <= 0xffff) {
+        *p++ = (char) 0xcd;
+        p = putBE(p, v, 2);
+    }
+    else if (v <= 0xffffffff) {
+        *p++ = (char) 0xce;
+        p = putBE(p, v, 4);
+    }
+    else {
+        *p++ = (char) 0xcf;
+        p = putBE(p, v, 8);
+    }
+    return p;
+}
+
+static char* putNegativeInt(char* p, TranscodeFormat format, int64_t v)
+{
+    if (format == TRANSCODE_CBOR) {
+        return putCborHead(p, 1, (uint64_t) (-(v + 1)));
+    }
+    if (v >= -32) {
+        *p++ = (char) (uint8_t) v;
+    }
+    else if (v >= INT8_MIN) {
+        *p++ = (char) 0xd0;
+        p = putBE(p, (uint64_t) v, 1);
+    }
+    else if (v >= INT16_MIN) {
+        *p++ = (char) 0xd1;
+        p = putBE(p, (uint64_t) v, 2);
+    }
+    else if (v >= INT32_MIN) {
+        *p++ = (char) 0xd2;
+        p = putBE(p, (uint64_t) v, 4);
+    }
+    else {
+        *p++ = (char) 0xd3;
+        p = putBE(p, (uint64_t) v, 8);
+    }
+    return p;
+}
+
+static char* putJsonNumber(char* p, TranscodeFormat format, const char* num, size_t len)
+{
+    bool negative = len > 0 && num[0] == '-';
+    size_t i = negative ? 1 : 0;
+    uint64_t v = 0;
+    bool integral = true;
+    bool overflow = false;
+    for (; i < len; i++) {
+        char c = num[i];
+        if (c >= '0' && c <= '9') {
+            if (v > (UINT64_MAX - (c - '0')) / 10) {
+                overflow = true;
+            }
+            v = v * 10 + (c - '0');
+        }
+        else {
+            integral = false;  // fraction or exponent
+            break;
+        }
+    }
+
+    if (integral && !overflow) {
+        if (!negative) {
+            return putUint(p, format, v);
+        }
+        else if (v == 0) {
+            return putUint(p, format, 0);
+        }
+        else if (v <= (uint64_t) INT64_MAX + 1) {
+            return putNegativeInt(p, format, v == (uint64_t) INT64_MAX + 1 ? INT64_MIN : -(int64_t) v);
+        }
+    }
+    else if (!integral && len < 32) {
+        // The number is written as a float only if the double prints back
+        // as the same text, so that neither digits nor scale are lost
+        char tmp[32];
+        char printed[32];
+        memcpy(tmp, num, len);
+        tmp[len] = '\0';
+        errno = 0;
+        double d = strtod(tmp, NULL);
+        snprintf(printed, sizeof(printed), "%.15g", d);
+        if (errno != ERANGE && strcmp(printed, tmp) == 0) {
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            *p++ = (char) (format == TRANSCODE_CBOR ? 0xfb : 0xcb);
+            return putBE(p, bits, 8);
+        }
+    }
+
+    p = putStringHead(p, format, len);
+    memcpy(p, num, len);
+    return p + len;
+}
+
+// Appends a JSON document transcoded to format to out. Returns -1 if the
+// document is not valid JSON.
+static int transcodeJson(const char* json, size_t size, TranscodeFormat format, struct ByteBuffer* out)
+{
+    struct JsonTokens* tokens = &s_json_tokens;
+    tokens->count = 0;
+
+    size_t pos = 0;
+    if (parseJsonValue(json, size, &pos, tokens, 0) < 0 ||
+            skipJsonSpace(json, size, pos) != size) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < tokens->count; i++) {
+        struct JsonToken* token = &tokens->tokens[i];
+        // 9 bytes is the largest header
+        char* p = reserveByteBuffer(out, 9 + token->len);
+        char* start = p;
+        switch (token->type) {
+        case JSON_NULL:
+            *p++ = (char) (format == TRANSCODE_CBOR ? 0xf6 : 0xc0);
+            break;
+        case JSON_FALSE:
+            *p++ = (char) (format == TRANSCODE_CBOR ? 0xf4 : 0xc2);
+            break;
+        case JSON_TRUE:
+            *p++ = (char) (format == TRANSCODE_CBOR ? 0xf5 : 0xc3);
+            break;
+        case JSON_NUMBER:
+            p = putJsonNumber(p, format, json + token->start, token->len);
+            break;
+        case JSON_STRING:
+            p = putStringHead(p, format, token->count);
+            decodeJsonString(json + token->start, token->len, p);
+            p += token->count;
+            break;
+        case JSON_ARRAY:
+            if (format == TRANSCODE_CBOR) {
+                p = putCborHead(p, 4, token->count);
+            }
+            else {
+                p = putMsgpackHead(p, 0x90, 15, 0, 0xdc, 0xdd, token->count);
+            }
+            break;
+        case JSON_OBJECT:
+            if (format == TRANSCODE_CBOR) {
+                p = putCborHead(p, 5, token->count);
+            }
+            else {
+                p = putMsgpackHead(p, 0x80, 15, 0, 0xde, 0xdf, token->count);
+            }
+            break;
+        }
+        out->len += p - start;
+    }
+
+    return 0;
+}
+
+////
+// Partitions
+//
+// With --partition, rows are distributed to several outputs by a hash of
+// their schema and table names (and primary key values with
+// --partition-key), so that changes of a table (or a row) stay in order
+// within one partition. Records without a table (transaction boundaries
+// and messages) are written to every partition. Each partition
+// acknowledges its own rows through its command fd, and the flush LSN
+// advances over the records acknowledged by every partition they were
+// written to.
+//
+
+static uint64_t hashBytes(uint64_t h, const char* p, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) p[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+// Returns the offset of the first occurrence of key in data, or size
+static size_t findBytes(const char* data, size_t size, const char* key, size_t key_len)
+{
+    size_t pos = 0;
+    while (size - pos >= key_len) {
+        const char* q = memchr(data + pos, key[0], size - pos - key_len + 1);
+        if (q == NULL) {
+            break;
+        }
+        if (memcmp(q, key, key_len) == 0) {
+            return q - data;
+        }
+        pos = q - data + 1;
+    }
+    return size;
+}
+
+// Finds key (e.g. "table":") in a JSON record and sets the contents of the
+// string value after it to r_value. A key never matches inside a string
+// because quotes are escaped there.
+static bool findJsonStringField(const char* json, size_t size, const char* key,
+        const char** r_value, size_t* r_len)
+{
+    size_t key_len = strlen(key);
+    size_t start = findBytes(json, size, key, key_len) + key_len;
+    for (size_t pos = start; pos < size; pos++) {
+        if (json[pos] == '\\') {
+            pos++;
+        }
+        else if (json[pos] == '"') {
+            *r_value = json + start;
+            *r_len = pos - start;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the index of the token after the value at index and its elements
+static size_t skipJsonValue(const struct JsonTokens* tokens, size_t index)
+{
+    size_t remaining = 1;
+    while (remaining > 0) {
+        const struct JsonToken* token = &tokens->tokens[index++];
+        remaining--;
+        if (token->type == JSON_ARRAY) {
+            remaining += token->count;
+        }
+        else if (token->type == JSON_OBJECT) {
+            remaining += token->count * 2;
+        }
+    }
+    return index;
+}
+
+// Returns the index of the value of name in the object at index, or 0 if
+// the object doesn't have it.
+static size_t findJsonMember(const char* json, const struct JsonTokens* tokens,
+        size_t index, const char* name)
+{
+    if (tokens->tokens[index].type != JSON_OBJECT) {
+        return 0;
+    }
+    size_t len = strlen(name);
+    size_t count = tokens->tokens[index].count;
+    index++;
+    for (size_t i = 0; i < count; i++) {
+        const struct JsonToken* key = &tokens->tokens[index];
+        if (key->len == len && memcmp(json + key->start, name, len) == 0) {
+            return index + 1;
+        }
+        index = skipJsonValue(tokens, index + 1);
+    }
+    return 0;
+}
+
+// Adds the value of the column named like the string token name in the
+// array of columns at index to h
+static uint64_t hashColumnValue(const char* json, const struct JsonTokens* tokens,
+        size_t index, const struct JsonToken* name, uint64_t h)
+{
+    size_t count = tokens->tokens[index].count;
+    index++;
+    for (size_t i = 0; i < count; i++) {
+        size_t col_name = findJsonMember(json, tokens, index, "name");
+        if (col_name != 0 && tokens->tokens[col_name].len == name->len &&
+                memcmp(json + tokens->tokens[col_name].start, json + name->start, name->len) == 0) {
+            size_t value = findJsonMember(json, tokens, index, "value");
+            if (value != 0) {
+                const struct JsonToken* token = &tokens->tokens[value];
+                h = hashBytes(h, json + token->start, token->len);
+            }
+            // a value in a JSON document has no raw new line
+            return hashBytes(h, "\n", 1);
+        }
+        index = skipJsonValue(tokens, index);
+    }
+    return h;
+}
+
+// Adds values of the primary key of a wal2json format-version=2 record
+// (include-pk=1) to h. Old values in "identity" are used if present, so
+// that an update or a delete follows the insert of the row.
+static uint64_t hashPrimaryKey(const char* json, size_t size, uint64_t h)
+{
+    struct JsonTokens* tokens = &s_json_tokens;
+    tokens->count = 0;
+
+    size_t pos = 0;
+    if (parseJsonValue(json, size, &pos, tokens, 0) < 0) {
+        return h;
+    }
+    size_t pk = findJsonMember(json, tokens, 0, "pk");
+    size_t values = findJsonMember(json, tokens, 0, "identity");
+    if (values == 0) {
+        values = findJsonMember(json, tokens, 0, "columns");
+    }
+    if (pk == 0 || values == 0 || tokens->tokens[pk].type != JSON_ARRAY ||
+            tokens->tokens[values].type != JSON_ARRAY) {
+        return h;
+    }
+
+    size_t count = tokens->tokens[pk].count;
+    size_t index = pk + 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t name = findJsonMember(json, tokens, index, "name");
+        if (name != 0 && tokens->tokens[name].type == JSON_STRING) {
+            h = hashColumnValue(json, tokens, values, &tokens->tokens[name], h);
+        }
+        index = skipJsonValue(tokens, index);
+    }
+    return h;
+}
+
+// Returns the partition of a record, or -1 if the record has no table and
+// is written to all partitions.
+static int routeRecord(const char* json, size_t size)
+{
+    const char* schema;
+    size_t schema_len;
+    const char* table;
+    size_t table_len;
+    if (!findJsonStringField(json, size, "\"schema\":\"", &schema, &schema_len)) {
+        return -1;
+    }
+    size_t offset = schema + schema_len - json;
+    if (!findJsonStringField(json + offset, size - offset, "\"table\":\"", &table, &table_len)) {
+        return -1;
+    }
+
+    uint64_t h = hashBytes(FNV_OFFSET_BASIS, schema, schema_len);
+    h = hashBytes(h, ".", 1);
+    h = hashBytes(h, table, table_len);
+    if (cfg_partition_key) {
+        h = hashPrimaryKey(json, size, h);
+    }
+    return (int) (h % (uint64_t) cfg_partition_count);
+}
+
+static void pushPartitionSeq(struct Partition* part, uint64_t seq)
+{
+    if (part->seqs_count == part->seqs_cap) {
+        size_t new_cap = part->seqs_cap == 0 ? 1024 : part->seqs_cap * 2;
+        uint64_t* new_seqs = malloc(sizeof(uint64_t) * new_cap);
+        for (size_t i = 0; i < part->seqs_count; i++) {
+            new_seqs[i] = part->seqs[(part->seqs_head + i) % part->seqs_cap];
+        }
+        free(part->seqs);
+        part->seqs = new_seqs;
+        part->seqs_head = 0;
+        part->seqs_cap = new_cap;
+    }
+    part->seqs[(part->seqs_head + part->seqs_count) % part->seqs_cap] = seq;
+    part->seqs_count++;
+}
+
+// Acknowledges the rows written to the partition up to the first one at
+// lsn. Returns true if the flushed LSN of s_inflight advanced.
+static bool ackPartition(struct Partition* part, int64_t lsn)
+{
+    struct Inflight* in = &s_inflight;
+    size_t n = 0;
+    while (n < part->seqs_count) {
+        uint64_t seq = part->seqs[(part->seqs_head + n) % part->seqs_cap];
+        if (in->records[seq & (in->cap - 1)].lsn == lsn) {
+            break;
+        }
+        n++;
+    }
+    if (n == part->seqs_count) {
+        if (cfg_verbose) {
+            fprintf(stderr, "Ignored F %X/%X of partition %d: no such row\n",
+                    (uint32_t) (lsn >> 32), (uint32_t) lsn, (int) (part - cfg_partitions));
+        }
+        return false;
+    }
+
+    for (size_t i = 0; i <= n; i++) {
+        uint64_t seq = part->seqs[part->seqs_head];
+        part->seqs_head = (part->seqs_head + 1) % part->seqs_cap;
+        in->records[seq & (in->cap - 1)].pending--;
+    }
+    part->seqs_count -= n + 1;
+    return advanceInflight(in);
+}
+
+// Writes a row to the output batch, or to the batch of partition (-1 for
+// all partitions) with --partition. Ownership of buf moves to this
+// function even if it fails. If data is NULL, the row is the last size
+// bytes of s_out.data.
+static int writeRow(int partition,
+        int64_t wal_pos, int64_t wal_end, int64_t send_time, int64_t receive_time,
+        const char* data, size_t size, char* buf)
+{
+    if (cfg_partition_count == 0) {
+        if (cfg_unordered_feedback) {
+            pushInflight(&s_inflight, wal_pos, 1);
+        }
+        return appendRow(&s_out, wal_pos, wal_end, send_time, receive_time, data, size, buf);
+    }
+
+    if (partition >= 0 && buf != NULL) {
+        struct Partition* part = &cfg_partitions[partition];
+        pushPartitionSeq(part, pushInflight(&s_inflight, wal_pos, 1));
+        return appendRow(&part->out, wal_pos, wal_end, send_time, receive_time, data, size, buf);
+    }
+
+    // Copy rows rendered into s_out.data or written to all partitions
+    if (data == NULL) {
+        s_out.data.len -= size;
+        data = s_out.data.buf + s_out.data.len;
+    }
+    int first = partition < 0 ? 0 : partition;
+    int last = partition < 0 ? cfg_partition_count - 1 : partition;
+    uint64_t seq = pushInflight(&s_inflight, wal_pos, (uint32_t) (last - first + 1));
+    int r = 0;
+    for (int i = first; i <= last && r == 0; i++) {
+        struct Partition* part = &cfg_partitions[i];
+        pushPartitionSeq(part, seq);
+        char* p = reserveByteBuffer(&part->out.data, size);
+        memcpy(p, data, size);
+        part->out.data.len += size;
+        r = appendRow(&part->out, wal_pos, wal_end, send_time, receive_time, NULL, size, NULL);
+    }
+    if (buf != NULL) {
+        freeRowBuffer(buf);
+    }
+    return r;
+}
+
+// Returns the partition of a row to write, or -1 without --partition
+static int partitionOf(const char* data, size_t size)
+{
+    return cfg_partition_count > 0 ? routeRecord(data, size) : -1;
+}
+
+// Writes a row through the transcoder if --transcode is set. Ownership of
+// buf moves to this function even if it fails. Returns -1 if
+// writing failed, or -2 if the row couldn't be transcoded.
+static int emitRecord(
+        int64_t wal_pos, int64_t wal_end, int64_t send_time, int64_t receive_time,
+        const char* data, size_t size, char* buf)
+{
+    int partition = partitionOf(data, size);
+    if (cfg_transcode == TRANSCODE_NONE) {
+        return writeRow(partition, wal_pos, wal_end, send_time, receive_time, data, size, buf);
+    }
+
+    size_t offset = s_out.data.len;
+    if (transcodeJson(data, size, cfg_transcode, &s_out.data) < 0) {
+        s_out.data.len = offset;
+        if (buf != NULL) {
+            freeRowBuffer(buf);
+        }
+        fprintf(stderr, "Failed to transcode a record at %X/%X: not a JSON document\n",
+                (uint32_t) (wal_pos >> 32), (uint32_t) wal_pos);
+        return -2;
+    }
+    if (buf != NULL) {
+        freeRowBuffer(buf);
+    }
+    return writeRow(partition, wal_pos, wal_end, send_time, receive_time,
+            NULL, s_out.data.len - offset, NULL);
+}
+
+////
+// Filter
+//
+// Drops change records of tables not listed by --filter-tables or of
+// actions not selected by --filter-actions, and removes columns not
+// selected by --filter-columns. Records are scanned as text; only the
+// "columns" and "identity" arrays of a projected record are rewritten.
+// Dropped records are confirmed to the server once the consumer
+// acknowledges the last record written before them, so that the slot
+// doesn't retain WAL for them.
+//
+
+static uint32_t filterActionBit(char action)
+{
+    switch (action) {
+    case 'I': return FILTER_ACTION_INSERT;
+    case 'U': return FILTER_ACTION_UPDATE;
+    case 'D': return FILTER_ACTION_DELETE;
+    case 'T': return FILTER_ACTION_TRUNCATE;
+    default:  return 0;
+    }
+}
+
+static uint64_t hashTableName(const char* schema, size_t schema_len, const char* table, size_t table_len)
+{
+    uint64_t h = hashBytes(FNV_OFFSET_BASIS, schema, schema_len);
+    h = hashBytes(h, ".", 1);
+    return hashBytes(h, table, table_len);
+}
+
+static struct FilterTable* getFilterTable(const char* schema, size_t schema_len,
+        const char* table, size_t table_len)
+{
+    struct Filter* f = &cfg_filter;
+    if (f->table_cap == 0) {
+        return NULL;
+    }
+    uint64_t h = hashTableName(schema, schema_len, table, table_len);
+    for (size_t i = h & (f->table_cap - 1); f->tables[i] != NULL; i = (i + 1) & (f->table_cap - 1)) {
+        struct FilterTable* t = f->tables[i];
+        if (t->hash == h && t->name_len == schema_len + 1 + table_len &&
+                memcmp(t->name, schema, schema_len) == 0 &&
+                memcmp(t->name + schema_len + 1, table, table_len) == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void insertFilterTable(struct Filter* f, struct FilterTable* t)
+{
+    size_t i = t->hash & (f->table_cap - 1);
+    while (f->tables[i] != NULL) {
+        i = (i + 1) & (f->table_cap - 1);
+    }
+    f->tables[i] = t;
+    f->table_count++;
+}
+
+// Returns the settings of SCHEMA.TABLE, adding them if not exist. Returns
+// NULL if name has no schema.
+static struct FilterTable* addFilterTable(const char* name, size_t len)
+{
+    struct Filter* f = &cfg_filter;
+    const char* dot = memchr(name, '.', len);
+    if (dot == NULL || dot == name || dot == name + len - 1) {
+        return NULL;
+    }
+    struct FilterTable* t = getFilterTable(name, dot - name, dot + 1, name + len - dot - 1);
+    if (t != NULL) {
+        return t;
+    }
+
+    if ((f->table_count + 1) * 2 > f->table_cap) {
+        struct Filter old = *f;
+        f->table_cap = old.table_cap == 0 ? 64 : old.table_cap * 2;
+        f->tables = calloc(f->table_cap, sizeof(struct FilterTable*));
+        f->table_count = 0;
+        for (size_t i = 0; i < old.table_cap; i++) {
+            if (old.tables[i] != NULL) {
+                insertFilterTable(f, old.tables[i]);
+            }
+        }
+        free(old.tables);
+    }
+
+    t = calloc(1, sizeof(struct FilterTable));
+    t->name = strndup(name, len);
+    t->name_len = len;
+    t->hash = hashTableName(name, dot - name, dot + 1, name + len - dot - 1);
+    insertFilterTable(f, t);
+    return t;
+}
+
+// Parses comma separated SCHEMA.TABLE names of --filter-tables
+static int addFilterTables(const char* arg)
+{
+    const char* p = arg;
+    while (true) {
+        const char* comma = strchr(p, ',');
+        size_t len = comma != NULL ? (size_t) (comma - p) : strlen(p);
+        struct FilterTable* t = addFilterTable(p, len);
+        if (t == NULL) {
+            return -1;
+        }
+        t->included = true;
+        if (comma == NULL) {
+            break;
+        }
+        p = comma + 1;
+    }
+    cfg_filter.has_table_list = true;
+    cfg_filter.enabled = true;
+    return 0;
+}
+
+// Parses ACTIONS of --filter-actions. A leading '-' selects actions not
+// listed.
+static int setFilterActions(const char* arg)
+{
+    bool exclude = arg[0] == '-';
+    uint32_t actions = 0;
+    for (const char* p = arg + (exclude ? 1 : 0); *p != '\0'; p++) {
+        uint32_t bit = filterActionBit(*p);
+        if (bit == 0) {
+            return -1;
+        }
+        actions |= bit;
+    }
+    cfg_filter.actions = exclude ? (FILTER_ACTION_ALL & ~actions) : actions;
+    cfg_filter.enabled = true;
+    return 0;
+}
+
+// Parses SCHEMA.TABLE=COLUMNS of --filter-columns. A leading '-' of
+// COLUMNS selects columns not listed.
+static int setFilterColumns(const char* arg)
+{
+    const char* eq = strchr(arg, '=');
+    if (eq == NULL || eq[1] == '\0') {
+        return -1;
+    }
+    struct FilterTable* t = addFilterTable(arg, eq - arg);
+    if (t == NULL || t->ncolumns > 0) {
+        return -1;
+    }
+
+    const char* p = eq + 1;
+    t->exclude_columns = *p == '-';
+    if (t->exclude_columns) {
+        p++;
+    }
+    while (true) {
+        const char* comma = strchr(p, ',');
+        size_t len = comma != NULL ? (size_t) (comma - p) : strlen(p);
+        if (len == 0) {
+            return -1;
+        }
+        t->columns = realloc(t->columns, sizeof(char*) * (t->ncolumns + 1));
+        t->column_lens = realloc(t->column_lens, sizeof(size_t) * (t->ncolumns + 1));
+        t->columns[t->ncolumns] = strndup(p, len);
+        t->column_lens[t->ncolumns] = len;
+        t->ncolumns++;
+        if (comma == NULL) {
+            break;
+        }
+        p = comma + 1;
+    }
+    cfg_filter.enabled = true;
+    return 0;
+}
+
+static bool isColumnSelected(const struct FilterTable* t, const char* name, size_t len)
+{
+    for (int i = 0; i < t->ncolumns; i++) {
+        if (t->column_lens[i] == len && memcmp(t->columns[i], name, len) == 0) {
+            return !t->exclude_columns;
+        }
+    }
+    return t->exclude_columns;
+}
+
+// Returns the offset after the JSON value at pos, or at the end of the
+// enclosing array or object if pos is there. Strings are skipped without
+// decoding. Returns 0 if the value is incomplete.
+static size_t skipJsonText(const char* json, size_t size, size_t pos)
+{
+    int depth = 0;
+    while (pos < size) {
+        char c = json[pos];
+        if (c == '"') {
+            pos++;
+            while (pos < size && json[pos] != '"') {
+                pos += json[pos] == '\\' ? 2 : 1;
+            }
+            if (pos >= size) {
+                return 0;
+            }
+        }
+        else if (c == '{' || c == '[') {
+            depth++;
+        }
+        else if (c == '}' || c == ']') {
+            if (depth == 0) {
+                return pos;
+            }
+            if (--depth == 0) {
+                return pos + 1;
+            }
+        }
+        else if (c == ',' && depth == 0) {
+            return pos;
+        }
+        pos++;
+    }
+    return 0;
+}
+
+// Writes the record to cfg_filter.record without the elements of
+// "columns" and "identity" arrays whose names are not selected. Returns
+// -1 if the record is not valid JSON.
+static int projectColumns(const char* json, size_t size, const struct FilterTable* t)
+{
+    static const char* const keys[] = { "\"columns\":[", "\"identity\":[" };
+    struct ByteBuffer* out = &cfg_filter.record;
+    out->len = 0;
+
+    size_t copied = 0;
+    for (int k = 0; k < 2; k++) {
+        size_t key_len = strlen(keys[k]);
+        size_t pos = copied + findBytes(json + copied, size - copied, keys[k], key_len);
+        if (pos == size) {
+            continue;
+        }
+        pos += key_len;
+        appendBytes(out, json + copied, pos - copied);
+
+        bool first = true;
+        pos = skipJsonSpace(json, size, pos);
+        while (pos < size && json[pos] != ']') {
+            size_t end = skipJsonText(json, size, pos);
+            if (end <= pos) {
+                return -1;
+            }
+            const char* name;
+            size_t name_len;
+            if (!findJsonStringField(json + pos, end - pos, "\"name\":\"", &name, &name_len) ||
+                    isColumnSelected(t, name, name_len)) {
+                if (!first) {
+                    appendBytes(out, ",", 1);
+                }
+                appendBytes(out, json + pos, end - pos);
+                first = false;
+            }
+            pos = skipJsonSpace(json, size, end);
+            if (pos < size && json[pos] == ',') {
+                pos = skipJsonSpace(json, size, pos + 1);
+            }
+        }
+        if (pos >= size) {
+            return -1;
+        }
+        copied = pos;  // at ']'
+    }
+    appendBytes(out, json + copied, size - copied);
+    return 0;
+}
+
+// Writes a row in a buffer reused by the caller
+static int emitCopy(int64_t wal_pos, int64_t wal_end, int64_t send_time, int64_t receive_time,
+        const char* data, size_t size)
+{
+    if (cfg_transcode != TRANSCODE_NONE) {
+        return emitRecord(wal_pos, wal_end, send_time, receive_time, data, size, NULL);
+    }
+    char* p = reserveByteBuffer(&s_out.data, size);
+    memcpy(p, data, size);
+    s_out.data.len += size;
+    return writeRow(partitionOf(p, size), wal_pos, wal_end, send_time, receive_time, NULL, size, NULL);
+}
+
+static void dropRecord(int64_t wal_pos)
+{
+    if (cfg_filter.dropped_lsn < wal_pos) {
+        cfg_filter.dropped_lsn = wal_pos;
+    }
+}
+
+static void markWritten(int64_t wal_pos)
+{
+    cfg_filter.written_lsn = wal_pos;
+    cfg_filter.written_acked = false;
+}
+
+// Writes the held B record before a record of its transaction
+static int releaseBegin(void)
+{
+    struct Filter* f = &cfg_filter;
+    if (!f->has_begin) {
+        return 0;
+    }
+    f->has_begin = false;
+    markWritten(f->begin_wal_pos);
+    return emitCopy(f->begin_wal_pos, f->begin_wal_end, f->begin_send_time, f->begin_receive_time,
+            f->begin.buf, f->begin.len);
+}
+
+// Confirms dropped records if the consumer acknowledged all records
+// written before them
+static void confirmFiltered(int64_t* r_next_feedback_lsn)
+{
+    if (cfg_filter.written_acked && *r_next_feedback_lsn < cfg_filter.dropped_lsn) {
+        *r_next_feedback_lsn = cfg_filter.dropped_lsn;
+    }
+}
+
+// Writes a row through the filter and the transcoder. Ownership of buf
+// moves to this function even if it fails. If buf is NULL, data is in a
+// buffer reused by the caller and copied. Returns -1 if writing failed,
+// or -2 if the row couldn't be transcoded.
+static int emitRow(
+        int64_t wal_pos, int64_t wal_end, int64_t send_time, int64_t receive_time,
+        const char* data, size_t size, char* buf)
+{
+    struct Filter* f = &cfg_filter;
+    if (!f->enabled) {
+        return emitRecord(wal_pos, wal_end, send_time, receive_time, data, size, buf);
+    }
+
+    const char* action;
+    size_t action_len;
+    if (!findJsonStringField(data, size, "\"action\":\"", &action, &action_len) || action_len != 1) {
+        action = "";
+    }
+
+    const struct FilterTable* t = NULL;
+    bool drop = false;
+    if (action[0] == 'B') {
+        // Hold until a record of the transaction passes
+        f->begin.len = 0;
+        appendBytes(&f->begin, data, size);
+        f->has_begin = true;
+        f->begin_wal_pos = wal_pos;
+        f->begin_wal_end = wal_end;
+        f->begin_send_time = send_time;
+        f->begin_receive_time = receive_time;
+        drop = true;
+    }
+    else if (action[0] == 'C' && f->has_begin) {
+        // The transaction has no records left
+        f->has_begin = false;
+        dropRecord(f->begin_wal_pos);
+        dropRecord(wal_pos);
+        drop = true;
+    }
+    else if (filterActionBit(action[0]) != 0) {
+        const char* schema;
+        size_t schema_len;
+        const char* table;
+        size_t table_len;
+        if (findJsonStringField(data, size, "\"schema\":\"", &schema, &schema_len) &&
+                findJsonStringField(schema + schema_len, data + size - (schema + schema_len),
+                    "\"table\":\"", &table, &table_len)) {
+            t = getFilterTable(schema, schema_len, table, table_len);
+        }
+        if ((f->actions & filterActionBit(action[0])) == 0 ||
+                (f->has_table_list && (t == NULL || !t->included))) {
+            dropRecord(wal_pos);
+            drop = true;
+        }
+    }
+    if (drop) {
+        if (buf != NULL) {
+            freeRowBuffer(buf);
+        }
+        return 0;
+    }
+
+    if (releaseBegin() < 0) {
+        if (buf != NULL) {
+            freeRowBuffer(buf);
+        }
+        return -1;
+    }
+    markWritten(wal_pos);
+
+    if (t != NULL && t->ncolumns > 0) {
+        if (projectColumns(data, size, t) < 0) {
+            if (buf != NULL) {
+                freeRowBuffer(buf);
+            }
+            fprintf(stderr, "Failed to filter columns of a record at %X/%X: not a JSON document\n",
+                    (uint32_t) (wal_pos >> 32), (uint32_t) wal_pos);
+            return -2;
+        }
+        if (buf != NULL) {
+            freeRowBuffer(buf);
+        }
+        return emitCopy(wal_pos, wal_end, send_time, receive_time, f->record.buf, f->record.len);
+    }
+    if (buf == NULL) {
+        return emitCopy(wal_pos, wal_end, send_time, receive_time, data, size);
+    }
+    return emitRecord(wal_pos, wal_end, send_time, receive_time, data, size, buf);
+}
+
+////
+// pgoutput decoder
+//
+// Decodes messages of the pgoutput plugin (protocol version 1, or 2 with
+// --pgoutput-streaming) and writes them as wal2json format-version=2
+// records. Relation messages are cached by OID with their schema, table
+// and column names rendered as JSON once, so that a change costs copying
+// those and its values.
+//
+// With streaming, the server sends changes of a large transaction in
+// blocks before it commits, interleaved with other transactions. Records
+// of a streamed transaction have "xid" (and "subxid" for changes of a
+// subtransaction) and no B record. It ends with a C or an A (abort)
+// record with "xid"; an A record with "subxid" aborts only the changes of
+// the subtransaction.
+//
+
+static uint32_t readPgInt(struct PgReader* r, int bytes)
+{
+    if (r->end - r->p < bytes) {
+        r->error = true;
+        return 0;
+    }
+    uint32_t v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v = (v << 8) | (unsigned char) *r->p++;
+    }
+    return v;
+}
+
+static const char* readPgString(struct PgReader* r)
+{
+    const char* s = r->p;
+    const char* nul = memchr(r->p, '\0', r->end - r->p);
+    if (nul == NULL) {
+        r->error = true;
+        return "";
+    }
+    r->p = nul + 1;
+    return s;
+}
+
+static void* getOidMap(const struct OidMap* map, uint32_t oid)
+{
+    if (map->cap == 0) {
+        return NULL;
+    }
+    for (size_t i = oid & (map->cap - 1); map->keys[i] != 0; i = (i + 1) & (map->cap - 1)) {
+        if (map->keys[i] == oid) {
+            return map->values[i];
+        }
+    }
+    return NULL;
+}
+
+// Puts value and returns the previous value of oid (OID 0 is not allowed)
+static void* putOidMap(struct OidMap* map, uint32_t oid, void* value)
+{
+    if ((map->count + 1) * 2 > map->cap) {
+        struct OidMap old = *map;
+        map->cap = old.cap == 0 ? 64 : old.cap * 2;
+        map->keys = calloc(map->cap, sizeof(uint32_t));
+        map->values = calloc(map->cap, sizeof(void*));
+        map->count = 0;
+        for (size_t i = 0; i < old.cap; i++) {
+            if (old.keys[i] != 0) {
+                putOidMap(map, old.keys[i], old.values[i]);
+            }
+        }
+        free(old.keys);
+        free(old.values);
+    }
+    size_t i = oid & (map->cap - 1);
+    while (map->keys[i] != 0 && map->keys[i] != oid) {
+        i = (i + 1) & (map->cap - 1);
+    }
+    void* prev = map->keys[i] == oid ? map->values[i] : NULL;
+    if (map->keys[i] == 0) {
+        map->count++;
+    }
+    map->keys[i] = oid;
+    map->values[i] = value;
+    return prev;
+}
+
+static void appendJsonString(struct ByteBuffer* bb, const char* str, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    // Every byte may become \u00XX
+    char* start = reserveByteBuffer(bb, len * 6 + 2);
+    char* p = start;
+    *p++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            *p++ = c;
+            continue;
+        }
+        *p++ = '\\';
+        switch (c) {
+        case '"':  *p++ = '"'; break;
+        case '\\': *p++ = '\\'; break;
+        case '\b': *p++ = 'b'; break;
+        case '\f': *p++ = 'f'; break;
+        case '\n': *p++ = 'n'; break;
+        case '\r': *p++ = 'r'; break;
+        case '\t': *p++ = 't'; break;
+        default:
+            *p++ = 'u';
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = digits[c >> 4];
+            *p++ = digits[c & 0xf];
+        }
+    }
+    *p++ = '"';
+    bb->len += p - start;
+}
+
+// Writes a type name in the same way as format_type_with_typemod()
+static void formatPgType(char* buf, size_t size, uint32_t type_oid, int32_t typmod,
+        const struct OidMap* types)
+{
+    // Built-in types of pg_type.dat, with names of format_type()
+    static const struct {
+        uint32_t oid;
+        uint32_t array_oid;
+        const char* name;
+    } builtin_types[] = {
+        { 16, 1000, "boolean" }, { 17, 1001, "bytea" }, { 18, 1002, "\"char\"" },
+        { 19, 1003, "name" }, { 20, 1016, "bigint" }, { 21, 1005, "smallint" },
+        { 22, 1006, "int2vector" }, { 23, 1007, "integer" }, { 24, 1008, "regproc" },
+        { 25, 1009, "text" }, { 26, 1028, "oid" }, { 27, 1010, "tid" }, { 28, 1011, "xid" },
+        { 29, 1012, "cid" }, { 30, 1013, "oidvector" }, { 114, 199, "json" },
+        { 142, 143, "xml" }, { 194, 0, "pg_node_tree" }, { 600, 1017, "point" },
+        { 601, 1018, "lseg" }, { 602, 1019, "path" }, { 603, 1020, "box" },
+        { 604, 1027, "polygon" }, { 628, 629, "line" }, { 650, 651, "cidr" },
+        { 700, 1021, "real" }, { 701, 1022, "double precision" }, { 718, 719, "circle" },
+        { 774, 775, "macaddr8" }, { 790, 791, "money" }, { 829, 1040, "macaddr" },
+        { 869, 1041, "inet" }, { 1033, 1034, "aclitem" }, { 1042, 1014, "character" },
+        { 1043, 1015, "character varying" }, { 1082, 1182, "date" },
+        { 1083, 1183, "time without time zone" },
+        { 1114, 1115, "timestamp without time zone" },
+        { 1184, 1185, "timestamp with time zone" }, { 1186, 1187, "interval" },
+        { 1266, 1270, "time with time zone" }, { 1560, 1561, "bit" },
+        { 1562, 1563, "bit varying" }, { 1700, 1231, "numeric" },
+        { 1790, 2201, "refcursor" }, { 2202, 2207, "regprocedure" },
+        { 2203, 2208, "regoper" }, { 2204, 2209, "regoperator" },
+        { 2205, 2210, "regclass" }, { 2206, 2211, "regtype" }, { 2249, 2287, "record" },
+        { 2275, 1263, "cstring" }, { 2950, 2951, "uuid" }, { 2970, 2949, "txid_snapshot" },
+        { 3220, 3221, "pg_lsn" }, { 3614, 3643, "tsvector" }, { 3615, 3645, "tsquery" },
+        { 3642, 3644, "gtsvector" }, { 3734, 3735, "regconfig" },
+        { 3769, 3770, "regdictionary" }, { 3802, 3807, "jsonb" },
+        { 3904, 3905, "int4range" }, { 3906, 3907, "numrange" },
+        { 3908, 3909, "tsrange" }, { 3910, 3911, "tstzrange" },
+        { 3912, 3913, "daterange" }, { 3926, 3927, "int8range" },
+        { 4072, 4073, "jsonpath" }, { 4089, 4090, "regnamespace" },
+        { 4096, 4097, "regrole" }, { 4191, 4192, "regcollation" },
+        { 4451, 6150, "int4multirange" }, { 4532, 6151, "nummultirange" },
+        { 4533, 6152, "tsmultirange" }, { 4534, 6153, "tstzmultirange" },
+        { 4535, 6155, "datemultirange" }, { 4536, 6157, "int8multirange" },
+        { 5038, 5039, "pg_snapshot" }, { 5069, 271, "xid8" },
+    };
+
+    // An array is written as its element type with typmod followed by []
+    const char* name = NULL;
+    const char* suffix = "";
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++) {
+        if (builtin_types[i].oid == type_oid) {
+            name = builtin_types[i].name;
+            break;
+        }
+        if (builtin_types[i].array_oid == type_oid) {
+            name = builtin_types[i].name;
+            type_oid = builtin_types[i].oid;
+            suffix = "[]";
+            break;
+        }
+    }
+    if (name == NULL) {
+        name = getOidMap(types, type_oid);
+    }
+    if (name == NULL) {
+        // Type message is sent only for user-defined types
+        snprintf(buf, size, "%u", type_oid);
+        return;
+    }
+
+    if (typmod < 0) {
+        snprintf(buf, size, "%s%s", name, suffix);
+    }
+    else if (type_oid == 1042 || type_oid == 1043) {
+        snprintf(buf, size, "%s(%d)%s", name, typmod - 4, suffix);
+    }
+    else if (type_oid == 1700) {
+        snprintf(buf, size, "numeric(%d,%d)%s",
+                ((typmod - 4) >> 16) & 0xffff, (typmod - 4) & 0xffff, suffix);
+    }
+    else if (type_oid == 1560 || type_oid == 1562) {
+        snprintf(buf, size, "%s(%d)%s", name, typmod, suffix);
+    }
+    else if (type_oid == 1083 || type_oid == 1114 || type_oid == 1184 || type_oid == 1266) {
+        // "timestamp(3) with time zone"
+        const char* sp = strchr(name, ' ');
+        snprintf(buf, size, "%.*s(%d)%s%s", (int) (sp - name), name, typmod, sp, suffix);
+    }
+    else {
+        snprintf(buf, size, "%s%s", name, suffix);
+    }
+}
+
+static void destroyPgRelation(struct PgRelation* rel)
+{
+    for (int i = 0; i < rel->natts; i++) {
+        free(rel->columns[i].prefix);
+    }
+    free(rel->columns);
+    free(rel->prefix);
+    free(rel);
+}
+
+static char* copyByteBuffer(struct ByteBuffer* bb, size_t* r_len)
+{
+    char* copy = malloc(bb->len);
+    memcpy(copy, bb->buf, bb->len);
+    *r_len = bb->len;
+    bb->len = 0;
+    return copy;
+}
+
+static int processPgRelation(struct PgReader* r)
+{
+    struct PgRelation* rel = calloc(1, sizeof(struct PgRelation));
+    rel->oid = readPgInt(r, 4);
+    const char* nspname = readPgString(r);
+    const char* relname = readPgString(r);
+    readPgInt(r, 1);  // replica identity
+    rel->natts = (int) readPgInt(r, 2);
+    rel->columns = calloc(rel->natts > 0 ? rel->natts : 1, sizeof(struct PgColumn));
+
+    // "schema":"public","table":"t"
+    struct ByteBuffer bb;
+    initByteBuffer(&bb, 256);
+    appendBytes(&bb, "\"schema\":", 9);
+    if (nspname[0] == '\0') {
+        nspname = "pg_catalog";
+    }
+    appendJsonString(&bb, nspname, strlen(nspname));
+    appendBytes(&bb, ",\"table\":", 9);
+    appendJsonString(&bb, relname, strlen(relname));
+    rel->prefix = copyByteBuffer(&bb, &rel->prefix_len);
+
+    for (int i = 0; i < rel->natts && !r->error; i++) {
+        struct PgColumn* col = &rel->columns[i];
+        col->key = (readPgInt(r, 1) & 1) != 0;
+        rel->has_key |= col->key;
+        const char* attname = readPgString(r);
+        uint32_t type_oid = readPgInt(r, 4);
+        int32_t typmod = (int32_t) readPgInt(r, 4);
+
+        switch (type_oid) {
+        case 20: case 21: case 23: case 26: case 700: case 701: case 1700:
+            col->kind = PG_VALUE_NUMBER;
+            break;
+        case 16:
+            col->kind = PG_VALUE_BOOL;
+            break;
+        default:
+            col->kind = PG_VALUE_STRING;
+        }
+
+        // {"name":"id","type":"integer","value":
+        char type_name[256];
+        formatPgType(type_name, sizeof(type_name), type_oid, typmod, &s_pg_types);
+        appendBytes(&bb, "{\"name\":", 8);
+        appendJsonString(&bb, attname, strlen(attname));
+        appendBytes(&bb, ",\"type\":", 8);
+        appendJsonString(&bb, type_name, strlen(type_name));
+        appendBytes(&bb, ",\"value\":", 9);
+        col->prefix = copyByteBuffer(&bb, &col->prefix_len);
+    }
+    free(bb.buf);
+
+    if (r->error || rel->oid == 0) {
+        destroyPgRelation(rel);
+        return -1;
+    }
+    struct PgRelation* prev = putOidMap(&s_pg_relations, rel->oid, rel);
+    if (prev != NULL) {
+        destroyPgRelation(prev);
+    }
+    return 0;
+}
+
+static int processPgType(struct PgReader* r)
+{
+    uint32_t oid = readPgInt(r, 4);
+    const char* nspname = readPgString(r);
+    const char* typname = readPgString(r);
+    if (r->error || oid == 0) {
+        return -1;
+    }
+    char* name;
+    if (nspname[0] == '\0' || strcmp(nspname, "public") == 0) {
+        name = strdup(typname);
+    }
+    else {
+        name = malloc(strlen(nspname) + 1 + strlen(typname) + 1);
+        sprintf(name, "%s.%s", nspname, typname);
+    }
+    free(putOidMap(&s_pg_types, oid, name));
+    return 0;
+}
+
+static bool isJsonNumberText(const char* s, size_t len)
+{
+    if (len == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (strchr("0123456789+-eE.", s[i]) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends "KEY":[columns...] for TupleData. If keys_only is set, only
+// replica identity columns are written.
+static int appendPgTuple(struct ByteBuffer* bb, struct PgReader* r, const struct PgRelation* rel,
+        const char* key, bool keys_only)
+{
+    int natts = (int) readPgInt(r, 2);
+    if (natts > rel->natts) {
+        r->error = true;
+        return -1;
+    }
+
+    appendBytes(bb, key, strlen(key));
+    bool first = true;
+    for (int i = 0; i < natts && !r->error; i++) {
+        const struct PgColumn* col = &rel->columns[i];
+        char kind = (char) readPgInt(r, 1);
+        if (kind == 'u' || (keys_only && !col->key)) {
+            // Unchanged TOASTed values are omitted like wal2json
+            continue;
+        }
+        if (!first) {
+            appendBytes(bb, ",", 1);
+        }
+        first = false;
+        appendBytes(bb, col->prefix, col->prefix_len);
+        if (kind == 'n') {
+            appendBytes(bb, "null}", 5);
+            continue;
+        }
+        if (kind != 't') {
+            // Binary values are not requested
+            r->error = true;
+            return -1;
+        }
+        size_t len = readPgInt(r, 4);
+        if ((size_t) (r->end - r->p) < len) {
+            r->error = true;
+            return -1;
+        }
+        const char* value = r->p;
+        r->p += len;
+        if (col->kind == PG_VALUE_BOOL) {
+            if (len > 0 && value[0] == 't') {
+                appendBytes(bb, "true}", 5);
+            }
+            else {
+                appendBytes(bb, "false}", 6);
+            }
+        }
+        else if (col->kind == PG_VALUE_NUMBER) {
+            // NaN and Infinity are null like wal2json
+            if (isJsonNumberText(value, len)) {
+                appendBytes(bb, value, len);
+                appendBytes(bb, "}", 1);
+            }
+            else {
+                appendBytes(bb, "null}", 5);
+            }
+        }
+        else {
+            appendJsonString(bb, value, len);
+            appendBytes(bb, "}", 1);
+        }
+    }
+    appendBytes(bb, "]", 1);
+    return r->error ? -1 : 0;
+}
+
+static struct PgRelation* readPgRelation(struct PgReader* r)
+{
+    uint32_t oid = readPgInt(r, 4);
+    struct PgRelation* rel = getOidMap(&s_pg_relations, oid);
+    if (rel == NULL && !r->error) {
+        fprintf(stderr, "pgoutput change of unknown relation OID %u\n", oid);
+        r->error = true;
+    }
+    return rel;
+}
+
+// Appends "xid":XID, of the streamed transaction, and "subxid":XID, if
+// xid of a message is a subtransaction
+static void appendPgXids(struct ByteBuffer* bb, uint32_t xid)
+{
+    char buf[48];
+    int n;
+    if (xid == s_pg_stream.xid) {
+        n = snprintf(buf, sizeof(buf), "\"xid\":%u,", xid);
+    }
+    else {
+        n = snprintf(buf, sizeof(buf), "\"xid\":%u,\"subxid\":%u,", s_pg_stream.xid, xid);
+    }
+    appendBytes(bb, buf, n);
+}
+
+// Renders a change message as a wal2json record into bb. xid is 0 unless
+// the change is streamed.
+static int renderPgChange(struct ByteBuffer* bb, struct PgReader* r, char action, uint32_t xid)
+{
+    struct PgRelation* rel = readPgRelation(r);
+    if (rel == NULL) {
+        return -1;
+    }
+
+    char head[] = "{\"action\":\"?\",";
+    head[11] = action;
+    appendBytes(bb, head, sizeof(head) - 1);
+    if (xid != 0) {
+        appendPgXids(bb, xid);
+    }
+    appendBytes(bb, rel->prefix, rel->prefix_len);
+
+    if (action == 'I') {
+        if (readPgInt(r, 1) != 'N') {
+            return -1;
+        }
+        if (appendPgTuple(bb, r, rel, ",\"columns\":[", false) < 0) {
+            return -1;
+        }
+    }
+    else if (action == 'U') {
+        // Old tuple ('K' for replica identity key or 'O' for FULL) comes
+        // first but is written after the new tuple as "identity". Without
+        // it the key didn't change, and wal2json takes the key columns of
+        // the new tuple.
+        struct ByteBuffer* identity = &s_pg_identity;
+        identity->len = 0;
+        char kind = (char) readPgInt(r, 1);
+        bool has_old = kind == 'K' || kind == 'O';
+        if (has_old) {
+            if (appendPgTuple(identity, r, rel, ",\"identity\":[", kind == 'K') < 0) {
+                return -1;
+            }
+            kind = (char) readPgInt(r, 1);
+        }
+        if (kind != 'N') {
+            return -1;
+        }
+        struct PgReader new_tuple = *r;
+        if (appendPgTuple(bb, r, rel, ",\"columns\":[", false) < 0) {
+            return -1;
+        }
+        if (!has_old && rel->has_key &&
+                appendPgTuple(identity, &new_tuple, rel, ",\"identity\":[", true) < 0) {
+            return -1;
+        }
+        appendBytes(bb, identity->buf, identity->len);
+    }
+    else {  // 'D'
+        char kind = (char) readPgInt(r, 1);
+        if (kind != 'K' && kind != 'O') {
+            return -1;
+        }
+        if (appendPgTuple(bb, r, rel, ",\"identity\":[", kind == 'K') < 0) {
+            return -1;
+        }
+    }
+    appendBytes(bb, "}", 1);
+    return 0;
+}
+
+// Writes a rendered record. Without --transcode and filters, the record is
+// rendered directly into the output arena.
+static int writePgRecord(int64_t wal_pos, int64_t wal_end, int64_t send_time, int64_t receive_time,
+        struct ByteBuffer* bb, size_t offset)
+{
+    if (bb == &s_out.data) {
+        return writeRow(partitionOf(bb->buf + offset, bb->len - offset),
+                wal_pos, wal_end, send_time, receive_time, NULL, bb->len - offset, NULL);
+    }
+    int r = emitRow(wal_pos, wal_end, send_time, receive_time, bb->buf + offset, bb->len - offset, NULL);
+    bb->len = offset;
+    return r;
+}
+
+// Decodes a pgoutput message. Returns -1 if writing failed, or -2 if the
+// message is invalid.
+static int decodePgoutput(int64_t wal_pos, int64_t wal_end, int64_t send_time, int64_t receive_time,
+        const char* data, size_t size)
+{
+    struct PgReader r = { data + 1, data + size, false };
+    struct ByteBuffer* bb = cfg_transcode == TRANSCODE_NONE && !cfg_filter.enabled ?
+        &s_out.data : &s_pg_record;
+    size_t offset = bb->len;
+    int res = 0;
+
+    if (size == 0) {
+        fprintf(stderr, "Empty pgoutput message at %X/%X\n",
+                (uint32_t) (wal_pos >> 32), (uint32_t) wal_pos);
+        return -2;
+    }
+
+    // Messages in a stream block start with the xid of the change
+    bool in_stream = s_pg_stream.active;
+    uint32_t xid = 0;
+    int64_t record_lsn = wal_pos;
+    int64_t record_end = wal_end;
+    if (in_stream) {
+        if (strchr("RYIUDTM", data[0]) != NULL) {
+            xid = readPgInt(&r, 4);
+        }
+        record_lsn = s_pg_stream.ack_lsn;
+        record_end = s_pg_stream.ack_lsn;
+    }
+
+    switch (data[0]) {
+    case 'B':  // Begin
+        appendBytes(bb, "{\"action\":\"B\"}", 14);
+        res = writePgRecord(record_lsn, record_end, send_time, receive_time, bb, offset);
+        break;
+    case 'C':  // Commit
+        appendBytes(bb, "{\"action\":\"C\"}", 14);
+        res = writePgRecord(record_lsn, record_end, send_time, receive_time, bb, offset);
+        break;
+    case 'R':  // Relation
+        if (processPgRelation(&r) < 0) {
+            r.error = true;
+        }
+        break;
+    case 'Y':  // Type
+        if (processPgType(&r) < 0) {
+            r.error = true;
+        }
+        break;
+    case 'I':  // Insert
+    case 'U':  // Update
+    case 'D':  // Delete
+        if (renderPgChange(bb, &r, data[0], xid) < 0) {
+            bb->len = offset;
+            r.error = true;
+            break;
+        }
+        res = writePgRecord(record_lsn, record_end, send_time, receive_time, bb, offset);
+        break;
+    case 'T':  // Truncate: a record for each relation
+        {
+            uint32_t nrels = readPgInt(&r, 4);
+            readPgInt(&r, 1);  // options
+            for (uint32_t i = 0; i < nrels && !r.error && res == 0; i++) {
+                struct PgRelation* rel = readPgRelation(&r);
+                if (rel == NULL) {
+                    break;
+                }
+                appendBytes(bb, "{\"action\":\"T\",", 14);
+                if (xid != 0) {
+                    appendPgXids(bb, xid);
+                }
+                appendBytes(bb, rel->prefix, rel->prefix_len);
+                appendBytes(bb, "}", 1);
+                res = writePgRecord(record_lsn, record_end, send_time, receive_time, bb, offset);
+                offset = bb->len;
+            }
+        }
+        break;
+    case 'S':  // Stream Start
+        s_pg_stream.xid = readPgInt(&r, 4);
+        readPgInt(&r, 1);  // first segment
+        if (in_stream || s_pg_stream.xid == 0) {
+            r.error = true;
+        }
+        s_pg_stream.active = true;
+        break;
+    case 'E':  // Stream Stop
+        if (!in_stream) {
+            r.error = true;
+        }
+        s_pg_stream.active = false;
+        break;
+    case 'c':  // Stream Commit: xid, flags, commit LSN, end LSN and time
+    case 'A':  // Stream Abort: xid and subxid
+        {
+            uint32_t top_xid = readPgInt(&r, 4);
+            uint32_t sub_xid = data[0] == 'A' ? readPgInt(&r, 4) : top_xid;
+            if (in_stream || r.error) {
+                r.error = true;
+                break;
+            }
+            char record[80];
+            int n;
+            if (sub_xid == top_xid) {
+                n = snprintf(record, sizeof(record), "{\"action\":\"%c\",\"xid\":%u}",
+                        data[0] == 'c' ? 'C' : 'A', top_xid);
+            }
+            else {
+                n = snprintf(record, sizeof(record), "{\"action\":\"A\",\"xid\":%u,\"subxid\":%u}",
+                        top_xid, sub_xid);
+            }
+            appendBytes(bb, record, n);
+            res = writePgRecord(record_lsn, record_end, send_time, receive_time, bb, offset);
+        }
+        break;
+    case 'O':  // Origin
+    case 'M':  // Message
+        break;
+    default:
+        r.error = true;
+    }
+
+    // Transactions before this message have all been written
+    if (!in_stream && data[0] != 'S' && s_pg_stream.ack_lsn < wal_pos) {
+        s_pg_stream.ack_lsn = wal_pos;
+    }
+
+    if (res != 0) {
+        return res;
+    }
+    if (r.error) {
+        fprintf(stderr, "Invalid pgoutput message '%c' at %X/%X\n",
+                data[0], (uint32_t) (wal_pos >> 32), (uint32_t) wal_pos);
+        return -2;
+    }
+    return 0;
+}
+
+static int processRow(char* copybuf, int buflen, int64_t now,
+        bool* r_feedback_requested, int64_t* r_received_lsn, int64_t* r_next_feedback_lsn)
+{
+    if (copybuf[0] == 'k') {
+        // Primary keepalive message (B)
+        //   Byte1('k'), Int64, Int64, Byte1
+        if (buflen < 1 + 8 + 8 + 1) {
+            // Protocol error
+            fprintf(stderr, "streaming header too small: %d\n", buflen);
+            return -1;
+        }
+        int64_t wal_pos = fe_recvint64(&copybuf[1]);        // Int64 walEnd
+        //int64_t send_time = fe_recvint64(&copybuf[1 + 8]);  // Int64 sendTime
+        bool reply_requested = copybuf[1 + 8 + 8];          // Byte1 replyRequested
+        if (reply_requested) {
+            *r_feedback_requested = true;
+        }
+        recordKeepalive(&s_stats, wal_pos);
+        if (*r_next_feedback_lsn == InvalidXLogRecPtr) {
+            // Sending feedback can't happen with InvalidXLogRecPtr but keepalive
+            // message is done by a feedback message.
+            // Here needs to update next_feedback_lsn so that keepalive message
+            // can be sent even when next_feedback_lsn is not set ever yet.
+            *r_next_feedback_lsn = wal_pos;
+        }
+        // OK
+        return 0;
+    }
+    else if (copybuf[0] == 'w') {
+        // XLogData (B)
+        //   Byte1('w'), Int64, Int64, Int64, ByteN
+        if (buflen < 1 + 8 + 8 + 8) {
+            // Protocol error
+            fprintf(stderr, "streaming header too small: %d\n", buflen);
+            return -1;
+        }
+        int64_t wal_pos = fe_recvint64(&copybuf[1]);            // Int64 dataStart
+        int64_t wal_end = fe_recvint64(&copybuf[1 + 8]);        // Int64 walEnd
+        int64_t send_time = fe_recvint64(&copybuf[1 + 8 + 8]);  // Int64 sendTime
+        char* data = copybuf + (1 + 8 + 8 + 8);
+        size_t size = buflen - (1 + 8 + 8 + 8);
+        recordReceived(&s_stats, now, wal_pos, wal_end, send_time, size);
+        int r;
+        if (cfg_pgoutput) {
+            // Decoded records are copied
+            r = decodePgoutput(wal_pos, wal_end, send_time, now, data, size);
+            freeRowBuffer(copybuf);
+        }
+        else {
+            // copybuf is released by emitRow after it's written.
+            r = emitRow(wal_pos, wal_end, send_time, now, data, size, copybuf);
+        }
+        if (r == -1) {
+            // Failed to write output
+            perror("failed to write data to output");
+            return -2;
+        }
+        else if (r == -2) {
+            // Invalid record
+            return -3;
+        }
+        // Streamed changes are acknowledged by the end of their transaction
+        int64_t ack_lsn = cfg_pgoutput_streaming ? s_pg_stream.ack_lsn : wal_end;
+        if (cfg_auto_feedback && *r_next_feedback_lsn < ack_lsn) {
+            *r_next_feedback_lsn = ack_lsn;
+        }
+        if (*r_received_lsn < wal_pos) {
+            *r_received_lsn = wal_pos;
+        }
+        // OK
+        return 2;
+    }
+    else {
+        // Protocol error
+        fprintf(stderr, "unrecognized streaming header '%c', size=%d bytes\n",
+                copybuf[0], buflen);
+        return -1;
+    }
+}
+
+// Writes a piece of an XLogData message larger than --stream-threshold
+// (see getCopyReaderData). The header of the record is written with the
+// first piece, and the record is acknowledged with the last one.
+static int processRowPiece(char* buf, int buflen, int64_t now,
+        int64_t* r_received_lsn, int64_t* r_next_feedback_lsn)
+{
+    struct StreamedRow* row = &s_streamed_row;
+    char* data = buf;
+    size_t size = buflen;
+    if (s_reader.piece == COPY_FIRST_PIECE) {
+        // XLogData (B)
+        //   Byte1('w'), Int64, Int64, Int64, ByteN
+        row->wal_pos = fe_recvint64(&buf[1]);                   // Int64 dataStart
+        row->wal_end = fe_recvint64(&buf[1 + 8]);               // Int64 walEnd
+        int64_t send_time = fe_recvint64(&buf[1 + 8 + 8]);      // Int64 sendTime
+        data += 1 + 8 + 8 + 8;
+        size -= 1 + 8 + 8 + 8;
+        size_t total = size + s_reader.stream_left;
+        recordReceived(&s_stats, now, row->wal_pos, row->wal_end, send_time, total);
+        if (cfg_unordered_feedback) {
+            pushInflight(&s_inflight, row->wal_pos, 1);
+        }
+        row->receive_time = now;
+        appendRowHeader(&s_out, row->wal_pos, row->wal_end, send_time, total);
+    }
+
+    bool last = s_reader.stream_left == 0;
+    if (appendRowPiece(&s_out, row->wal_pos, row->receive_time, data, size, buf, last) < 0) {
+        perror("failed to write data to output");
+        return -2;
+    }
+    if (last) {
+        if (cfg_auto_feedback && *r_next_feedback_lsn < row->wal_end) {
+            *r_next_feedback_lsn = row->wal_end;
+        }
+        if (*r_received_lsn < row->wal_pos) {
+            *r_received_lsn = row->wal_pos;
+        }
+    }
+    return 2;
+}
+
+static void initCmdBuffer(struct CmdBuffer* cb)
+{
+    cb->buf = malloc(CMD_BUFSIZ);
+    cb->read_pos = 0;
+    cb->scan_pos = 0;
+    cb->write_pos = 0;
+}
+
+// Reads command input from fd into cb. set_flags are file status flags
+// set on fd while reading.
+static int getCmdData(struct CmdBuffer* cb, int fd, int set_flags)
+{
+    size_t used = cb->write_pos - cb->read_pos;
+    if (used == CMD_BUFSIZ) {
+        // A text command longer than the buffer
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // Free space of the ring is at most two regions
+    size_t offset = cb->write_pos % CMD_BUFSIZ;
+    size_t space = CMD_BUFSIZ - used;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = cb->buf + offset;
+    iov[0].iov_len = CMD_BUFSIZ - offset;
+    if (iov[0].iov_len >= space) {
+        iov[0].iov_len = space;
+    }
+    else {
+        iov[1].iov_base = cb->buf;
+        iov[1].iov_len = space - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    if (set_flags) {
+        // set non-blocking flag if necessary
+        if (fcntl(fd, F_SETFL, set_flags) < 0) {
+            return -1;
+        }
+    }
+
+    int retval;
+    ssize_t len = readv(fd, iov, iovcnt);
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK) {
+            retval = 0;  // not ready to read
+        }
+        else {
+            retval = -1;  // read error
+        }
+        goto done;
+    }
+    else if (len == 0) {
+        retval = -2;  // closed
+        goto done;
+    }
+    else {
+        cb->write_pos += len;
+        retval = (int) len;  // OK
+        goto done;
+    }
+
+done:
+    if (set_flags) {
+        // Restore flags back
+        if (fcntl(fd, F_SETFL, set_flags | ~O_NONBLOCK) < 0) {
+            return -1;
+        }
+    }
+    return retval;
+}
+
+// Applies the LSN of an F command read from part (NULL for the command fd)
+// to r_ack_lsn. With --unordered-feedback or --partition, it's the flush
+// LSN of the acknowledged prefix.
+static int applyAck(struct Partition* part, int64_t lsn, int64_t* r_ack_lsn)
+{
+    bool advanced;
+    if (part != NULL) {
+        advanced = ackPartition(part, lsn);
+    }
+    else if (cfg_partition_count > 0) {
+        fprintf(stderr, "F commands must be sent to the command fds of partitions\n");
+        return -1;
+    }
+    else if (cfg_unordered_feedback) {
+        advanced = ackInflight(&s_inflight, lsn);
+    }
+    else {
+        *r_ack_lsn = lsn;
+        return 0;
+    }
+    if (advanced) {
+        *r_ack_lsn = s_inflight.flushed_lsn;
+    }
+    return 0;
+}
+
+static const char* parseHex32(const char* p, const char* end, uint32_t* r_value)
+{
+    const char* begin = p;
+    uint32_t v = 0;
+    while (p < end && p - begin < 8) {
+        char c = *p;
+        if (c >= '0' && c <= '9') v = (v << 4) | (c - '0');
+        else if (c >= 'A' && c <= 'F') v = (v << 4) | (c - 'A' + 10);
+        else if (c >= 'a' && c <= 'f') v = (v << 4) | (c - 'a' + 10);
+        else break;
+        p++;
+    }
+    *r_value = v;
+    return p == begin ? NULL : p;
+}
+
+// Parses "%X/%X" at p. Returns false if it's not a LSN.
+static bool parseLsn(const char* p, const char* end, int64_t* r_lsn)
+{
+    uint32_t high32;
+    uint32_t low32;
+    p = parseHex32(p, end, &high32);
+    if (p == NULL || p == end || *p != '/') {
+        return false;
+    }
+    p = parseHex32(p + 1, end, &low32);
+    if (p == NULL) {
+        return false;
+    }
+    *r_lsn = (((int64_t) high32) << 32) | ((int64_t) low32);
+    return true;
+}
+
+// Sets the LSN of an F command to r_ack_lsn (see applyAck). The caller
+// applies the last one of a batch of commands as the acknowledged LSN.
+static int processOneCommand(struct Partition* part, const char* cmd, size_t len,
+        int64_t* r_ack_lsn, bool* r_quit_requested)
+{
+    if (len == 0 || cmd[0] == '#') {
+        // NOP
+        return 0;
+    }
+    else if (cmd[0] == 'F') {
+        const char* p = cmd + 1;
+        const char* end = cmd + len;
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        int64_t lsn;
+        if (!parseLsn(p, end, &lsn)) {
+            fprintf(stderr, "Invalid F command: %s\n", cmd);
+            return -1;
+        }
+        return applyAck(part, lsn, r_ack_lsn);
+    }
+    else if (cmd[0] == 'S') {
+        if (*r_ack_lsn != InvalidXLogRecPtr) {
+            recordAck(&s_stats, *r_ack_lsn);
+        }
+        if (writeStats(&s_stats) < 0) {
+            perror("Failed to write stats");
+            return -1;
+        }
+        return 0;
+    }
+    else if (cmd[0] == 'q') {
+        *r_quit_requested = true;
+        return 0;
+    }
+    fprintf(stderr, "Invalid command: %s\n", cmd);
+    return -1;
+}
+
+// Processes new line separated text commands in cb
+static int processTextCommands(struct CmdBuffer* cb, struct Partition* part,
+        int64_t* r_ack_lsn, bool* r_quit_requested)
+{
+    static char line[CMD_LINE_MAX + 1];
+
+    while (cb->scan_pos < cb->write_pos) {
+        // find the next \n character from scan_pos in the contiguous
+        // region of the ring
+        size_t offset = cb->scan_pos % CMD_BUFSIZ;
+        size_t len = cb->write_pos - cb->scan_pos;
+        if (len > CMD_BUFSIZ - offset) {
+            len = CMD_BUFSIZ - offset;
+        }
+        char* nl = memchr(cb->buf + offset, '\n', len);
+        if (nl == NULL) {
+            cb->scan_pos += len;
+            continue;
+        }
+        *nl = '\0';
+        size_t end_pos = cb->scan_pos + (nl - (cb->buf + offset));
+
+        const char* cmd;
+        size_t cmd_len = end_pos - cb->read_pos;
+        size_t cmd_offset = cb->read_pos % CMD_BUFSIZ;
+        if (cmd_offset + cmd_len <= CMD_BUFSIZ) {
+            cmd = cb->buf + cmd_offset;
+        }
+        else {
+            // Copy the command wrapped around the end of the ring
+            if (cmd_len > CMD_LINE_MAX) {
+                fprintf(stderr, "Too long command: %zu bytes\n", cmd_len);
+                return -1;
+            }
+            size_t first = CMD_BUFSIZ - cmd_offset;
+            memcpy(line, cb->buf + cmd_offset, first);
+            memcpy(line + first, cb->buf, cmd_len - first);
+            line[cmd_len] = '\0';
+            cmd = line;
+        }
+
+        int r = processOneCommand(part, cmd, cmd_len, r_ack_lsn, r_quit_requested);
+        if (r < 0) {
+            return -1;
+        }
+        cb->read_pos = end_pos + 1;
+        cb->scan_pos = cb->read_pos;
+    }
+    return 0;
+}
+
+// Processes complete frames of --binary-commands in cb.
+//   Byte1 command ('F', 'S' or 'q'), Byte7 reserved, UInt64 LSN of F
+//   (little endian)
+static int processBinaryCommands(struct CmdBuffer* cb, struct Partition* part,
+        int64_t* r_ack_lsn, bool* r_quit_requested)
+{
+    while (cb->write_pos - cb->read_pos >= CMD_FRAME_SIZE) {
+        const unsigned char* frame = (const unsigned char*) cb->buf + cb->read_pos % CMD_BUFSIZ;
+        switch (frame[0]) {
+        case 'F':
+            {
+                uint64_t lsn = 0;
+                for (int i = 7; i >= 0; i--) {
+                    lsn = (lsn << 8) | frame[8 + i];
+                }
+                if (applyAck(part, (int64_t) lsn, r_ack_lsn) < 0) {
+                    return -1;
+                }
+            }
+            break;
+        case 'S':
+            if (*r_ack_lsn != InvalidXLogRecPtr) {
+                recordAck(&s_stats, *r_ack_lsn);
+            }
+            if (writeStats(&s_stats) < 0) {
+                perror("Failed to write stats");
+                return -1;
+            }
+            break;
+        case 'q':
+            *r_quit_requested = true;
+            break;
+        default:
+            fprintf(stderr, "Invalid binary command: 0x%02x\n", frame[0]);
+            return -1;
+        }
+        cb->read_pos += CMD_FRAME_SIZE;
+    }
+    return 0;
+}
+
+// Processes all complete commands read to cb from the command fd, or
+// from the command fd of part with --partition. F commands are cumulative
+// unless --unordered-feedback is set; only the resulting acknowledged LSN
+// of a batch is applied.
+static int processCommands(struct CmdBuffer* cb, struct Partition* part,
+        int64_t* r_next_feedback_lsn, bool* r_quit_requested)
+{
+    int64_t ack_lsn = InvalidXLogRecPtr;
+    bool quit_requested = false;
+
+    int r;
+    if (cfg_binary_commands) {
+        r = processBinaryCommands(cb, part, &ack_lsn, &quit_requested);
+    }
+    else {
+        r = processTextCommands(cb, part, &ack_lsn, &quit_requested);
+    }
+
+    if (ack_lsn != InvalidXLogRecPtr) {
+        *r_next_feedback_lsn = ack_lsn;
+        recordAck(&s_stats, ack_lsn);
+        filterAcked(ack_lsn);
+    }
+    if (quit_requested) {
+        *r_quit_requested = true;
+    }
+    return r;
+}
+
+////
+// Checkpoint
+//
+// With --checkpoint, the LSN acknowledged by the consumer is also kept in
+// a local file, so that replication restarts from it even if the server
+// didn't receive the last feedback (e.g. after a failover to a standby
+// with a copy of the slot). Acknowledgements within --checkpoint-interval
+// are written together, paying one fdatasync(2) per interval instead of
+// one per F command.
+
+// Opens the checkpoint file, creating it if it doesn't exist, and sets the
+// LSN in it to r_lsn (InvalidXLogRecPtr if the file is empty)
+static int openCheckpoint(struct Checkpoint* cp, const char* path, int64_t* r_lsn)
+{
+    cp->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cp->fd < 0) {
+        return -1;
+    }
+    char buf[CHECKPOINT_SIZE];
+    ssize_t n = pread(cp->fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+        return -1;
+    }
+    cp->lsn = InvalidXLogRecPtr;
+    cp->written_at = 0;
+    if (n > 0 && !parseLsn(buf, buf + n, &cp->lsn)) {
+        errno = EINVAL;
+        return -1;
+    }
+    *r_lsn = cp->lsn;
+    return 0;
+}
+
+// Overwrites the checkpoint with lsn and waits until it's on disk
+static int writeCheckpoint(struct Checkpoint* cp, int64_t now, int64_t lsn)
+{
+    char buf[CHECKPOINT_SIZE];
+    memset(buf, ' ', sizeof(buf));
+    formatLsn(buf, lsn);
+    buf[CHECKPOINT_SIZE - 1] = '\n';
+    ssize_t n = pwrite(cp->fd, buf, sizeof(buf), 0);
+    if (n != (ssize_t) sizeof(buf)) {
+        if (n >= 0) {
+            errno = EIO;
+        }
+        return -1;
+    }
+#ifdef __linux__
+    if (fdatasync(cp->fd) < 0) {
+#else
+    if (fsync(cp->fd) < 0) {
+#endif
+        return -1;
+    }
+    cp->lsn = lsn;
+    cp->written_at = now;
+    return 0;
+}
+
+// Writes lsn if it advanced and --checkpoint-interval passed since the
+// last write, or right away if force is set
+static int updateCheckpoint(struct Checkpoint* cp, int64_t now, int64_t lsn, bool force)
+{
+    if (cp->fd < 0 || lsn <= cp->lsn) {
+        return 0;
+    }
+    if (!force && !feTimestampDifferenceExceeds(cp->written_at, now, cfg_checkpoint_interval)) {
+        return 0;
+    }
+    return writeCheckpoint(cp, now, lsn);
+}
+
+// Returns when updateCheckpoint writes lsn, or NO_DEADLINE
+static int64_t checkpointDeadline(const struct Checkpoint* cp, int64_t lsn)
+{
+    if (cp->fd < 0 || lsn <= cp->lsn) {
+        return NO_DEADLINE;
+    }
+    return cp->written_at + cfg_checkpoint_interval * 1000L;
+}
+
+static void closeCheckpoint(struct Checkpoint* cp)
+{
+    if (cp->fd >= 0) {
+        close(cp->fd);
+        cp->fd = -1;
+    }
+}
+
+////
+// Replication loop
+//
+static int sendFeedback(PGconn* conn, int64_t now, int64_t received_lsn, int64_t next_feedback_lsn,
+        bool reply_requested)
+{
+    if (received_lsn < next_feedback_lsn) {
+        received_lsn = next_feedback_lsn;
+    }
+
+    if (cfg_verbose) {
+        fprintf(stderr, "Sending feedback: write_LSN=%X/%X flush_LSN=%X/%X\n",
+                (uint32_t) (received_lsn >> 32),
+                (uint32_t) received_lsn,
+                (uint32_t) (next_feedback_lsn >> 32),
+                (uint32_t) next_feedback_lsn);
+    }
+
+    // Standby status update (F)
+    //   Byte1('r'), Int64, Int64, Int64, Int64, Byte1
+    char replybuf[1 + 8 + 8 + 8 + 8 + 1];
+    char* p = replybuf;
+    *p = 'r';                            // 'r'
+    p += 1;
+    fe_sendint64(received_lsn, p);       // Int64 writeLSN
+    p += 8;
+    fe_sendint64(next_feedback_lsn, p);  // Int64 flushLSN
+    p += 8;
+    fe_sendint64(InvalidXLogRecPtr, p);  // Int64 applyLSN
+    p += 8;
+    fe_sendint64(now, p);                // Int64 sendTime
+    p += 8;
+    *p = reply_requested ? 1 : 0;        // Byte1 replyRequested
+
+    if (isDirectRead(conn)) {
+        if (sendCopyReaderMessage(&s_reader, 'd', replybuf, sizeof(replybuf)) < 0) {
+            fprintf(stderr, "Failed to send a standby status update: %s\n", s_reader.error);
+            return -1;
+        }
+    }
+    else if (PQputCopyData(conn, replybuf, sizeof(replybuf)) <= 0 || PQflush(conn)) {
+        fprintf(stderr, "Failed to send a standby status update: %s\n", PQerrorMessage(conn));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns the reason to send feedback now, or FEEDBACK_NONE
+static FeedbackReason isFeedbackNeeded(int64_t now, bool feedback_requested,
+        int64_t next_feedback_lsn, int64_t last_sent_feedback_lsn,
+        int64_t last_feedback_sent_at)
+{
+    if (next_feedback_lsn == InvalidXLogRecPtr) {
+        // Feedback can't be sent with InvalidXLogRecPtr.
+        return FEEDBACK_NONE;
+    }
+    if (feedback_requested) {
+        // send feedback if server requests reply with 'k' message
+        return FEEDBACK_REQUESTED;
+    }
+    if (next_feedback_lsn != last_sent_feedback_lsn &&
+            feTimestampDifferenceExceeds(last_feedback_sent_at, now, cfg_feedback_interval)) {
+        // send feedback every feedback interval if next_feedback_lsn is updated
+        return FEEDBACK_INTERVAL;
+    }
+    if (cfg_standby_message_interval != 0 &&
+            feTimestampDifferenceExceeds(last_feedback_sent_at, now, cfg_standby_message_interval)) {
+        // send feedback every standby message interval regardless of next_feedback_lsn
+        return FEEDBACK_STATUS;
+    }
+    return FEEDBACK_NONE;
+}
+
+static void feedbackDeadlines(
+        int64_t next_feedback_lsn, int64_t last_sent_feedback_lsn,
+        int64_t last_feedback_sent_at,
+        int64_t* r_feedback_deadline, int64_t* r_status_deadline)
+{
+    *r_feedback_deadline = NO_DEADLINE;
+    *r_status_deadline = NO_DEADLINE;
+
+    // send feedback every feedback interval if next_feedback_lsn is updated
+    if (next_feedback_lsn != InvalidXLogRecPtr &&
+            next_feedback_lsn != last_sent_feedback_lsn) {
+        *r_feedback_deadline = last_feedback_sent_at + cfg_feedback_interval * 1000L;
+    }
+
+    // send feedback every standby message interval regardless of next_feedback_lsn
+    if (next_feedback_lsn != InvalidXLogRecPtr &&
+            cfg_standby_message_interval != 0) {
+        *r_status_deadline = last_feedback_sent_at + cfg_standby_message_interval * 1000L;
+    }
+}
+
+#ifndef USE_EPOLL
+static long selectTimeoutMillis(int64_t now,
+        int64_t feedback_deadline, int64_t status_deadline)
+{
+    long minMsec = LONG_MAX;
+
+    if (feedback_deadline != NO_DEADLINE) {
+        long msec = (feedback_deadline - now) / 1000L;
+        if (msec < minMsec) minMsec = msec;
+    }
+
+    if (status_deadline != NO_DEADLINE) {
+        long msec = (status_deadline - now) / 1000L;
+        if (msec < minMsec) minMsec = msec;
+    }
+
+    // wait at least 300 milliseconds
+    if (minMsec < 0L) {
+        return 300L;
+    }
+
+    // wait at most 60 seconds
+    if (minMsec > 60 * 1000L) {
+        return 60 * 1000L;
+    }
+
+    return minMsec;
+}
+#endif
+
+#ifdef USE_EPOLL
+static int armTimer(int timer_fd, int64_t deadline)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (deadline != NO_DEADLINE) {
+        // PostgreSQL epoch to UNIX epoch. it_value must not be zero
+        // because zero disarms the timer.
+        int64_t unix_usec = deadline +
+            ((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC);
+        if (unix_usec <= 0) {
+            unix_usec = 1;
+        }
+        spec.it_value.tv_sec = unix_usec / USECS_PER_SEC;
+        spec.it_value.tv_nsec = (unix_usec % USECS_PER_SEC) * 1000L;
+    }
+    return timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static int addEpollFd(struct EventLoop* loop, int fd, uint32_t event, bool write)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = write ? EPOLLOUT : EPOLLIN;
+    ev.data.u32 = event;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+#endif
+
+static int initEventLoop(struct EventLoop* loop)
+{
+    loop->count = 0;
+    loop->feedback_deadline = NO_DEADLINE;
+    loop->status_deadline = NO_DEADLINE;
+#ifdef USE_EPOLL
+    loop->feedback_timer_fd = -1;
+    loop->status_timer_fd = -1;
+    loop->epoll_fd = -1;
+#ifdef USE_IO_URING
+    loop->uring = s_uring.fd >= 0;
+    if (loop->uring) {
+        // Completions of polls of a previous loop are told apart by the id
+        loop->uring_id = ++s_uring.loop_id;
+        s_uring.deferred_count = 0;
+        return 0;
+    }
+#endif
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        return -1;
+    }
+    loop->feedback_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->feedback_timer_fd < 0) {
+        return -1;
+    }
+    loop->status_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->status_timer_fd < 0) {
+        return -1;
+    }
+    if (addEpollFd(loop, loop->feedback_timer_fd, EVENT_FEEDBACK_TIMER, false) < 0 ||
+            addEpollFd(loop, loop->status_timer_fd, EVENT_STATUS_TIMER, false) < 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void destroyEventLoop(struct EventLoop* loop)
+{
+#ifdef USE_IO_URING
+    if (loop->uring) {
+        // Cancel polls so that they don't keep the fds open. Completions
+        // are ignored since they have the id of this loop.
+        for (int i = 0; i < loop->count; i++) {
+            if (!loop->sources[i].armed) {
+                continue;
+            }
+            struct io_uring_sqe* sqe = getUringSqe(&s_uring);
+            if (sqe == NULL) {
+                break;
+            }
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = ((uint64_t) loop->uring_id << 32) | (uint64_t) i;
+            loop->sources[i].armed = false;
+        }
+        enterUring(&s_uring, 0, -1);
+    }
+#endif
+#ifdef USE_EPOLL
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+    if (loop->feedback_timer_fd >= 0) close(loop->feedback_timer_fd);
+    if (loop->status_timer_fd >= 0) close(loop->status_timer_fd);
+    loop->epoll_fd = -1;
+    loop->feedback_timer_fd = -1;
+    loop->status_timer_fd = -1;
+#endif
+}
+
+static int pollEventSource(struct EventLoop* loop, struct EventSource* src)
+{
+#ifdef USE_IO_URING
+    if (loop->uring) {
+        // Polled by the next waitEvents call
+        src->enabled = true;
+        return 0;
+    }
+#endif
+#ifdef USE_EPOLL
+    if (addEpollFd(loop, src->fd, src->event, src->write) < 0) {
+        if (errno != EPERM) {
+            return -1;
+        }
+        // epoll doesn't support regular files and some devices. They
+        // are always readable and writable as select(2) reports.
+        src->always_ready = true;
+    }
+#endif
+    src->enabled = true;
+    return 0;
+}
+
+static int addPolledSource(struct EventLoop* loop, int fd, uint32_t event,
+        bool write, bool enabled)
+{
+    if (loop->count >= EVENT_SOURCES_MAX) {
+        errno = EMFILE;
+        return -1;
+    }
+#ifndef USE_EPOLL
+    if (fd >= FD_SETSIZE) {
+        errno = EBADF;
+        return -1;
+    }
+#endif
+    struct EventSource* src = &loop->sources[loop->count];
+    src->fd = fd;
+    src->event = event;
+    src->write = write;
+    src->enabled = false;
+    src->always_ready = false;
+    src->armed = false;
+    if (enabled && pollEventSource(loop, src) < 0) {
+        return -1;
+    }
+    loop->count++;
+    return 0;
+}
+
+static int addEventSource(struct EventLoop* loop, int fd, uint32_t event)
+{
+    return addPolledSource(loop, fd, event, false, true);
+}
+
+// Adds fd polled for writability. It is disabled until
+// setEventSourceEnabled is called.
+static int addWriteEventSource(struct EventLoop* loop, int fd, uint32_t event)
+{
+    return addPolledSource(loop, fd, event, true, false);
+}
+
+// Starts or stops polling fd for readability or writability
+static int setEventSourceEnabled(struct EventLoop* loop, int fd, bool write, bool enabled)
+{
+    for (int i = 0; i < loop->count; i++) {
+        struct EventSource* src = &loop->sources[i];
+        if (src->fd != fd || src->write != write || src->enabled == enabled) {
+            continue;
+        }
+        if (enabled) {
+            if (pollEventSource(loop, src) < 0) {
+                return -1;
+            }
+            continue;
+        }
+#ifdef USE_IO_URING
+        if (loop->uring) {
+            // A submitted poll is left and its completion is ignored
+            src->enabled = false;
+            continue;
+        }
+#endif
+#ifdef USE_EPOLL
+        // Removed rather than modified to an empty event mask since epoll
+        // reports hangups of the fd anyway
+        if (!src->always_ready && epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+            return -1;
+        }
+#endif
+        src->enabled = false;
+    }
+    return 0;
+}
+
+static int setEventDeadlines(struct EventLoop* loop,
+        int64_t feedback_deadline, int64_t status_deadline)
+{
+#ifdef USE_IO_URING
+    if (loop->uring) {
+        // waitUring computes the timeout from the deadlines
+        loop->feedback_deadline = feedback_deadline;
+        loop->status_deadline = status_deadline;
+        return 0;
+    }
+#endif
+#ifdef USE_EPOLL
+    // Re-arm timers only when deadlines change
+    if (loop->feedback_deadline != feedback_deadline) {
+        if (armTimer(loop->feedback_timer_fd, feedback_deadline) < 0) {
+            return -1;
+        }
+    }
+    if (loop->status_deadline != status_deadline) {
+        if (armTimer(loop->status_timer_fd, status_deadline) < 0) {
+            return -1;
+        }
+    }
+#endif
+    loop->feedback_deadline = feedback_deadline;
+    loop->status_deadline = status_deadline;
+    return 0;
+}
+
+#ifdef USE_EPOLL
+// Adds event bits of ready sources to events. Returns -1 on errors.
+static int waitEpoll(struct EventLoop* loop, uint32_t* events)
+{
+    struct epoll_event evs[EVENT_SOURCES_MAX + 2];
+    int r = epoll_wait(loop->epoll_fd, evs, EVENT_SOURCES_MAX + 2, *events != 0 ? 0 : -1);
+    if (r < 0) {
+        if (errno == EINTR) {
+            // Interrupted by a signal
+            return 0;
+        }
+        perror("epoll_wait(2)");
+        return -1;
+    }
+    uint32_t ready = 0;
+    for (int i = 0; i < r; i++) {
+        ready |= evs[i].data.u32;
+    }
+    // Consume expirations of timers so that they don't stay readable.
+    // Expired timers are re-armed by the next setEventDeadlines call.
+    uint64_t expirations;
+    if (ready & EVENT_FEEDBACK_TIMER) {
+        if (read(loop->feedback_timer_fd, &expirations, sizeof(expirations)) > 0) {
+            loop->feedback_deadline = NO_DEADLINE;
+        }
+    }
+    if (ready & EVENT_STATUS_TIMER) {
+        if (read(loop->status_timer_fd, &expirations, sizeof(expirations)) > 0) {
+            loop->status_deadline = NO_DEADLINE;
+        }
+    }
+    *events |= ready & ~(EVENT_FEEDBACK_TIMER | EVENT_STATUS_TIMER);
+    return 0;
+}
+#else
+// Adds event bits of ready sources to events. Returns -1 on errors.
+static int waitSelect(struct EventLoop* loop, int64_t now, uint32_t* events)
+{
+    fd_set select_fds;
+    fd_set write_fds;
+    FD_ZERO(&select_fds);
+    FD_ZERO(&write_fds);
+    int max_fd = -1;
+    for (int i = 0; i < loop->count; i++) {
+        if (!loop->sources[i].enabled) {
+            continue;
+        }
+        FD_SET(loop->sources[i].fd, loop->sources[i].write ? &write_fds : &select_fds);
+        if (max_fd < loop->sources[i].fd) max_fd = loop->sources[i].fd;
+    }
+
+    struct timeval timeout;
+    long timeoutMillis = selectTimeoutMillis(now,
+            loop->feedback_deadline, loop->status_deadline);
+    timeout.tv_sec = timeoutMillis / 1000L;
+    timeout.tv_usec = timeoutMillis % 1000L * 1000L;
+
+    int r = select(max_fd + 1, &select_fds, &write_fds, NULL, &timeout);
+    if (r < 0) {
+        if (errno == EINTR) {
+            // Interrupted by a signal
+            return 0;
+        }
+        perror("select(2)");
+        return -1;
+    }
+    for (int i = 0; i < loop->count; i++) {
+        if (loop->sources[i].enabled &&
+                FD_ISSET(loop->sources[i].fd, loop->sources[i].write ? &write_fds : &select_fds)) {
+            *events |= loop->sources[i].event;
+        }
+    }
+    return 0;
+}
+#endif
+
+#ifdef USE_IO_URING
+// Adds the event bit of the source of a poll completion to events
+static void completeUringPoll(struct EventLoop* loop, uint64_t data, uint32_t* events)
+{
+    uint32_t i = (uint32_t) data;
+    if ((uint32_t) (data >> 32) != loop->uring_id || i >= (uint32_t) loop->count) {
+        return;
+    }
+    struct EventSource* src = &loop->sources[i];
+    src->armed = false;
+    if (src->enabled) {
+        *events |= src->event;
+    }
+}
+
+// Submits polls of enabled sources and waits for one of them or the
+// earliest deadline with one io_uring_enter(2). Polls are one-shot and
+// submitted again after they complete, so readiness is level-triggered
+// as with epoll. Adds event bits of ready sources to events. Returns -1
+// on errors.
+static int waitUring(struct EventLoop* loop, int64_t now, uint32_t* events)
+{
+    for (int i = 0; i < loop->count; i++) {
+        struct EventSource* src = &loop->sources[i];
+        if (!src->enabled || src->armed) {
+            continue;
+        }
+        struct io_uring_sqe* sqe = getUringSqe(&s_uring);
+        if (sqe == NULL) {
+            perror("io_uring_enter(2)");
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = src->fd;
+        sqe->poll32_events = src->write ? POLLOUT : POLLIN;
+        sqe->user_data = ((uint64_t) loop->uring_id << 32) | (uint64_t) i;
+        src->armed = true;
+    }
+
+    int64_t timeout = -1;
+    int64_t deadline = loop->feedback_deadline < loop->status_deadline ?
+        loop->feedback_deadline : loop->status_deadline;
+    if (*events != 0 || s_uring.deferred_count > 0) {
+        timeout = 0;
+    }
+    else if (deadline != NO_DEADLINE) {
+        timeout = deadline > now ? deadline - now : 0;
+    }
+    if (enterUring(&s_uring, 1, timeout) < 0 && errno != ETIME && errno != EINTR) {
+        perror("io_uring_enter(2)");
+        return -1;
+    }
+
+    for (int i = 0; i < s_uring.deferred_count; i++) {
+        completeUringPoll(loop, s_uring.deferred[i], events);
+    }
+    s_uring.deferred_count = 0;
+    uint64_t data;
+    int32_t res;
+    while (popUringCqe(&s_uring, &data, &res)) {
+        completeUringPoll(loop, data, events);
+    }
+    return 0;
+}
+#endif
+
+// Returns 0 and sets event bits of ready sources to r_events. r_events
+// is 0 if timeout or interrupted by a signal. Returns -1 on errors.
+static int waitEvents(struct EventLoop* loop, int64_t now, uint32_t* r_events)
+{
+    int64_t started_at = feGetCurrentTimestamp();
+    uint32_t events = 0;
+    for (int i = 0; i < loop->count; i++) {
+        if (loop->sources[i].enabled && loop->sources[i].always_ready) {
+            events |= loop->sources[i].event;
+        }
+    }
+
+#if defined(USE_IO_URING)
+    int r = loop->uring ? waitUring(loop, now, &events) : waitEpoll(loop, &events);
+#elif defined(USE_EPOLL)
+    int r = waitEpoll(loop, &events);
+#else
+    int r = waitSelect(loop, now, &events);
+#endif
+    if (r < 0) {
+        return -1;
+    }
+
+    s_stats.wakeups++;
+    s_stats.wait_time += feGetCurrentTimestamp() - started_at;
+    *r_events = events;
+    return 0;
+}
+
+static int addSpoolSources(struct EventLoop* loop)
+{
+    if (cfg_spool_size == 0) {
+        return 0;
+    }
+    if (addWriteEventSource(loop, s_out.fd, EVENT_OUT) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < cfg_partition_count; i++) {
+        if (addWriteEventSource(loop, cfg_partitions[i].out.fd, EVENT_OUT) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Polls outputs for writability while they have spooled data, and sets
+// r_paused to true if reading replication streams should pause because
+// a spool is full or the ring has a backlog
+static int pollSpools(struct EventLoop* loop, bool* r_paused)
+{
+    if (s_ring.header != NULL) {
+        // The consumer writes the wait fd when it frees space
+        *r_paused = hasRingBacklog(&s_ring);
+        return 0;
+    }
+    *r_paused = isSpoolFull();
+    if (setEventSourceEnabled(loop, s_out.fd, true, hasSpooledData(&s_out)) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < cfg_partition_count; i++) {
+        struct OutBatch* ob = &cfg_partitions[i].out;
+        if (setEventSourceEnabled(loop, ob->fd, true, hasSpooledData(ob)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int addPartitionSources(struct EventLoop* loop)
+{
+    for (int i = 0; i < cfg_partition_count; i++) {
+        if (addEventSource(loop, cfg_partitions[i].cmd_fd, EVENT_PARTITION(i)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Marks command fds of partitions with event bits set in events as ready.
+// Returns true if any of them is.
+static bool setPartitionsReady(uint32_t events)
+{
+    bool ready = false;
+    for (int i = 0; i < cfg_partition_count; i++) {
+        if (events & EVENT_PARTITION(i)) {
+            cfg_partitions[i].cmd_ready = true;
+            ready = true;
+        }
+    }
+    return ready;
+}
+
+// Reads commands of partitions whose command fds are ready. Sets r_ready
+// to false when all of them returned no data.
+static ExitCode readPartitionCommands(int64_t* r_next_feedback_lsn, bool* r_quit_requested, bool* r_ready)
+{
+    *r_ready = false;
+    for (int i = 0; i < cfg_partition_count; i++) {
+        struct Partition* part = &cfg_partitions[i];
+        if (!part->cmd_ready) {
+            continue;
+        }
+        int buflen = getCmdData(&part->cmd, part->cmd_fd, 0);
+        if (buflen > 0) {
+            if (processCommands(&part->cmd, part, r_next_feedback_lsn, r_quit_requested) < 0) {
+                return ECODE_CMD_ERROR;
+            }
+            *r_ready = true;
+        }
+        else if (buflen == 0) {
+            part->cmd_ready = false;
+        }
+        else if (buflen == -2) {
+            fprintf(stderr, "Command fd of partition %d closed.\n", i);
+            return ECODE_CMD_CLOSED;
+        }
+        else {
+            perror("Failed to read the command fd of a partition");
+            return ECODE_CMD_ERROR;
+        }
+    }
+    return ECODE_SUCCESS;
+}
+
+static ExitCode runLoop(PGconn* conn, struct ReplicationState* st)
+{
+    ExitCode ecode;
+    bool quit_requested = false;
+    bool feedback_requested = false;
+    char* copybuf = NULL;
+    // libpq may have received rows together with CopyBothResponse
+    bool pq_ready = true;
+    bool cmd_ready = false;
+    bool partitions_ready = false;
+    bool paused = false;  // a spool is full or the ring has a backlog
+    struct EventLoop loop;
+
+    // Register file descriptors to wait for
+    int pq_socket = PQsocket(conn);
+    if (pq_socket < 0) {
+        fprintf(stderr, "Failed to get a socket of the connection: %s\n", PQerrorMessage(conn));
+        return ECODE_PG_ERROR;
+    }
+    if (initEventLoop(&loop) < 0 ||
+            addEventSource(&loop, pq_socket, EVENT_PQ) < 0 ||
+            addEventSource(&loop, cfg_cmd_fd, EVENT_CMD) < 0 ||
+            addPartitionSources(&loop) < 0 ||
+            addSpoolSources(&loop) < 0 ||
+            (s_ring.header != NULL && addEventSource(&loop, s_ring.wait_fd, EVENT_RING) < 0)) {
+        perror("Failed to initialize event loop");
+        destroyEventLoop(&loop);
+        return ECODE_SYSTEM_ERROR;
+    }
+
+    while (true) {
+        if (copybuf != NULL) {
+            freeRowBuffer(copybuf);
+            copybuf = NULL;
+        }
+
+        int64_t now = feGetCurrentTimestamp();
+
+        // Acknowledged LSN published through the ring works as F command
+        if (s_ring.header != NULL) {
+            pollRingAck(&s_ring, &st->next_feedback_lsn);
+        }
+
+        // If feedback is needed, send feedback to PostgreSQL
+        FeedbackReason reason = isFeedbackNeeded(now, feedback_requested,
+                st->next_feedback_lsn, st->last_sent_feedback_lsn, st->last_feedback_sent_at);
+        if (reason != FEEDBACK_NONE) {
+            int r = sendFeedback(conn, now, st->received_lsn, st->next_feedback_lsn, false);
+            if (r < 0) {
+                ecode = ECODE_PG_ERROR;
+                goto error;
+            }
+            recordFeedback(&s_stats, reason, st->next_feedback_lsn);
+            st->last_feedback_sent_at = now;
+            st->last_sent_feedback_lsn = st->next_feedback_lsn;
+            feedback_requested = false;
+        }
+
+        if (updateCheckpoint(&s_checkpoint, now, st->next_feedback_lsn, false) < 0) {
+            perror("Failed to write the checkpoint");
+            ecode = ECODE_SYSTEM_ERROR;
+            goto error;
+        }
+        updateMetrics(now);
+
+        // If abort is requested by signal, exit
+        if (sig_abort_req) {
+            if (cfg_verbose) {
+                fprintf(stderr, "Signal received to exit.\n");
+            }
+            ecode = ECODE_SUCCESS;
+            goto error;
+        }
+
+        // If quit is requested by a command, exit
+        if (quit_requested) {
+            if (cfg_verbose) {
+                fprintf(stderr, "Quit command received to exit.\n");
+            }
+            ecode = ECODE_SUCCESS;
+            goto error;
+        }
+
+        // If PQgetCopyData is ready to call, try to receive a row. Rows
+        // are left in the socket while output is paused.
+        if (pq_ready && !paused) {
+            if (consumeCopyInput(conn) == 0) {
+                fprintf(stderr, "Failed to receive additional replication data: %s\n", copyErrorMessage(conn));
+                ecode = ECODE_PG_ERROR;
+                goto error;
+            }
+            // call select(2) only when PQgetCopyData doesn't return 0 after
+            // PQconsumeInput. pq_ready is set to true if PQgetCopyData
+            // returns 0.
+            pq_ready = false;
+
+            while (true) {
+                // PQgetCopyData with async=true mode receives a complete row
+                // and return byte size > 0. Otherwise return 0 immediately.
+                int buflen = getCopyData(conn, &copybuf);
+                if (buflen > 0) {
+                    int r;
+                    if (s_reader.piece != COPY_WHOLE && isDirectRead(conn)) {
+                        r = processRowPiece(copybuf, buflen, now,
+                                &st->received_lsn, &st->next_feedback_lsn);
+                    }
+                    else {
+                        r = processRow(copybuf, buflen, now,
+                                &feedback_requested, &st->received_lsn, &st->next_feedback_lsn);
+                    }
+                    if (r == 2 || r == -2 || r == -3) {
+                        // Ownership of copybuf moved to emitRow
+                        copybuf = NULL;
+                    }
+                    else {
+                        freeRowBuffer(copybuf);
+                        copybuf = NULL;
+                    }
+                    if (r == -1 || r == -3) {
+                        // Protocol error or invalid record
+                        ecode = ECODE_PG_ERROR;
+                        goto error;
+                    }
+                    else if (r == -2) {
+                        // Failed to write output
+                        ecode = ECODE_SYSTEM_ERROR;
+                        goto error;
+                    }
+                    pq_ready = true;
+                    // Commands are read only after waitEvents otherwise. A
+                    // consumer blocked on a full command pipe stops reading
+                    // the output while rows keep arriving.
+                    cmd_ready = true;
+                    partitions_ready = setPartitionsReady(~0U);
+                    // continoue to PQgetCopyData call again. Call PQgetCopyData until
+                    // it returns 0, then call PQconsumeInput.
+                }
+                else if (buflen == 0) {
+                    // end pq_ready
+                    break;
+                }
+                else if (buflen == -1) {
+                    fprintf(stderr, "Replication stream closed.\n");
+                    ecode = ECODE_PG_CLOSED;
+                    goto error;
+                }
+                else {  // buflen < -1
+                    fprintf(stderr, "Failed to receive replication data: %s\n", copyErrorMessage(conn));
+                    ecode = ECODE_PG_ERROR;
+                    goto error;
+                }
+            }
+        }
+
+        // If cmd is ready to receive, try to receive commands
+        if (cmd_ready) {
+            // getCmdData reads data from cfg_cmd_fd and
+            // return byte size > 0. Otherwise return 0 immediately.
+            int buflen = getCmdData(&s_cmd, cfg_cmd_fd, s_cmd_fd_set_flags);
+            if (buflen > 0) {
+                int r = processCommands(&s_cmd, NULL, &st->next_feedback_lsn, &quit_requested);
+                if (r < 0) {
+                    ecode = ECODE_CMD_ERROR;
+                    goto error;
+                }
+                if (quit_requested) {
+                    // Send feedback before quit
+                    feedback_requested = true;
+                }
+                // end cmd_ready
+            }
+            else if (buflen == 0) {
+                cmd_ready = false;
+            }
+            else if (buflen == -2) {
+                fprintf(stderr, "STDIN closed.\n");
+                ecode = ECODE_CMD_CLOSED;
+                goto error;
+            }
+            else {  // buflen < 0
+                perror("Failed to read STDIN");
+                ecode = ECODE_CMD_ERROR;
+                goto error;
+            }
+        }
+
+        if (partitions_ready) {
+            ecode = readPartitionCommands(&st->next_feedback_lsn, &quit_requested, &partitions_ready);
+            if (ecode != ECODE_SUCCESS) {
+                goto error;
+            }
+            if (quit_requested) {
+                feedback_requested = true;
+            }
+        }
+
+        confirmFiltered(&st->next_feedback_lsn);
+
+        // If pq_ready=false (last PQgetCopyData call returned 0)
+        // or cmd_ready=false (last getCmdData call returned 0),
+        // then use waitEvents() to wait for additional data.
+        if ((!pq_ready || paused) && !cmd_ready && !partitions_ready && !feedback_requested) {
+            // out-of-bound flush before blocking operation
+            if (flushOut() < 0) {
+                perror("failed to write data to output");
+                ecode = ECODE_SYSTEM_ERROR;
+                goto error;
+            }
+
+            // Timers keep sending status messages while paused
+            if (cfg_spool_size > 0 || s_ring.header != NULL) {
+                if (pollSpools(&loop, &paused) < 0 ||
+                        setEventSourceEnabled(&loop, pq_socket, false, !paused) < 0) {
+                    perror("Failed to update event sources");
+                    ecode = ECODE_SYSTEM_ERROR;
+                    goto error;
+                }
+                if (pq_ready && !paused) {
+                    continue;
+                }
+            }
+
+            int64_t feedback_deadline;
+            int64_t status_deadline;
+            feedbackDeadlines(st->next_feedback_lsn, st->last_sent_feedback_lsn, st->last_feedback_sent_at,
+                    &feedback_deadline, &status_deadline);
+            int64_t checkpoint_deadline = checkpointDeadline(&s_checkpoint, st->next_feedback_lsn);
+            if (checkpoint_deadline < feedback_deadline) {
+                feedback_deadline = checkpoint_deadline;
+            }
+            if (metricsDeadline() < feedback_deadline) {
+                feedback_deadline = metricsDeadline();
+            }
+            if (setEventDeadlines(&loop, feedback_deadline, status_deadline) < 0) {
+                perror("Failed to set a timer");
+                ecode = ECODE_SYSTEM_ERROR;
+                goto error;
+            }
+
+            if (s_ring.header != NULL && !enterRingWait(&s_ring, &st->next_feedback_lsn)) {
+                continue;
+            }
+
+            uint32_t events;
+            if (waitEvents(&loop, now, &events) < 0) {
+                ecode = ECODE_SYSTEM_ERROR;
+                goto error;
+            }
+
+            if (s_ring.header != NULL) {
+                leaveRingWait(&s_ring, events);
+            }
+
+            // If pq_socket is ready, call PQconsumeInput and set pq_ready=true
+            if (events & EVENT_PQ) {
+                if (consumeCopyInput(conn) == 0) {
+                    fprintf(stderr, "Failed to receive additional replication data: %s\n", copyErrorMessage(conn));
+                    ecode = ECODE_PG_ERROR;
+                    goto error;
+                }
+                pq_ready = true;
+            }
+
+            // If cfg_cmd_fd is ready, set cmd_ready=true
+            if (events & EVENT_CMD) {
+                cmd_ready = true;
+            }
+            if (setPartitionsReady(events)) {
+                partitions_ready = true;
+            }
+
+            if (events & EVENT_OUT) {
+                if (drainSpools() < 0) {
+                    perror("failed to write data to output");
+                    ecode = ECODE_SYSTEM_ERROR;
+                    goto error;
+                }
+                paused = isSpoolFull();
+            }
+        }
+
+    }  // while (true)
+
+error:
+    if (copybuf != NULL) {
+        freeRowBuffer(copybuf);
+        copybuf = NULL;
+    }
+
+    flushOut();
+
+    // Acknowledgements since the last checkpoint aren't lost on exit
+    if (updateCheckpoint(&s_checkpoint, feGetCurrentTimestamp(), st->next_feedback_lsn, true) < 0) {
+        perror("Failed to write the checkpoint");
+        if (ecode == ECODE_SUCCESS) {
+            ecode = ECODE_SYSTEM_ERROR;
+        }
+    }
+
+    destroyEventLoop(&loop);
+
+    return ecode;
+}
+
+static int setNonBlocking(void)
+{
+    // Remove non-blocking flag from STDOUT unless data is spooled, and
+    // write in append mode
+    int out_flags = fcntl(cfg_out_fd, F_GETFL, 0);
+    if (out_flags < 0) {
+        return -1;
+    }
+    int out_nonblock = cfg_spool_size > 0 ? O_NONBLOCK : 0;
+    if (fcntl(cfg_out_fd, F_SETFL, (out_flags & ~O_NONBLOCK) | out_nonblock | O_APPEND) < 0) {
+        return -1;
+    }
+
+    // Set non-blocking flag to STDIN
+    int in_flags = fcntl(cfg_cmd_fd, F_GETFL, 0);
+    if (in_flags < 0) {
+        return -1;
+    }
+    if (fcntl(cfg_cmd_fd, F_SETFL, in_flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    // Get flags of STDOUT again
+    out_flags = fcntl(cfg_out_fd, F_GETFL, 0);
+    if (out_flags < 0) {
+        return -1;
+    }
+
+    if ((out_flags & O_NONBLOCK) && out_nonblock == 0) {
+        // Setting non-blocking flag to STDIN sets non-blocking flag
+        // also to STDOUT. This happens when they share the same
+        // socket or tty on some platforms (darwin). In this case,
+        // call fcntl always around read.
+        if (fcntl(cfg_out_fd, F_SETFL, out_flags & ~O_NONBLOCK) < 0) {
+            return -1;
+        }
+        s_cmd_fd_set_flags = in_flags | O_NONBLOCK;
+    }
+    else {
+        s_cmd_fd_set_flags = 0;
+    }
+
+    return 0;
+}
+
+// Allocates buffers of partitions and sets flags of their fds in the same
+// way as the output and the command fd
+static int initPartitions(void)
+{
+    for (int i = 0; i < cfg_partition_count; i++) {
+        struct Partition* part = &cfg_partitions[i];
+        initOutBatch(&part->out, part->out_fd);
+        initCmdBuffer(&part->cmd);
+
+        int out_flags = fcntl(part->out_fd, F_GETFL, 0);
+        if (out_flags < 0) {
+            return -1;
+        }
+        int out_nonblock = cfg_spool_size > 0 ? O_NONBLOCK : 0;
+        if (fcntl(part->out_fd, F_SETFL, (out_flags & ~O_NONBLOCK) | out_nonblock | O_APPEND) < 0) {
+            return -1;
+        }
+        int in_flags = fcntl(part->cmd_fd, F_GETFL, 0);
+        if (in_flags < 0) {
+            return -1;
+        }
+        if (fcntl(part->cmd_fd, F_SETFL, in_flags | O_NONBLOCK) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+////
+// > IDENTIFY_SYSTEM
+//
+static int runIdentifySystem(PGconn* conn)
+{
+    // Setup signal handlers
+    setupSignalHandlers();
+
+    // Run IDENTIFY_SYSTEM
+    if (cfg_verbose) {
+        fprintf(stderr, "> IDENTIFY_SYSTEM\n");
+    }
+    PGresult* res = PQexec(conn, "IDENTIFY_SYSTEM");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "IDENTIFY_SYSTEM: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        return -1;
+    }
+
+    // Print information
+    if (cfg_verbose) {
+        fprintf(stderr, "System status:\n");
+        for (int r = 0; r < PQntuples(res); r++) {
+            int fields = PQnfields(res);
+            for (int c = 0; c < fields; c++) {
+                fprintf(stderr, "  %s=%s\n", PQfname(res, c), PQgetvalue(res, r, c));
+            }
+        }
+        fprintf(stderr, "  libpq=%d\n", PQlibVersion());
+    }
+
+    PQclear(res);
+    return 0;
+}
+
+////
+// > CREATE_REPLICATION_SLOT
+//
+static int createReplicationSlot(PGconn* conn, const char* slot_name)
+{
+    struct QueryBuffer qb;
+    initQueryBuffer(&qb);
+
+    if (cfg_poll_mode) {
+        char* liter_slot_name = PQescapeLiteral(conn, slot_name, strlen(slot_name));
+        char* liter_create_slot_plugin = PQescapeLiteral(conn, cfg_create_slot_plugin, strlen(cfg_create_slot_plugin));
+        appendQueryBuffer(&qb, "select * from pg_create_logical_replication_slot(");
+        appendQueryBuffer(&qb, liter_slot_name);
+        appendQueryBuffer(&qb, ", ");
+        appendQueryBuffer(&qb, liter_create_slot_plugin);
+        appendQueryBuffer(&qb, ")");
+        PQfreemem(liter_slot_name);
+        PQfreemem(liter_create_slot_plugin);
+    }
+    else {
+        char* ident_slot_name = PQescapeIdentifier(conn, slot_name, strlen(slot_name));
+        char* ident_create_slot_plugin = PQescapeIdentifier(conn, cfg_create_slot_plugin, strlen(cfg_create_slot_plugin));
+        appendQueryBuffer(&qb, "CREATE_REPLICATION_SLOT ");
+        appendQueryBuffer(&qb, ident_slot_name);
+        appendQueryBuffer(&qb, " LOGICAL ");
+        appendQueryBuffer(&qb, ident_create_slot_plugin);
+        PQfreemem(ident_slot_name);
+        PQfreemem(ident_create_slot_plugin);
+    }
+
+    if (cfg_verbose) {
+        fprintf(stderr, "> %s\n", qb.str);
+    }
+
+    PGresult* res = PQexec(conn, qb.str);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        const char* sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+
+        // If slot already exists, return 1.
+        if (strcmp(SQLSTATE_ERRCODE_DUPLICATE_OBJECT, sqlstate) == 0) {
+            destroyQueryBuffer(&qb);
+            PQclear(res);
+            return 1;
+        }
+
+        // Other errors return -1.
+        fprintf(stderr, "Failed to create a replication slot (%s): %s\n",
+                sqlstate, PQerrorMessage(conn));
+        destroyQueryBuffer(&qb);
+        PQclear(res);
+        return -1;
+    }
+
+    destroyQueryBuffer(&qb);
+    PQclear(res);
+    return 0;
+}
+
+////
+// Slot lock
+//
+// With --slot-lock, the node streaming from a slot holds a session advisory
+// lock keyed by the slot name. It is released when the walsender exits, so
+// poll mode can block on the lock instead of polling pg_replication_slots.
+//
+static void buildSlotLockQuery(struct QueryBuffer* qb, PGconn* conn, const char* func)
+{
+    char* liter_slot_name = PQescapeLiteral(conn, cfg_slot_name, strlen(cfg_slot_name));
+    appendQueryBuffer(qb, "select ");
+    appendQueryBuffer(qb, func);
+    appendQueryBuffer(qb, "(" SLOT_LOCK_CLASS_ID ", hashtext(");
+    appendQueryBuffer(qb, liter_slot_name);
+    appendQueryBuffer(qb, "))");
+    PQfreemem(liter_slot_name);
+}
+
+// Returns 1 if the query returned true, 0 if false, -1 on errors.
+static int execSlotLockQuery(PGconn* conn, const char* func)
+{
+    struct QueryBuffer qb;
+    initQueryBuffer(&qb);
+    buildSlotLockQuery(&qb, conn, func);
+
+    if (cfg_verbose) {
+        fprintf(stderr, "> %s\n", qb.str);
+    }
+
+    int ret;
+    PGresult* res = PQexec(conn, qb.str);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+        fprintf(stderr, "Failed to run %s: %s\n", func, PQerrorMessage(conn));
+        ret = -1;
+    }
+    else {
+        ret = strcmp(PQgetvalue(res, 0, 0), "t") == 0 ? 1 : 0;
+    }
+
+    PQclear(res);
+    destroyQueryBuffer(&qb);
+    return ret;
+}
+
+// Takes the slot lock on a replication connection before START_REPLICATION.
+// Failure is not fatal because START_REPLICATION decides who owns the slot.
+static void lockSlot(PGconn* conn)
+{
+    int r = execSlotLockQuery(conn, "pg_try_advisory_lock");
+    if (r == 0) {
+        fprintf(stderr, "Slot lock is held by another session.\n");
+    }
+}
+
+// Blocks until the slot lock is released by the session holding it, then
+// releases it again unless hold is set. Returns 1 if the lock was
+// acquired, 0 on timeout or SIGINT, -1 on errors.
+static int waitSlotLock(PGconn* conn, int64_t deadline, bool hold)
+{
+    struct QueryBuffer qb;
+    initQueryBuffer(&qb);
+    buildSlotLockQuery(&qb, conn, "pg_advisory_lock");
+
+    if (cfg_verbose) {
+        fprintf(stderr, "> %s\n", qb.str);
+    }
+
+    if (PQsendQuery(conn, qb.str) == 0) {
+        fprintf(stderr, "Failed to run pg_advisory_lock: %s\n", PQerrorMessage(conn));
+        destroyQueryBuffer(&qb);
+        return -1;
+    }
+    destroyQueryBuffer(&qb);
+
+    bool cancelled = false;
+    while (true) {
+        if (PQconsumeInput(conn) == 0) {
+            fprintf(stderr, "Failed to run pg_advisory_lock: %s\n", PQerrorMessage(conn));
+            return -1;
+        }
+        if (!PQisBusy(conn)) {
+            break;
+        }
+
+        int timeout = -1;
+        if (deadline != NO_DEADLINE) {
+            int64_t now = feGetCurrentTimestamp();
+            timeout = now >= deadline ? 0 : (int) ((deadline - now + 999) / 1000);
+        }
+
+        struct pollfd pfd = { PQsocket(conn), POLLIN, 0 };
+        int n = poll(&pfd, 1, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("poll failed");
+            return -1;
+        }
+        if (n == 0 || sig_abort_req) {
+            // Cancel the lock wait and drain its result below. The lock
+            // may still be granted if the cancel request arrives late.
+            char errbuf[256];
+            PGcancel* cancel = PQgetCancel(conn);
+            if (cancel == NULL || PQcancel(cancel, errbuf, sizeof(errbuf)) == 0) {
+                fprintf(stderr, "Failed to cancel pg_advisory_lock\n");
+            }
+            PQfreeCancel(cancel);
+            cancelled = true;
+            break;
+        }
+    }
+
+    bool acquired = false;
+    bool failed = false;
+    PGresult* res;
+    while ((res = PQgetResult(conn)) != NULL) {
+        if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+            acquired = true;
+        }
+        else if (!cancelled) {
+            fprintf(stderr, "Failed to run pg_advisory_lock: %s\n", PQerrorMessage(conn));
+            failed = true;
+        }
+        PQclear(res);
+    }
+
+    if (acquired && (!hold || cancelled || failed) &&
+            execSlotLockQuery(conn, "pg_advisory_unlock") < 0) {
+        return -1;
+    }
+    if (failed) {
+        return -1;
+    }
+    return cancelled ? 0 : 1;
+}
+
+////
+// > START_REPLICATION
+//
+static ExitCode runStartReplication(PGconn* conn,
+        const char* slot_name, const struct ConfigParams* plugin_params, int64_t start_lsn)
+{
+    char start_lsn_buffer[16*2+1+1];
+    sprintf(start_lsn_buffer, "%X/%X",
+            (uint32_t) (start_lsn >> 32), (uint32_t) start_lsn);
+
+    struct QueryBuffer qb;
+    initQueryBuffer(&qb);
+
+    {
+        char* ident_slot_name = PQescapeIdentifier(conn, slot_name, strlen(slot_name));
+        appendQueryBuffer(&qb, "START_REPLICATION SLOT ");
+        appendQueryBuffer(&qb, ident_slot_name);
+        appendQueryBuffer(&qb, " LOGICAL ");
+        appendQueryBuffer(&qb, start_lsn_buffer);
+        PQfreemem(ident_slot_name);
+    }
+
+    if (plugin_params->count > 0) {
+        appendQueryBuffer(&qb, " (");
+        for (int i=0; i < plugin_params->count; i++) {
+            if (i != 0) {
+                appendQueryBuffer(&qb, ", ");
+            }
+            if (plugin_params->values[i] != NULL) {
+                char* ident_key = PQescapeIdentifier(conn, plugin_params->keys[i], strlen(plugin_params->keys[i]));
+                char* liter_value = PQescapeLiteral(conn, plugin_params->values[i], strlen(plugin_params->values[i]));
+                appendQueryBuffer(&qb, ident_key);
+                appendQueryBuffer(&qb, " ");
+                appendQueryBuffer(&qb, liter_value);
+                PQfreemem(ident_key);
+                PQfreemem(liter_value);
+            }
+            else {
+                char* ident_key = PQescapeIdentifier(conn, plugin_params->keys[i], strlen(plugin_params->keys[i]));
+                appendQueryBuffer(&qb, ident_key);
+                PQfreemem(ident_key);
+            }
+        }
+        appendQueryBuffer(&qb, ")");
+    }
+
+    if (cfg_verbose) {
+        fprintf(stderr, "> %s\n", qb.str);
+    }
+
+    // The stream is read by the CopyData reader unless it's encrypted
+    bool direct = cfg_direct_read;
+    if (direct && (PQsslInUse(conn) || PQgetgssctx(conn) != NULL)) {
+        if (cfg_verbose) {
+            fprintf(stderr, "--direct-read is not used with an encrypted connection.\n");
+        }
+        direct = false;
+    }
+    resetCopyReader(&s_reader, -1);
+
+    PGresult* res = NULL;
+    const char* sqlstate;
+    const char* message;
+    if (direct) {
+        if (startCopyReader(&s_reader, PQsocket(conn), qb.str) == 0) {
+            destroyQueryBuffer(&qb);
+            return ECODE_SUCCESS;
+        }
+        sqlstate = s_reader.sqlstate;
+        message = s_reader.error;
+    }
+    else {
+        res = PQexec(conn, qb.str);
+        if (PQresultStatus(res) == PGRES_COPY_BOTH) {
+            destroyQueryBuffer(&qb);
+            PQclear(res);
+            return ECODE_SUCCESS;
+        }
+        sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+        message = PQerrorMessage(conn);
+    }
+    if (sqlstate == NULL) {
+        sqlstate = "";
+    }
+
+    ExitCode ecode;
+    // If slot is in use by another client, return ECODE_SLOT_IN_USE.
+    if (strcmp(SQLSTATE_ERRCODE_OBJECT_IN_USE, sqlstate) == 0) {
+        if (cfg_verbose) {
+            fprintf(stderr, "Replication slot is in use: %s\n", message);
+        }
+        ecode = ECODE_SLOT_IN_USE;
+    }
+    // If slot does not exist, return ECODE_SLOT_NOT_EXIST.
+    else if (strcmp(SQLSTATE_ERRCODE_UNDEFINED_OBJECT, sqlstate) == 0) {
+        if (cfg_verbose) {
+            fprintf(stderr, "Replication does not exist: %s\n", message);
+        }
+        ecode = ECODE_SLOT_NOT_EXIST;
+    }
+    // Otherwise, return ECODE_INIT_FAILED.
+    else {
+        fprintf(stderr, "Failed to start replication (%s): %s\n", sqlstate, message);
+        ecode = ECODE_INIT_FAILED;
+    }
+
+    destroyQueryBuffer(&qb);
+    PQclear(res);
+    return ecode;
+}
+
+static bool isConnectionLost(PGconn* conn, ExitCode ecode)
+{
+    // Invalid records and write errors are not recovered by reconnecting
+    return ecode == ECODE_PG_CLOSED ||
+        (ecode == ECODE_PG_ERROR && (PQstatus(conn) == CONNECTION_BAD || s_reader.lost));
+}
+
+// Keeps the replication connection and retries START_REPLICATION while the
+// slot is in use, so that replication starts without connecting again when
+// the active node exits. With --slot-lock, it waits for the slot lock and
+// holds it before each attempt.
+static ExitCode runStandby(PGconn* conn, int64_t start_lsn)
+{
+    int64_t started_at = feGetCurrentTimestamp();
+    int64_t deadline = cfg_poll_has_duration ? started_at + cfg_poll_duration * 1000L : NO_DEADLINE;
+    long backoff = 0;
+
+    while (true) {
+        if (sig_abort_req) {
+            return ECODE_SUCCESS;
+        }
+
+        if (cfg_slot_lock) {
+            if (cfg_verbose) {
+                fprintf(stderr, "Waiting for the slot lock.\n");
+            }
+            int r = waitSlotLock(conn, deadline, true);
+            if (r < 0) {
+                return ECODE_INIT_FAILED;
+            }
+            if (r == 0) {
+                if (sig_abort_req) {
+                    return ECODE_SUCCESS;
+                }
+                fprintf(stderr, "Slot is in use. Timeout.\n");
+                return ECODE_SLOT_IN_USE;
+            }
+        }
+
+        ExitCode ecode = runStartReplication(conn, cfg_slot_name, &cfg_plugin_params, start_lsn);
+        if (ecode == ECODE_SUCCESS) {
+            return ecode;
+        }
+        if (cfg_slot_lock && execSlotLockQuery(conn, "pg_advisory_unlock") < 0) {
+            return ECODE_INIT_FAILED;
+        }
+        if (ecode != ECODE_SLOT_IN_USE) {
+            return ecode;
+        }
+
+        int64_t now = feGetCurrentTimestamp();
+        if (cfg_poll_has_duration && feTimestampDifferenceExceeds(started_at, now, cfg_poll_duration)) {
+            fprintf(stderr, "Slot is in use. Timeout.\n");
+            return ECODE_SLOT_IN_USE;
+        }
+
+        // With --slot-lock, the slot is in use only until the walsender of
+        // the last lock holder releases it, or if the active node doesn't
+        // hold the lock. Retry soon, then back off up to --poll-interval.
+        long interval = cfg_poll_interval;
+        if (cfg_slot_lock) {
+            backoff = backoff == 0 ? RECONNECT_BACKOFF_MIN : backoff * 2;
+            if (backoff < interval) {
+                interval = backoff;
+            }
+        }
+        if (deadline != NO_DEADLINE && now + interval * 1000L > deadline) {
+            interval = (long) ((deadline - now + 999) / 1000);
+        }
+        if (cfg_verbose) {
+            fprintf(stderr, "Slot is in use. Sleeping %.3f seconds.\n", (interval / 1000.0));
+        }
+        struct timespec ts = { interval / 1000, (interval % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Runs START_REPLICATION from start_lsn, or from the position confirmed
+// by the slot if it's later (or start_lsn is InvalidXLogRecPtr)
+static ExitCode startReplication(PGconn* conn, int64_t start_lsn)
+{
+    if (cfg_standby) {
+        return runStandby(conn, start_lsn);
+    }
+
+    // Hold the slot lock so that poll mode of other nodes can wait for it
+    if (cfg_slot_lock) {
+        lockSlot(conn);
+    }
+
+    return runStartReplication(conn, cfg_slot_name, &cfg_plugin_params, start_lsn);
+}
+
+// Connects again and restarts replication from start_lsn like the first
+// connection (holding --slot-lock or waiting with --standby), retrying
+// with exponential backoff until --reconnect timeout. Returns lost_ecode
+// if the timeout expires.
+static ExitCode reconnect(PGconn** r_conn, int64_t start_lsn, ExitCode lost_ecode)
+{
+    int64_t started_at = feGetCurrentTimestamp();
+    long backoff = 0;
+    ExitCode ecode = lost_ecode;
+
+    fprintf(stderr, "Reconnecting to restart replication from %X/%X\n",
+            (uint32_t) (start_lsn >> 32), (uint32_t) start_lsn);
+
+    while (true) {
+        if (sig_abort_req) {
+            return ECODE_SUCCESS;
+        }
+
+        PGconn* conn = PQconnectdbParams(cfg_pq_params.keys, cfg_pq_params.values, 1);
+        if (PQstatus(conn) != CONNECTION_OK) {
+            if (cfg_verbose) {
+                fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(conn));
+            }
+        }
+        else if (runIdentifySystem(conn) == 0) {
+            ecode = startReplication(conn, start_lsn);
+            if (ecode == ECODE_SUCCESS) {
+                *r_conn = conn;
+                return ECODE_SUCCESS;
+            }
+            if (ecode != ECODE_SLOT_IN_USE) {
+                // The slot may stay in use until the server notices that
+                // the old connection is closed. Other errors are permanent.
+                PQfinish(conn);
+                return ecode;
+            }
+        }
+        PQfinish(conn);
+
+        if (cfg_reconnect_timeout != 0 &&
+                feTimestampDifferenceExceeds(started_at, feGetCurrentTimestamp(), cfg_reconnect_timeout)) {
+            fprintf(stderr, "Gave up reconnecting.\n");
+            return ecode == ECODE_SLOT_IN_USE ? ecode : lost_ecode;
+        }
+
+        backoff = backoff == 0 ? RECONNECT_BACKOFF_MIN : backoff * 2;
+        if (backoff > RECONNECT_BACKOFF_MAX) {
+            backoff = RECONNECT_BACKOFF_MAX;
+        }
+        struct timespec ts = { backoff / 1000, (backoff % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+    }
 }
 
-static long selectTimeoutMillis(int64_t now,
-        int64_t next_feedback_lsn, int64_t last_sent_feedback_lsn,
-        int64_t last_feedback_sent_at)
+static ExitCode run(void)
 {
-    long minMsec = LONG_MAX;
+    PGconn* conn = NULL;
+    ExitCode ecode;
 
-    // send feedback every feedback interval if next_feedback_lsn is updated
-    if (next_feedback_lsn != InvalidXLogRecPtr &&
-            next_feedback_lsn != last_sent_feedback_lsn) {
-        long msec = cfg_feedback_interval - feTimestampDifferenceMillis(last_feedback_sent_at, now);
-        if (msec < minMsec) minMsec = msec;
+    // Allocate input buffer
+    initCmdBuffer(&s_cmd);
+    if (cfg_unordered_feedback || cfg_partition_count > 0) {
+        initInflight(&s_inflight, 1024);
     }
 
-    // send feedback every standby message interval regardless of next_feedback_lsn
-    if (next_feedback_lsn != InvalidXLogRecPtr &&
-            cfg_standby_message_interval != 0) {
-        long msec = cfg_standby_message_interval - feTimestampDifferenceMillis(last_feedback_sent_at, now);
-        if (msec < minMsec) minMsec = msec;
+    // Allocate output buffer
+    initOutBatch(&s_out, cfg_out_fd);
+    if (cfg_compress != COMPRESS_NONE) {
+        initLz4State(&s_lz4);
+        initByteBuffer(&s_frame, OUT_BUFSIZ);
+    }
+    if (cfg_pgoutput) {
+        initByteBuffer(&s_pg_record, 4096);
+        initByteBuffer(&s_pg_identity, 4096);
     }
 
-    // wait at least 300 milliseconds
-    if (minMsec < 0L) {
-        return 300L;
+    // Set non-blocking mode to command input file descriptor
+    if (setNonBlocking() < 0) {
+        perror("Invalid STDIN file descriptor");
+        ecode = ECODE_INIT_FAILED;
+        goto done;
+    }
+    if (initPartitions() < 0) {
+        perror("Invalid --partition file descriptors");
+        ecode = ECODE_INIT_FAILED;
+        goto done;
     }
 
-    // wait at most 60 seconds
-    if (minMsec > 60 * 1000L) {
-        return 60 * 1000L;
+    // Map the shared memory ring
+    if (cfg_ring_fd >= 0 && openRing(&s_ring, cfg_ring_fd, cfg_ring_notify_fd, cfg_ring_wait_fd) < 0) {
+        perror("Invalid --ring file descriptors");
+        ecode = ECODE_INIT_FAILED;
+        goto done;
+    }
+#ifdef USE_IO_URING
+    if (cfg_io_uring && openUring(&s_uring) < 0) {
+        perror("Failed to set up io_uring");
+        ecode = ECODE_INIT_FAILED;
+        goto done;
+    }
+#endif
+
+    // Restart from the checkpoint unless --start-lsn is later
+    int64_t start_lsn = cfg_start_lsn;
+    if (cfg_checkpoint_path != NULL) {
+        int64_t checkpoint_lsn;
+        if (openCheckpoint(&s_checkpoint, cfg_checkpoint_path, &checkpoint_lsn) < 0) {
+            fprintf(stderr, "Failed to read the checkpoint %s: %s\n", cfg_checkpoint_path, strerror(errno));
+            ecode = ECODE_INIT_FAILED;
+            goto done;
+        }
+        if (start_lsn < checkpoint_lsn) {
+            start_lsn = checkpoint_lsn;
+        }
     }
 
-    return minMsec;
+    // Establish the connection
+    conn = PQconnectdbParams(cfg_pq_params.keys, cfg_pq_params.values, 1);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(conn));
+        ecode = ECODE_INIT_FAILED;
+        goto done;
+    }
+
+    // Run IDENTIFY_SYSTEM
+    if (runIdentifySystem(conn) < 0) {
+        ecode = ECODE_INIT_FAILED;
+        goto done;
+    }
+
+    // Run START_REPLICATION
+    ecode = startReplication(conn, start_lsn);
+    if (cfg_create_slot && ecode == ECODE_SLOT_NOT_EXIST) {
+        // If slot doesn't exist and --create-slot is set, create the slot
+        if (createReplicationSlot(conn, cfg_slot_name) < 0) {
+            ecode = ECODE_INIT_FAILED;
+            goto done;
+        }
+        // then retry runStartReplication.
+        ecode = startReplication(conn, start_lsn);
+    }
+    if (ecode != ECODE_SUCCESS) {
+        goto done;
+    }
+
+    // Run the main loop
+    if (cfg_verbose) {
+        fprintf(stderr, "Replication started\n");
+    }
+
+    struct ReplicationState st;
+    memset(&st, 0, sizeof(st));
+    if (start_lsn != InvalidXLogRecPtr) {
+        // Rows of a transaction acknowledged in part are sent again
+        st.next_feedback_lsn = start_lsn;
+        if ((cfg_write_header || cfg_binary_header) && writeRestartMarker(start_lsn) < 0) {
+            perror("failed to write data to output");
+            ecode = ECODE_SYSTEM_ERROR;
+            goto done;
+        }
+    }
+    ecode = runLoop(conn, &st);
+
+    while (cfg_reconnect && isConnectionLost(conn, ecode)) {
+        PQfinish(conn);
+        conn = NULL;
+
+        // Rows after the LSN acknowledged by the consumer are sent again
+        int64_t start_lsn = st.next_feedback_lsn;
+        if (start_lsn < st.last_sent_feedback_lsn) {
+            start_lsn = st.last_sent_feedback_lsn;
+        }
+        ExitCode r = reconnect(&conn, start_lsn, ecode);
+        if (r != ECODE_SUCCESS || conn == NULL) {
+            ecode = r;
+            break;
+        }
+        if (writeRestartMarker(start_lsn) < 0) {
+            perror("failed to write data to output");
+            ecode = ECODE_SYSTEM_ERROR;
+            break;
+        }
+        ecode = runLoop(conn, &st);
+    }
+
+done:
+    if (finishSpools() < 0 || finishRing(&s_ring) < 0) {
+        perror("failed to write data to output");
+        if (ecode == ECODE_SUCCESS) {
+            ecode = ECODE_SYSTEM_ERROR;
+        }
+    }
+    finishMetrics();
+    if (conn != NULL) {
+        if (cfg_verbose) {
+            fprintf(stderr, "Closing connection\n");
+        }
+        PQfinish(conn);
+    }
+    closeRing(&s_ring);
+#ifdef USE_IO_URING
+    closeUring(&s_uring);
+#endif
+    closeCheckpoint(&s_checkpoint);
+    return ecode;
+}
+
+////
+// Shard mode
+//
+// Each shard streams a subset of tables (wal2json add-tables option) from
+// its own slot so that decoding runs on multiple walsender processes.
+// Transactions are buffered per shard and written in commit LSN order.
+// A transaction is written only when every other shard is known not to
+// have an earlier one: either it has a buffered transaction committed
+// later, or its watermark (walEnd of keepalive messages, or commit LSN of
+// the last transaction) passed the commit LSN. Keepalive messages are
+// requested from shards blocking the merge.
+//
+
+static bool hasPrefix(const char* data, size_t size, const char* prefix)
+{
+    size_t len = strlen(prefix);
+    return size >= len && memcmp(data, prefix, len) == 0;
+}
+
+static bool hasConfigParam(const struct ConfigParams* params, const char* key, const char* value)
+{
+    for (int i = 0; i < params->count; i++) {
+        if (strcmp(params->keys[i], key) == 0 && params->values[i] != NULL &&
+                strcmp(params->values[i], value) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void addShard(const char* slot_eq_tables)
+{
+    struct Shard* shard = &cfg_shards[cfg_shard_count++];
+    memset(shard, 0, sizeof(*shard));
+
+    char* arg = strdup(slot_eq_tables);
+    char* eq = strchr(arg, '=');
+    if (eq != NULL) {
+        *eq = '\0';
+    }
+    shard->slot_name = arg;
+
+    // Plugin options are copied later because -o options may follow
+    initConfigParam(&shard->plugin_params);
+    if (eq != NULL) {
+        addConfigParam(&shard->plugin_params, "add-tables", eq + 1);
+    }
+}
+
+static void pushShardRow(struct Shard* shard, const struct PendingRow* row)
+{
+    if (shard->rows_count == shard->rows_cap) {
+        size_t new_cap = shard->rows_cap == 0 ? 64 : shard->rows_cap * 2;
+        struct PendingRow* new_rows = malloc(sizeof(struct PendingRow) * new_cap);
+        for (size_t i = 0; i < shard->rows_count; i++) {
+            new_rows[i] = shard->rows[(shard->rows_head + i) % shard->rows_cap];
+        }
+        free(shard->rows);
+        shard->rows = new_rows;
+        shard->rows_head = 0;
+        shard->rows_cap = new_cap;
+    }
+    shard->rows[(shard->rows_head + shard->rows_count) % shard->rows_cap] = *row;
+    shard->rows_count++;
+    shard->rows_bytes += row->size;
+}
+
+static struct PendingRow* shiftShardRow(struct Shard* shard)
+{
+    struct PendingRow* row = &shard->rows[shard->rows_head];
+    shard->rows_head = (shard->rows_head + 1) % shard->rows_cap;
+    shard->rows_count--;
+    shard->rows_bytes -= row->size;
+    return row;
+}
+
+// Returns true if the shard is not read until its buffered transactions
+// are written. A shard without a complete transaction is always read
+// because the merge may wait for it.
+static bool isShardFull(const struct Shard* shard)
+{
+    return shard->txns_count > 0 && shard->rows_bytes >= SHARD_BUFFER_MAX;
+}
+
+static void pushShardTxn(struct Shard* shard, int64_t commit_lsn, size_t nrows)
+{
+    if (shard->txns_count == shard->txns_cap) {
+        size_t new_cap = shard->txns_cap == 0 ? 16 : shard->txns_cap * 2;
+        struct PendingTxn* new_txns = malloc(sizeof(struct PendingTxn) * new_cap);
+        for (size_t i = 0; i < shard->txns_count; i++) {
+            new_txns[i] = shard->txns[(shard->txns_head + i) % shard->txns_cap];
+        }
+        free(shard->txns);
+        shard->txns = new_txns;
+        shard->txns_head = 0;
+        shard->txns_cap = new_cap;
+    }
+    struct PendingTxn* txn = &shard->txns[(shard->txns_head + shard->txns_count) % shard->txns_cap];
+    txn->commit_lsn = commit_lsn;
+    txn->nrows = nrows;
+    shard->txns_count++;
+}
+
+static void destroyShard(struct Shard* shard)
+{
+    while (shard->rows_count > 0) {
+        PQfreemem(shiftShardRow(shard)->buf);
+    }
+    free(shard->rows);
+    free(shard->txns);
+    shard->rows = NULL;
+    shard->txns = NULL;
+    if (shard->conn != NULL) {
+        PQfinish(shard->conn);
+        shard->conn = NULL;
+    }
+}
+
+// Returns 0 if the row is a keepalive message, 1 if buf is moved to the
+// row queue, or -1 on protocol errors.
+static int processShardRow(struct Shard* shard, char* copybuf, int buflen, int64_t now, bool txn_framing)
+{
+    if (copybuf[0] == 'k') {
+        // Primary keepalive message (B)
+        //   Byte1('k'), Int64, Int64, Byte1
+        if (buflen < 1 + 8 + 8 + 1) {
+            fprintf(stderr, "streaming header too small: %d\n", buflen);
+            return -1;
+        }
+        int64_t wal_pos = fe_recvint64(&copybuf[1]);  // Int64 walEnd
+        bool reply_requested = copybuf[1 + 8 + 8];    // Byte1 replyRequested
+        if (reply_requested) {
+            shard->feedback_requested = true;
+        }
+        recordKeepalive(&s_stats, wal_pos);
+        if (shard->next_feedback_lsn == InvalidXLogRecPtr) {
+            // See processRow
+            shard->next_feedback_lsn = wal_pos;
+        }
+        // All transactions committed before walEnd are already sent
+        if (shard->watermark < wal_pos) {
+            shard->watermark = wal_pos;
+        }
+        return 0;
+    }
+    else if (copybuf[0] == 'w') {
+        // XLogData (B)
+        //   Byte1('w'), Int64, Int64, Int64, ByteN
+        if (buflen < 1 + 8 + 8 + 8) {
+            fprintf(stderr, "streaming header too small: %d\n", buflen);
+            return -1;
+        }
+        struct PendingRow row;
+        row.buf = copybuf;
+        row.wal_pos = fe_recvint64(&copybuf[1]);
+        row.wal_end = fe_recvint64(&copybuf[1 + 8]);
+        row.send_time = fe_recvint64(&copybuf[1 + 8 + 8]);
+        row.data = copybuf + (1 + 8 + 8 + 8);
+        row.size = buflen - (1 + 8 + 8 + 8);
+        row.receive_time = now;
+        recordReceived(&s_stats, now, row.wal_pos, row.wal_end, row.send_time, row.size);
+        pushShardRow(shard, &row);
+        shard->open_rows++;
+        if (shard->received_lsn < row.wal_pos) {
+            shard->received_lsn = row.wal_pos;
+        }
+
+        // With wal2json format-version=2, a transaction is rows from an
+        // "B" row to a "C" row. Otherwise (format-version=1), a row
+        // is a transaction.
+        if (txn_framing) {
+            if (hasPrefix(row.data, row.size, "{\"action\":\"B\"")) {
+                shard->in_txn = true;
+            }
+            else if (hasPrefix(row.data, row.size, "{\"action\":\"C\"")) {
+                shard->in_txn = false;
+            }
+        }
+        if (!shard->in_txn) {
+            pushShardTxn(shard, row.wal_pos, shard->open_rows);
+            shard->open_rows = 0;
+            if (shard->watermark < row.wal_pos) {
+                shard->watermark = row.wal_pos;
+            }
+        }
+        return 1;
+    }
+    else {
+        fprintf(stderr, "unrecognized streaming header '%c', size=%d bytes\n",
+                copybuf[0], buflen);
+        return -1;
+    }
+}
+
+static int sendShardFeedback(struct Shard* shard, int64_t now, bool reply_requested)
+{
+    if (sendFeedback(shard->conn, now, shard->received_lsn, shard->next_feedback_lsn,
+                reply_requested) < 0) {
+        return -1;
+    }
+    shard->last_feedback_sent_at = now;
+    shard->last_sent_feedback_lsn = shard->next_feedback_lsn;
+    shard->feedback_requested = false;
+    return 0;
+}
+
+// Writes transactions that no other shards can precede. Sets the earliest
+// time to request keepalive messages again to r_retry_at if the merge is
+// blocked by shards that didn't answer yet.
+static int mergeShards(struct Shard* shards, int count, int64_t now, int64_t* r_retry_at)
+{
+    *r_retry_at = NO_DEADLINE;
+
+    while (true) {
+        struct Shard* first = NULL;
+        for (int i = 0; i < count; i++) {
+            if (shards[i].txns_count > 0 && (first == NULL ||
+                        shards[i].txns[shards[i].txns_head].commit_lsn <
+                        first->txns[first->txns_head].commit_lsn)) {
+                first = &shards[i];
+            }
+        }
+        if (first == NULL) {
+            return 0;
+        }
+
+        struct PendingTxn* txn = &first->txns[first->txns_head];
+        bool ready = true;
+        for (int i = 0; i < count; i++) {
+            struct Shard* shard = &shards[i];
+            if (shard->txns_count == 0 && shard->watermark < txn->commit_lsn) {
+                ready = false;
+                // Ask the shard for a keepalive message to know its walEnd
+                int64_t retry_at = shard->keepalive_requested_at +
+                    SHARD_KEEPALIVE_REQUEST_INTERVAL * 1000L;
+                if (retry_at <= now) {
+                    if (sendShardFeedback(shard, now, true) < 0) {
+                        return -1;
+                    }
+                    shard->keepalive_requested_at = now;
+                    retry_at = now + SHARD_KEEPALIVE_REQUEST_INTERVAL * 1000L;
+                }
+                if (retry_at < *r_retry_at) {
+                    *r_retry_at = retry_at;
+                }
+            }
+        }
+        if (!ready) {
+            return 0;
+        }
+
+        for (size_t n = 0; n < txn->nrows; n++) {
+            struct PendingRow* row = shiftShardRow(first);
+            int r = emitRow(row->wal_pos, row->wal_end, row->send_time, row->receive_time,
+                    row->data, row->size, row->buf);
+            if (r == -1) {
+                perror("failed to write data to output");
+                return -2;
+            }
+            else if (r == -2) {
+                return -1;
+            }
+            if (cfg_auto_feedback) {
+                for (int i = 0; i < count; i++) {
+                    if (shards[i].next_feedback_lsn < row->wal_end &&
+                            row->wal_end <= shards[i].watermark) {
+                        shards[i].next_feedback_lsn = row->wal_end;
+                    }
+                }
+            }
+        }
+        first->txns_head = (first->txns_head + 1) % first->txns_cap;
+        first->txns_count--;
+    }
 }
 
-static ExitCode runLoop(PGconn* conn)
+static ExitCode runShardLoop(struct Shard* shards, int count)
 {
     ExitCode ecode;
-    int64_t last_feedback_sent_at = 0;
-    int64_t last_sent_feedback_lsn = InvalidXLogRecPtr;
     int64_t next_feedback_lsn = InvalidXLogRecPtr;
-    int64_t received_lsn = InvalidXLogRecPtr;
+    int64_t ack_lsn = InvalidXLogRecPtr;
+    int64_t retry_at = NO_DEADLINE;
     bool quit_requested = false;
-    bool feedback_requested = false;
-    char* copybuf = NULL;
-    bool pq_ready = false;
     bool cmd_ready = false;
+    bool partitions_ready = false;
+    bool paused = false;  // a spool is full or the ring has a backlog
+    bool txn_framing = hasConfigParam(&cfg_plugin_params, "format-version", "2");
+    struct EventLoop loop;
+
+    if (initEventLoop(&loop) < 0 ||
+            addEventSource(&loop, cfg_cmd_fd, EVENT_CMD) < 0 ||
+            addPartitionSources(&loop) < 0 ||
+            addSpoolSources(&loop) < 0 ||
+            (s_ring.header != NULL && addEventSource(&loop, s_ring.wait_fd, EVENT_RING) < 0)) {
+        perror("Failed to initialize event loop");
+        destroyEventLoop(&loop);
+        return ECODE_SYSTEM_ERROR;
+    }
+    for (int i = 0; i < count; i++) {
+        int pq_socket = PQsocket(shards[i].conn);
+        if (pq_socket < 0) {
+            fprintf(stderr, "Failed to get a socket of the connection: %s\n", PQerrorMessage(shards[i].conn));
+            destroyEventLoop(&loop);
+            return ECODE_PG_ERROR;
+        }
+        if (addEventSource(&loop, pq_socket, EVENT_SHARD(i)) < 0) {
+            perror("Failed to initialize event loop");
+            destroyEventLoop(&loop);
+            return ECODE_SYSTEM_ERROR;
+        }
+    }
 
     while (true) {
-        if (copybuf != NULL) {
-            PQfreemem(copybuf);
-            copybuf = NULL;
+        int64_t now = feGetCurrentTimestamp();
+
+        if (s_ring.header != NULL) {
+            pollRingAck(&s_ring, &next_feedback_lsn);
         }
 
-        int64_t now = feGetCurrentTimestamp();
+        // Acknowledged LSN is confirmed by all shards because all
+        // transactions committed before it are already written.
+        if (ack_lsn != next_feedback_lsn) {
+            ack_lsn = next_feedback_lsn;
+            for (int i = 0; i < count; i++) {
+                shards[i].next_feedback_lsn =
+                    ack_lsn < shards[i].watermark ? ack_lsn : shards[i].watermark;
+            }
+        }
 
         // If feedback is needed, send feedback to PostgreSQL
-        if (isFeedbackNeeded(now, feedback_requested, next_feedback_lsn, last_sent_feedback_lsn, last_feedback_sent_at)) {
-            int r = sendFeedback(conn, now, received_lsn, next_feedback_lsn);
-            if (r < 0) {
-                ecode = ECODE_PG_ERROR;
-                goto error;
+        for (int i = 0; i < count; i++) {
+            struct Shard* shard = &shards[i];
+            FeedbackReason reason = isFeedbackNeeded(now, shard->feedback_requested,
+                    shard->next_feedback_lsn, shard->last_sent_feedback_lsn, shard->last_feedback_sent_at);
+            if (reason != FEEDBACK_NONE) {
+                if (sendShardFeedback(shard, now, false) < 0) {
+                    ecode = ECODE_PG_ERROR;
+                    goto error;
+                }
+                recordFeedback(&s_stats, reason, shard->last_sent_feedback_lsn);
             }
-            last_feedback_sent_at = now;
-            last_sent_feedback_lsn = next_feedback_lsn;
-            feedback_requested = false;
         }
+        updateMetrics(now);
 
-        // If abort is requested by signal, exit
         if (sig_abort_req) {
             if (cfg_verbose) {
                 fprintf(stderr, "Signal received to exit.\n");
@@ -492,7 +7394,6 @@ static ExitCode runLoop(PGconn* conn)
             goto error;
         }
 
-        // If quit is requested by a command, exit
         if (quit_requested) {
             if (cfg_verbose) {
                 fprintf(stderr, "Quit command received to exit.\n");
@@ -501,72 +7402,81 @@ static ExitCode runLoop(PGconn* conn)
             goto error;
         }
 
-        // If PQgetCopyData is ready to call, try to receive a row
-        if (pq_ready) {
-            if (PQconsumeInput(conn) == 0) {
-                fprintf(stderr, "Failed to receive additional replication data: %s\n", PQerrorMessage(conn));
+        // Receive rows from shards unless a spool or the buffer of the
+        // shard is full
+        bool pq_ready = false;
+        for (int i = 0; i < count; i++) {
+            struct Shard* shard = &shards[i];
+            if (!shard->pq_ready || paused || isShardFull(shard)) {
+                continue;
+            }
+            if (PQconsumeInput(shard->conn) == 0) {
+                fprintf(stderr, "Failed to receive additional replication data (%s): %s\n",
+                        shard->slot_name, PQerrorMessage(shard->conn));
                 ecode = ECODE_PG_ERROR;
                 goto error;
             }
-            // call select(2) only when PQgetCopyData doesn't return 0 after
-            // PQconsumeInput. pq_ready is set to true if PQgetCopyData
-            // returns 0.
-            pq_ready = false;
+            shard->pq_ready = false;
 
             while (true) {
-                // PQgetCopyData with async=true mode receives a complete row
-                // and return byte size > 0. Otherwise return 0 immediately.
-                int buflen = PQgetCopyData(conn, &copybuf, true);
+                char* copybuf = NULL;
+                int buflen = PQgetCopyData(shard->conn, &copybuf, true);
                 if (buflen > 0) {
-                    int r = processRow(copybuf, buflen,
-                            &feedback_requested, &received_lsn, &next_feedback_lsn);
-                    if (r == -1) {
-                        // Protocol error
-                        ecode = ECODE_PG_ERROR;
-                        goto error;
+                    int r = processShardRow(shard, copybuf, buflen, now, txn_framing);
+                    if (r != 1) {
+                        PQfreemem(copybuf);
                     }
-                    else if (r == -2) {
-                        // Failed to write output
-                        ecode = ECODE_SYSTEM_ERROR;
+                    if (r < 0) {
+                        ecode = ECODE_PG_ERROR;
                         goto error;
                     }
-                    pq_ready = true;
-                    // continoue to PQgetCopyData call again. Call PQgetCopyData until
-                    // it returns 0, then call PQconsumeInput.
+                    shard->pq_ready = true;
+                    // See runLoop
+                    cmd_ready = true;
+                    partitions_ready = setPartitionsReady(~0U);
                 }
                 else if (buflen == 0) {
-                    // end pq_ready
                     break;
                 }
                 else if (buflen == -1) {
-                    fprintf(stderr, "Replication stream closed.\n");
+                    fprintf(stderr, "Replication stream closed (%s).\n", shard->slot_name);
                     ecode = ECODE_PG_CLOSED;
                     goto error;
                 }
-                else {  // buflen < -1
-                    fprintf(stderr, "Failed to receive replication data: %s\n", PQerrorMessage(conn));
+                else {
+                    fprintf(stderr, "Failed to receive replication data (%s): %s\n",
+                            shard->slot_name, PQerrorMessage(shard->conn));
                     ecode = ECODE_PG_ERROR;
                     goto error;
                 }
             }
+            pq_ready = pq_ready || shard->pq_ready;
+        }
+
+        // Write transactions in commit order
+        int r = mergeShards(shards, count, now, &retry_at);
+        if (r == -1) {
+            ecode = ECODE_PG_ERROR;
+            goto error;
+        }
+        else if (r == -2) {
+            ecode = ECODE_SYSTEM_ERROR;
+            goto error;
         }
 
-        // If cmd is ready to receive, try to receive commands
         if (cmd_ready) {
-            // getCmdData reads data from cfg_cmd_fd and
-            // return byte size > 0. Otherwise return 0 immediately.
-            int buflen = getCmdData();
+            int buflen = getCmdData(&s_cmd, cfg_cmd_fd, s_cmd_fd_set_flags);
             if (buflen > 0) {
-                int r = processCommands(&next_feedback_lsn, &quit_requested);
-                if (r < 0) {
+                if (processCommands(&s_cmd, NULL, &next_feedback_lsn, &quit_requested) < 0) {
                     ecode = ECODE_CMD_ERROR;
                     goto error;
                 }
                 if (quit_requested) {
                     // Send feedback before quit
-                    feedback_requested = true;
+                    for (int i = 0; i < count; i++) {
+                        shards[i].feedback_requested = true;
+                    }
                 }
-                // end cmd_ready
             }
             else if (buflen == 0) {
                 cmd_ready = false;
@@ -576,17 +7486,33 @@ static ExitCode runLoop(PGconn* conn)
                 ecode = ECODE_CMD_CLOSED;
                 goto error;
             }
-            else {  // buflen < 0
+            else {
                 perror("Failed to read STDIN");
                 ecode = ECODE_CMD_ERROR;
                 goto error;
             }
         }
 
-        // If pq_ready=false (last PQgetCopyData call returned 0)
-        // or cmd_ready=false (last getCmdData call returned 0),
-        // then use select() to wait for additional data.
-        if (!pq_ready && !cmd_ready && !feedback_requested) {
+        if (partitions_ready) {
+            ecode = readPartitionCommands(&next_feedback_lsn, &quit_requested, &partitions_ready);
+            if (ecode != ECODE_SUCCESS) {
+                goto error;
+            }
+            if (quit_requested) {
+                for (int i = 0; i < count; i++) {
+                    shards[i].feedback_requested = true;
+                }
+            }
+        }
+
+        confirmFiltered(&next_feedback_lsn);
+
+        bool feedback_requested = false;
+        for (int i = 0; i < count; i++) {
+            feedback_requested = feedback_requested || shards[i].feedback_requested;
+        }
+
+        if (!pq_ready && !cmd_ready && !partitions_ready && !feedback_requested) {
             // out-of-bound flush before blocking operation
             if (flushOut() < 0) {
                 perror("failed to write data to output");
@@ -594,300 +7520,103 @@ static ExitCode runLoop(PGconn* conn)
                 goto error;
             }
 
-            fd_set select_fds;
-            int pq_socket = PQsocket(conn);
-            if (pq_socket < 0) {
-                fprintf(stderr, "Failed to get a socket of the connection: %s\n", PQerrorMessage(conn));
-                ecode = ECODE_PG_ERROR;
+            if ((cfg_spool_size > 0 || s_ring.header != NULL) && pollSpools(&loop, &paused) < 0) {
+                perror("Failed to update event sources");
+                ecode = ECODE_SYSTEM_ERROR;
                 goto error;
             }
+            bool shards_ready = false;
+            for (int i = 0; i < count; i++) {
+                bool enabled = !paused && !isShardFull(&shards[i]);
+                if (setEventSourceEnabled(&loop, PQsocket(shards[i].conn), false, enabled) < 0) {
+                    perror("Failed to update event sources");
+                    ecode = ECODE_SYSTEM_ERROR;
+                    goto error;
+                }
+                shards_ready = shards_ready || (enabled && shards[i].pq_ready);
+            }
+            if (shards_ready) {
+                continue;
+            }
 
-            FD_ZERO(&select_fds);
-            FD_SET(pq_socket, &select_fds);
-            FD_SET(cfg_cmd_fd, &select_fds);
-
-            int max_fd = pq_socket;
-            if (max_fd < cfg_cmd_fd) max_fd = cfg_cmd_fd;
-
-            struct timeval timeout;
-            long timeoutMillis = selectTimeoutMillis(now,
-                    next_feedback_lsn, last_sent_feedback_lsn, last_feedback_sent_at);
-            timeout.tv_sec = timeoutMillis / 1000L;
-            timeout.tv_usec = timeoutMillis % 1000L * 1000L;
-
-            int r = select(max_fd + 1, &select_fds, NULL, NULL, &timeout);
-            if (r == 0 || (r < 0 && errno == EINTR)) {
-                // Timeout or interrupted by a signal. Continue the loop.
+            // Wake up at the earliest deadline of all shards
+            int64_t min_feedback_deadline = retry_at;
+            int64_t min_status_deadline = NO_DEADLINE;
+            for (int i = 0; i < count; i++) {
+                int64_t feedback_deadline;
+                int64_t status_deadline;
+                feedbackDeadlines(shards[i].next_feedback_lsn, shards[i].last_sent_feedback_lsn,
+                        shards[i].last_feedback_sent_at, &feedback_deadline, &status_deadline);
+                if (feedback_deadline < min_feedback_deadline) min_feedback_deadline = feedback_deadline;
+                if (status_deadline < min_status_deadline) min_status_deadline = status_deadline;
             }
-            else if (r < 0) {
-                perror("select(2)");
+            if (metricsDeadline() < min_feedback_deadline) min_feedback_deadline = metricsDeadline();
+            if (setEventDeadlines(&loop, min_feedback_deadline, min_status_deadline) < 0) {
+                perror("Failed to set a timer");
                 ecode = ECODE_SYSTEM_ERROR;
                 goto error;
             }
-            else {
-                // If pq_socket is ready, call PQconsumeInput and set pq_ready=true
-                if (FD_ISSET(pq_socket, &select_fds)) {
-                    if (PQconsumeInput(conn) == 0) {
-                        fprintf(stderr, "Failed to receive additional replication data: %s\n", PQerrorMessage(conn));
-                        ecode = ECODE_PG_ERROR;
-                        goto error;
-                    }
-                    pq_ready = true;
-                }
 
-                // If cfg_cmd_fd is ready, set cmd_ready=true
-                if (FD_ISSET(cfg_cmd_fd, &select_fds)) {
-                    cmd_ready = true;
-                }
+            if (s_ring.header != NULL && !enterRingWait(&s_ring, &next_feedback_lsn)) {
+                continue;
             }
-        }
-
-    }  // while (true)
-
-error:
-    if (copybuf != NULL) {
-        PQfreemem(copybuf);
-        copybuf = NULL;
-    }
-
-    flushOut();
-
-    return ecode;
-}
-
-static int setNonBlocking(void)
-{
-    // Remove non-blocking flag from STDOUT
-    int out_flags = fcntl(cfg_out_fd, F_GETFL, 0);
-    if (out_flags < 0) {
-        return -1;
-    }
-    if (fcntl(cfg_out_fd, F_SETFL, out_flags & ~O_NONBLOCK) < 0) {
-        return -1;
-    }
-
-    // Set non-blocking flag to STDIN
-    int in_flags = fcntl(cfg_cmd_fd, F_GETFL, 0);
-    if (in_flags < 0) {
-        return -1;
-    }
-    if (fcntl(cfg_cmd_fd, F_SETFL, in_flags | O_NONBLOCK) < 0) {
-        return -1;
-    }
-
-    // Get flags of STDOUT again
-    out_flags = fcntl(cfg_out_fd, F_GETFL, 0);
-    if (out_flags < 0) {
-        return -1;
-    }
-
-    if (out_flags & O_NONBLOCK) {
-        // Setting non-blocking flag to STDIN sets non-blocking flag
-        // also to STDOUT. This happens when they share the same
-        // socket or tty on some platforms (darwin). In this case,
-        // call fcntl always around read.
-        if (fcntl(cfg_out_fd, F_SETFL, out_flags & ~O_NONBLOCK) < 0) {
-            return -1;
-        }
-        s_cmd_fd_set_flags = in_flags | O_NONBLOCK;
-    }
-    else {
-        s_cmd_fd_set_flags = 0;
-    }
-
-    return 0;
-}
-
-////
-// > IDENTIFY_SYSTEM
-//
-static int runIdentifySystem(PGconn* conn)
-{
-    // Setup signal handlers
-    setupSignalHandlers();
-
-    // Run IDENTIFY_SYSTEM
-    if (cfg_verbose) {
-        fprintf(stderr, "> IDENTIFY_SYSTEM\n");
-    }
-    PGresult* res = PQexec(conn, "IDENTIFY_SYSTEM");
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "IDENTIFY_SYSTEM: %s\n", PQerrorMessage(conn));
-        PQclear(res);
-        return -1;
-    }
 
-    // Print information
-    if (cfg_verbose) {
-        fprintf(stderr, "System status:\n");
-        for (int r = 0; r < PQntuples(res); r++) {
-            int fields = PQnfields(res);
-            for (int c = 0; c < fields; c++) {
-                fprintf(stderr, "  %s=%s\n", PQfname(res, c), PQgetvalue(res, r, c));
+            uint32_t events;
+            if (waitEvents(&loop, now, &events) < 0) {
+                ecode = ECODE_SYSTEM_ERROR;
+                goto error;
             }
-        }
-        fprintf(stderr, "  libpq=%d\n", PQlibVersion());
-    }
-
-    PQclear(res);
-    return 0;
-}
-
-////
-// > CREATE_REPLICATION_SLOT
-//
-static int createReplicationSlot(PGconn* conn)
-{
-    struct QueryBuffer qb;
-    initQueryBuffer(&qb);
-
-    if (cfg_poll_mode) {
-        char* liter_slot_name = PQescapeLiteral(conn, cfg_slot_name, strlen(cfg_slot_name));
-        char* liter_create_slot_plugin = PQescapeLiteral(conn, cfg_create_slot_plugin, strlen(cfg_create_slot_plugin));
-        appendQueryBuffer(&qb, "select * from pg_create_logical_replication_slot(");
-        appendQueryBuffer(&qb, liter_slot_name);
-        appendQueryBuffer(&qb, ", ");
-        appendQueryBuffer(&qb, liter_create_slot_plugin);
-        appendQueryBuffer(&qb, ")");
-        PQfreemem(liter_slot_name);
-        PQfreemem(liter_create_slot_plugin);
-    }
-    else {
-        char* ident_slot_name = PQescapeIdentifier(conn, cfg_slot_name, strlen(cfg_slot_name));
-        char* ident_create_slot_plugin = PQescapeIdentifier(conn, cfg_create_slot_plugin, strlen(cfg_create_slot_plugin));
-        appendQueryBuffer(&qb, "CREATE_REPLICATION_SLOT ");
-        appendQueryBuffer(&qb, ident_slot_name);
-        appendQueryBuffer(&qb, " LOGICAL ");
-        appendQueryBuffer(&qb, ident_create_slot_plugin);
-        PQfreemem(ident_slot_name);
-        PQfreemem(ident_create_slot_plugin);
-    }
-
-    if (cfg_verbose) {
-        fprintf(stderr, "> %s\n", qb.str);
-    }
-
-    PGresult* res = PQexec(conn, qb.str);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        const char* sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
-
-        // If slot already exists, return 1.
-        if (strcmp(SQLSTATE_ERRCODE_DUPLICATE_OBJECT, sqlstate) == 0) {
-            destroyQueryBuffer(&qb);
-            PQclear(res);
-            return 1;
-        }
-
-        // Other errors return -1.
-        fprintf(stderr, "Failed to create a replication slot (%s): %s\n",
-                sqlstate, PQerrorMessage(conn));
-        destroyQueryBuffer(&qb);
-        PQclear(res);
-        return -1;
-    }
-
-    destroyQueryBuffer(&qb);
-    PQclear(res);
-    return 0;
-}
-
-////
-// > START_REPLICATION
-//
-static ExitCode runStartReplication(PGconn* conn, int64_t start_lsn)
-{
-    char start_lsn_buffer[16*2+1+1];
-    sprintf(start_lsn_buffer, "%X/%X",
-            (uint32_t) (start_lsn >> 32), (uint32_t) start_lsn);
-
-    struct QueryBuffer qb;
-    initQueryBuffer(&qb);
 
-    {
-        char* ident_slot_name = PQescapeIdentifier(conn, cfg_slot_name, strlen(cfg_slot_name));
-        appendQueryBuffer(&qb, "START_REPLICATION SLOT ");
-        appendQueryBuffer(&qb, ident_slot_name);
-        appendQueryBuffer(&qb, " LOGICAL ");
-        appendQueryBuffer(&qb, start_lsn_buffer);
-        PQfreemem(ident_slot_name);
-    }
+            if (s_ring.header != NULL) {
+                leaveRingWait(&s_ring, events);
+            }
 
-    if (cfg_plugin_params.count > 0) {
-        appendQueryBuffer(&qb, " (");
-        for (int i=0; i < cfg_plugin_params.count; i++) {
-            if (i != 0) {
-                appendQueryBuffer(&qb, ", ");
+            for (int i = 0; i < count; i++) {
+                if (events & EVENT_SHARD(i)) {
+                    shards[i].pq_ready = true;
+                }
             }
-            if (cfg_plugin_params.values[i] != NULL) {
-                char* ident_key = PQescapeIdentifier(conn, cfg_plugin_params.keys[i], strlen(cfg_plugin_params.keys[i]));
-                char* liter_value = PQescapeLiteral(conn, cfg_plugin_params.values[i], strlen(cfg_plugin_params.values[i]));
-                appendQueryBuffer(&qb, ident_key);
-                appendQueryBuffer(&qb, " ");
-                appendQueryBuffer(&qb, liter_value);
-                PQfreemem(ident_key);
-                PQfreemem(liter_value);
+            if (events & EVENT_CMD) {
+                cmd_ready = true;
             }
-            else {
-                char* ident_key = PQescapeIdentifier(conn, cfg_plugin_params.keys[i], strlen(cfg_plugin_params.keys[i]));
-                appendQueryBuffer(&qb, ident_key);
-                PQfreemem(ident_key);
+            if (setPartitionsReady(events)) {
+                partitions_ready = true;
+            }
+            if (events & EVENT_OUT) {
+                if (drainSpools() < 0) {
+                    perror("failed to write data to output");
+                    ecode = ECODE_SYSTEM_ERROR;
+                    goto error;
+                }
+                paused = isSpoolFull();
             }
         }
-        appendQueryBuffer(&qb, ")");
-    }
-
-    if (cfg_verbose) {
-        fprintf(stderr, "> %s\n", qb.str);
     }
 
-    PGresult* res = PQexec(conn, qb.str);
-    if (PQresultStatus(res) != PGRES_COPY_BOTH) {
-        const char* sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
-
-        // If slot is in use by another client, return ECODE_SLOT_IN_USE.
-        if (strcmp(SQLSTATE_ERRCODE_OBJECT_IN_USE, sqlstate) == 0) {
-            if (cfg_verbose) {
-                fprintf(stderr, "Replication slot is in use: %s\n", PQerrorMessage(conn));
-            }
-            destroyQueryBuffer(&qb);
-            PQclear(res);
-            return ECODE_SLOT_IN_USE;
-        }
-        // If slot does not exist, return ECODE_SLOT_NOT_EXIST.
-        else if (strcmp(SQLSTATE_ERRCODE_UNDEFINED_OBJECT, sqlstate) == 0) {
-            if (cfg_verbose) {
-                fprintf(stderr, "Replication does not exist: %s\n", PQerrorMessage(conn));
-            }
-            destroyQueryBuffer(&qb);
-            PQclear(res);
-            return ECODE_SLOT_NOT_EXIST;
-        }
+error:
+    flushOut();
 
-        // Otherwise, return ECODE_INIT_FAILED.
-        fprintf(stderr, "Failed to start replication (%s): %s\n",
-                sqlstate, PQerrorMessage(conn));
-        destroyQueryBuffer(&qb);
-        PQclear(res);
-        return ECODE_INIT_FAILED;
-    }
+    destroyEventLoop(&loop);
 
-    destroyQueryBuffer(&qb);
-    PQclear(res);
-    return ECODE_SUCCESS;
+    return ecode;
 }
 
-static ExitCode run(void)
+static ExitCode runShards(void)
 {
-    PGconn* conn = NULL;
     ExitCode ecode;
 
     // Allocate input buffer
-    s_cmdbuf = malloc(CMD_BUFSIZ);
-    s_cmdbf_len = 0;
+    initCmdBuffer(&s_cmd);
+    if (cfg_unordered_feedback || cfg_partition_count > 0) {
+        initInflight(&s_inflight, 1024);
+    }
 
     // Allocate output buffer
-    s_out_file = fdopen(cfg_out_fd, "a");
-    setvbuf(s_out_file, NULL, _IOFBF, OUT_BUFSIZ);  // ignore errors and use default
+    initOutBatch(&s_out, cfg_out_fd);
+    if (cfg_compress != COMPRESS_NONE) {
+        initLz4State(&s_lz4);
+        initByteBuffer(&s_frame, OUT_BUFSIZ);
+    }
 
     // Set non-blocking mode to command input file descriptor
     if (setNonBlocking() < 0) {
@@ -895,50 +7624,87 @@ static ExitCode run(void)
         ecode = ECODE_INIT_FAILED;
         goto done;
     }
-
-    // Establish the connection
-    conn = PQconnectdbParams(cfg_pq_params.keys, cfg_pq_params.values, 1);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(conn));
+    if (initPartitions() < 0) {
+        perror("Invalid --partition file descriptors");
         ecode = ECODE_INIT_FAILED;
         goto done;
     }
 
-    // Run IDENTIFY_SYSTEM
-    if (runIdentifySystem(conn) < 0) {
+    // Map the shared memory ring
+    if (cfg_ring_fd >= 0 && openRing(&s_ring, cfg_ring_fd, cfg_ring_notify_fd, cfg_ring_wait_fd) < 0) {
+        perror("Invalid --ring file descriptors");
         ecode = ECODE_INIT_FAILED;
         goto done;
     }
+#ifdef USE_IO_URING
+    if (cfg_io_uring && openUring(&s_uring) < 0) {
+        perror("Failed to set up io_uring");
+        ecode = ECODE_INIT_FAILED;
+        goto done;
+    }
+#endif
 
-    // Run START_REPLICATION
-    ecode = runStartReplication(conn, InvalidXLogRecPtr);
-    if (cfg_create_slot && ecode == ECODE_SLOT_NOT_EXIST) {
-        // If slot doesn't exist and --create-slot is set, create the slot
-        if (createReplicationSlot(conn) < 0) {
+    for (int i = 0; i < cfg_shard_count; i++) {
+        struct Shard* shard = &cfg_shards[i];
+
+        // Establish the connection
+        shard->conn = PQconnectdbParams(cfg_pq_params.keys, cfg_pq_params.values, 1);
+        if (PQstatus(shard->conn) != CONNECTION_OK) {
+            fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(shard->conn));
             ecode = ECODE_INIT_FAILED;
             goto done;
         }
-        // then retry runStartReplication.
-        ecode = runStartReplication(conn, InvalidXLogRecPtr);
-    }
-    if (ecode != ECODE_SUCCESS) {
-        goto done;
+
+        // Run IDENTIFY_SYSTEM
+        if (runIdentifySystem(shard->conn) < 0) {
+            ecode = ECODE_INIT_FAILED;
+            goto done;
+        }
+
+        // Plugin options of the shard are -o options and add-tables
+        for (int j = 0; j < cfg_plugin_params.count; j++) {
+            addConfigParam(&shard->plugin_params, cfg_plugin_params.keys[j], cfg_plugin_params.values[j]);
+        }
+
+        // Run START_REPLICATION
+        ecode = runStartReplication(shard->conn, shard->slot_name, &shard->plugin_params, InvalidXLogRecPtr);
+        if (cfg_create_slot && ecode == ECODE_SLOT_NOT_EXIST) {
+            if (createReplicationSlot(shard->conn, shard->slot_name) < 0) {
+                ecode = ECODE_INIT_FAILED;
+                goto done;
+            }
+            ecode = runStartReplication(shard->conn, shard->slot_name, &shard->plugin_params, InvalidXLogRecPtr);
+        }
+        if (ecode != ECODE_SUCCESS) {
+            goto done;
+        }
+        shard->pq_ready = true;
     }
 
-    // Run the main loop
     if (cfg_verbose) {
-        fprintf(stderr, "Replication started\n");
+        fprintf(stderr, "Replication started with %d shards\n", cfg_shard_count);
     }
 
-    ecode = runLoop(conn);
+    ecode = runShardLoop(cfg_shards, cfg_shard_count);
 
 done:
-    if (conn != NULL) {
-        if (cfg_verbose) {
-            fprintf(stderr, "Closing connection\n");
+    if (finishSpools() < 0 || finishRing(&s_ring) < 0) {
+        perror("failed to write data to output");
+        if (ecode == ECODE_SUCCESS) {
+            ecode = ECODE_SYSTEM_ERROR;
         }
-        PQfinish(conn);
     }
+    finishMetrics();
+    if (cfg_verbose) {
+        fprintf(stderr, "Closing connections\n");
+    }
+    for (int i = 0; i < cfg_shard_count; i++) {
+        destroyShard(&cfg_shards[i]);
+    }
+    closeRing(&s_ring);
+#ifdef USE_IO_URING
+    closeUring(&s_uring);
+#endif
     return ecode;
 }
 
@@ -961,6 +7727,8 @@ static ExitCode runPollLoop(PGconn* conn)
     }
 
     int64_t started_at = feGetCurrentTimestamp();
+    int64_t deadline = cfg_poll_has_duration ? started_at + cfg_poll_duration * 1000L : NO_DEADLINE;
+    long recheck_interval = 0;
     while (true) {
         // Select from pg_replication_slots
         PGresult* res = PQexec(conn, qb.str);
@@ -999,7 +7767,7 @@ static ExitCode runPollLoop(PGconn* conn)
             if (cfg_verbose) {
                 fprintf(stderr, "Slot doesn't exist.\n");
             }
-            if (createReplicationSlot(conn) < 0) {
+            if (createReplicationSlot(conn, cfg_slot_name) < 0) {
                 ecode = ECODE_INIT_FAILED;
                 goto done;
             }
@@ -1024,6 +7792,29 @@ static ExitCode runPollLoop(PGconn* conn)
             }
         }
 
+        // If the slot is in use and --slot-lock is set, wait until the
+        // active node releases the slot lock. The lock is free if the active
+        // node doesn't hold it, or if its walsender didn't release the slot
+        // yet. Then check again after a backoff up to --poll-interval.
+        if (exist && cfg_slot_lock) {
+            if (recheck_interval > 0) {
+                struct timespec sp = { recheck_interval / 1000, (recheck_interval % 1000) * 1000000L };
+                nanosleep(&sp, NULL);
+            }
+            recheck_interval = recheck_interval == 0 ? RECONNECT_BACKOFF_MIN : recheck_interval * 2;
+            if (recheck_interval > cfg_poll_interval) {
+                recheck_interval = cfg_poll_interval;
+            }
+            if (cfg_verbose) {
+                fprintf(stderr, "Slot is in use. Waiting for the slot lock.\n");
+            }
+            if (waitSlotLock(conn, deadline, false) < 0) {
+                ecode = ECODE_INIT_FAILED;
+                goto done;
+            }
+            continue;
+        }
+
         // Otherwise, wait.
         if (cfg_poll_interval > 0) {
             struct timespec sp;
@@ -1081,19 +7872,66 @@ static void showUsage(void)
     printf("  -o, --option KEY[=VALUE]     pass option NAME with optional value VALUE to the replication slot\n");
     printf("  -c, --create-slot            create a replication slot if not exist using the plugin set to --P option\n");
     printf("  -L, --poll-mode              check availability of the replication slot then exit\n");
+    printf("  -W, --standby                keep the connection and start replication when the slot becomes available\n");
     printf("  -D, --fd INTEGER             use the given file descriptor number instead of 1 (stdout)\n");
     printf("  -F, --feedback-interval SEC  maximum delay to send feedback to the replication slot (default: %.3f)\n", (cfg_feedback_interval / 1000.0));
     printf("  -s, --status-interval SECS   time between status messages sent to the server (default: %.3f)\n", (cfg_standby_message_interval / 1000.0));
     printf("  -A, --auto-feedback          send feedback automatically\n");
+    printf("  -a, --unordered-feedback     F command acknowledges one record and may arrive out of order (see README)\n");
     printf("  -H, --write-header           write a header line every before a record\n");
     printf("  -N, --write-nl               write a new line character every after a record\n");
+    printf("  -B, --binary-header          write a %d-byte binary header every before a record instead of a header line\n", FRAME_HEADER_SIZE);
+    printf("  -T, --transcode FORMAT       convert JSON records to msgpack or cbor\n");
+    printf("  -R, --ring FD,NOTIFY,WAIT    write records to the shared memory ring FD instead of --fd (see README)\n");
+    printf("  -Z, --spool SIZE             write output without blocking, keeping up to SIZE bytes (K, M or G\n");
+    printf("                               suffix) per output in memory while the consumer is behind (see README)\n");
+    printf("  -l, --spill DIR              write output to files in DIR after --spool bytes are kept in memory\n");
+    printf("  -M, --spill-size SIZE        pause reading when files in --spill reach SIZE (default: 1G)\n");
+    printf("  -z, --compress lz4           write output in LZ4 compressed frames (see README)\n");
+    printf("  -g, --compress-level LEVEL   1 (fastest) to %d (smallest) (default: 1)\n", COMPRESS_LEVEL_MAX);
+    printf("  -b, --compress-block SIZE    maximum uncompressed size of a frame (default: %dK)\n", OUT_BUFSIZ / 1024);
+    printf("  -q, --direct-read            parse the replication stream in reusable buffers instead of libpq\n");
+    printf("                               (not with SSL or GSS encryption, see README)\n");
+    printf("  -f, --stream-threshold SIZE  write records larger than SIZE as they arrive instead of buffering\n");
+    printf("                               them whole (requires --direct-read, see README)\n");
+    printf("  -Q, --io-uring               use io_uring for polling, timeouts and output writes (Linux 5.11+,\n");
+    printf("                               see README)\n");
+    printf("  -C, --binary-commands        read %d-byte binary commands instead of command lines (see README)\n", CMD_FRAME_SIZE);
+    printf("  -t, --stats-fd INTEGER       write output of S command to the given file descriptor instead of 2 (stderr)\n");
+    printf("  -G, --metrics FILE           write metrics in the Prometheus text format to FILE (see README)\n");
+    printf("  -I, --metrics-interval SECS  time between writes of --metrics (default: %.3f)\n", (cfg_metrics_interval / 1000.0));
     printf("  -j, --wal2json1              equivalent to -o include-lsn=true -P wal2json\n");
     printf("  -J  --wal2json2              equivalent to -o format-version=2 --write-header -P wal2json\n");
+    printf("  -O, --pgoutput PUBLICATIONS  decode pgoutput into wal2json format-version=2 records. Equivalent to\n");
+    printf("                               -o proto_version=1 -o publication_names=PUBLICATIONS --write-header -P pgoutput\n");
+    printf("  -n, --pgoutput-streaming     receive changes of large transactions before they commit (PostgreSQL 14+,\n");
+    printf("                               see README). Sets -o proto_version=2 -o streaming=on\n");
+    printf("  -r, --reconnect SECS         reconnect and restart replication if the connection is lost, giving up\n");
+    printf("                               after SECS (0: never). Requires --write-header or --binary-header\n");
+    printf("  -y, --start-lsn LSN          start replication from LSN if the slot confirmed an earlier one\n");
+    printf("  -w, --checkpoint FILE        keep the acknowledged LSN in FILE and start from it (see README)\n");
+    printf("  -V, --checkpoint-sync SECS   time between writes of --checkpoint (default: %.3f)\n", (cfg_checkpoint_interval / 1000.0));
     printf("\nCreate slot options:\n");
     printf("  -P, --plugin NAME            logical decoder plugin for a new replication slot (default: test_decoding)\n");
-    printf("\nPoll mode options:\n");
+    printf("\nShard mode options:\n");
+    printf("  -X, --shard SLOT=TABLES      stream tables matching TABLES (wal2json add-tables option) using slot SLOT\n");
+    printf("                               instead of --slot. Repeat to add shards (up to %d)\n", SHARDS_MAX);
+    printf("\nPartition options:\n");
+    printf("  -Y, --partition OUT,CMD      write rows of a hash partition of tables to fd OUT and read its F commands\n");
+    printf("                               from fd CMD instead of --fd. Repeat to add partitions (up to %d)\n", PARTITIONS_MAX);
+    printf("  -K, --partition-key          partition rows also by primary key values (adds -o include-pk=1)\n");
+    printf("\nFilter options:\n");
+    printf("  -e, --filter-tables TABLES   write only changes of tables in comma separated SCHEMA.TABLE names\n");
+    printf("  -E, --filter-actions ACTIONS write only changes of ACTIONS (I, U, D and T), or other actions if\n");
+    printf("                               ACTIONS starts with '-'\n");
+    printf("  -x, --filter-columns SCHEMA.TABLE=COLUMNS\n");
+    printf("                               write only comma separated COLUMNS of the table, or other columns if\n");
+    printf("                               COLUMNS starts with '-'\n");
+    printf("\nPoll mode and standby options:\n");
     printf("  -u, --poll-duration SECS     maximum amount of time to wait until slot becomes available (default: no limit)\n");
     printf("  -i, --poll-interval SECS     interval to check availability of a slot (default: %.3f)\n", (cfg_poll_interval / 1000.0));
+    printf("  -k, --slot-lock              hold an advisory lock while streaming, and wait for it in poll mode\n");
+    printf("                               instead of checking the slot every --poll-interval\n");
     printf("\nConnection options:\n");
     printf("  -d, --dbname DBNAME      database name to connect to\n");
     printf("  -h, --host HOSTNAME      database server host or socket directory\n");
@@ -1116,6 +7954,29 @@ static int parseInterval(const char* arg, const char* arg_name, long* r_millis)
     return 0;
 }
 
+// Parses a byte size with an optional K, M or G suffix
+static int parseSize(const char* arg, const char* arg_name, size_t* r_size)
+{
+    char* endpos = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &endpos, 10);
+    int shift = 0;
+    if (endpos != arg && *endpos != '\0' && endpos[1] == '\0') {
+        switch (*endpos) {
+        case 'K': shift = 10; endpos++; break;
+        case 'M': shift = 20; endpos++; break;
+        case 'G': shift = 30; endpos++; break;
+        }
+    }
+    if (errno != 0 || endpos == arg || *endpos != '\0' || arg[0] == '-' ||
+            v > (SIZE_MAX >> shift)) {
+        fprintf(stderr, "Invalid %s option: %s\n", arg_name, arg);
+        return -1;
+    }
+    *r_size = (size_t) v << shift;
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
     initConfigParam(&cfg_pq_params);
@@ -1128,17 +7989,48 @@ int main(int argc, char** argv)
         { "option",             required_argument, NULL, 'o' },
         { "create-slot",        no_argument,       NULL, 'c' },
         { "poll-mode",          no_argument,       NULL, 'L' },
+        { "standby",            no_argument,       NULL, 'W' },
         { "fd",                 required_argument, NULL, 'D' },
         { "feedback-interval",  required_argument, NULL, 'F' },
         { "status-interval",    required_argument, NULL, 's' },
         { "auto-feedback",      no_argument,       NULL, 'A' },
+        { "unordered-feedback", no_argument,       NULL, 'a' },
         { "write-header",       no_argument,       NULL, 'H' },
         { "write-nl",           no_argument,       NULL, 'N' },
+        { "binary-header",      no_argument,       NULL, 'B' },
+        { "transcode",          required_argument, NULL, 'T' },
+        { "ring",               required_argument, NULL, 'R' },
+        { "spool",              required_argument, NULL, 'Z' },
+        { "spill",              required_argument, NULL, 'l' },
+        { "spill-size",         required_argument, NULL, 'M' },
+        { "compress",           required_argument, NULL, 'z' },
+        { "compress-level",     required_argument, NULL, 'g' },
+        { "compress-block",     required_argument, NULL, 'b' },
+        { "direct-read",        no_argument,       NULL, 'q' },
+        { "stream-threshold",   required_argument, NULL, 'f' },
+        { "io-uring",           no_argument,       NULL, 'Q' },
+        { "binary-commands",    no_argument,       NULL, 'C' },
+        { "stats-fd",           required_argument, NULL, 't' },
+        { "metrics",            required_argument, NULL, 'G' },
+        { "metrics-interval",   required_argument, NULL, 'I' },
+        { "reconnect",          required_argument, NULL, 'r' },
+        { "start-lsn",          required_argument, NULL, 'y' },
+        { "checkpoint",         required_argument, NULL, 'w' },
+        { "checkpoint-sync",    required_argument, NULL, 'V' },
         { "wal2json1",          no_argument,       NULL, 'j' },
         { "wal2json2",          no_argument,       NULL, 'J' },
+        { "pgoutput",           required_argument, NULL, 'O' },
+        { "pgoutput-streaming", no_argument,       NULL, 'n' },
+        { "shard",              required_argument, NULL, 'X' },
+        { "partition",          required_argument, NULL, 'Y' },
+        { "partition-key",      no_argument,       NULL, 'K' },
+        { "filter-tables",      required_argument, NULL, 'e' },
+        { "filter-actions",     required_argument, NULL, 'E' },
+        { "filter-columns",     required_argument, NULL, 'x' },
         { "plugin",             required_argument, NULL, 'P' },
         { "poll-duration",      required_argument, NULL, 'u' },
         { "poll-interval",      required_argument, NULL, 'i' },
+        { "slot-lock",          no_argument,       NULL, 'k' },
         { "dbname",             required_argument, NULL, 'd' },
         { "host",               required_argument, NULL, 'h' },
         { "port",               required_argument, NULL, 'p' },
@@ -1149,7 +8041,7 @@ int main(int argc, char** argv)
 
     int opt;
     int longindex;
-    while ((opt = getopt_long(argc, argv, "?vS:o:cLD:F:s:AHNjJP:u:i:d:h:p:U:m:", longopts, &longindex)) != -1) {
+    while ((opt = getopt_long(argc, argv, "?vS:o:cLWD:F:s:AaHNBT:R:Z:l:M:z:g:b:qf:QCt:G:I:r:y:w:V:jJO:nX:Y:Ke:E:x:P:u:i:kd:h:p:U:m:", longopts, &longindex)) != -1) {
         switch (opt) {
         case '?':
             showUsage();
@@ -1174,6 +8066,102 @@ int main(int argc, char** argv)
                 cfg_out_fd = (int) v;
             }
             break;
+        case 't':
+            {
+                char* endpos = NULL;
+                long v = strtol(optarg, &endpos, 10);
+                if (endpos == optarg || *endpos != '\0' ||
+                        v < 0L || v == STDIN_FILENO || v > INT_MAX) {
+                    fprintf(stderr, "Invalid -t,--stats-fd option: %s\n", optarg);
+                    return ECODE_INVALID_ARGS;
+                }
+                cfg_stats_fd = (int) v;
+            }
+            break;
+        case 'G':
+            cfg_metrics_path = optarg;
+            break;
+        case 'I':
+            if (parseInterval(optarg, "-I,--metrics-interval", &cfg_metrics_interval) < 0) {
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'r':
+            cfg_reconnect = true;
+            if (parseInterval(optarg,"-r,--reconnect", &cfg_reconnect_timeout) < 0) {
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'y':
+            if (!parseLsn(optarg, optarg + strlen(optarg), &cfg_start_lsn)) {
+                fprintf(stderr, "Invalid -y,--start-lsn option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'w':
+            cfg_checkpoint_path = optarg;
+            break;
+        case 'V':
+            if (parseInterval(optarg, "-V,--checkpoint-sync", &cfg_checkpoint_interval) < 0) {
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'X':
+            if (cfg_shard_count >= SHARDS_MAX) {
+                fprintf(stderr, "Too many -X,--shard options: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            {
+                // Without add-tables, the shard would stream all tables
+                // and duplicate changes of the other shards
+                const char* eq = strchr(optarg, '=');
+                if (eq == NULL || eq[1] == '\0' || eq == optarg) {
+                    fprintf(stderr, "Invalid -X,--shard option (SLOT=TABLES is required): %s\n", optarg);
+                    return ECODE_INVALID_ARGS;
+                }
+            }
+            addShard(optarg);
+            break;
+        case 'Y':
+            {
+                int fds[2];
+                int n = -1;
+                if (cfg_partition_count >= PARTITIONS_MAX) {
+                    fprintf(stderr, "Too many -Y,--partition options: %s\n", optarg);
+                    return ECODE_INVALID_ARGS;
+                }
+                if (sscanf(optarg, "%d,%d%n", &fds[0], &fds[1], &n) != 2 ||
+                        n != (int) strlen(optarg) ||
+                        fds[0] < 0 || fds[0] == STDIN_FILENO || fds[1] < 0) {
+                    fprintf(stderr, "Invalid -Y,--partition option: %s\n", optarg);
+                    return ECODE_INVALID_ARGS;
+                }
+                cfg_partitions[cfg_partition_count].out_fd = fds[0];
+                cfg_partitions[cfg_partition_count].cmd_fd = fds[1];
+                cfg_partition_count++;
+            }
+            break;
+        case 'K':
+            cfg_partition_key = true;
+            break;
+        case 'e':
+            if (addFilterTables(optarg) < 0) {
+                fprintf(stderr, "Invalid -e,--filter-tables option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'E':
+            if (setFilterActions(optarg) < 0) {
+                fprintf(stderr, "Invalid -E,--filter-actions option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'x':
+            if (setFilterColumns(optarg) < 0) {
+                fprintf(stderr, "Invalid -x,--filter-columns option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
         case 'c':
             cfg_create_slot = true;
             break;
@@ -1183,6 +8171,9 @@ int main(int argc, char** argv)
         case 'L':
             cfg_poll_mode = true;
             break;
+        case 'W':
+            cfg_standby = true;
+            break;
         case 'u':
             cfg_poll_has_duration = true;
             if (parseInterval(optarg,"-u,--poll-duration", &cfg_poll_duration) < 0) {
@@ -1194,9 +8185,15 @@ int main(int argc, char** argv)
                 return ECODE_INVALID_ARGS;
             }
             break;
+        case 'k':
+            cfg_slot_lock = true;
+            break;
         case 'A':
             cfg_auto_feedback = true;
             break;
+        case 'a':
+            cfg_unordered_feedback = true;
+            break;
         case 'H':
             cfg_write_header = true;
             break;
@@ -1213,6 +8210,85 @@ int main(int argc, char** argv)
         case 'N':
             cfg_write_nl = true;
             break;
+        case 'B':
+            cfg_binary_header = true;
+            break;
+        case 'C':
+            cfg_binary_commands = true;
+            break;
+        case 'T':
+            if (strcmp(optarg, "msgpack") == 0) {
+                cfg_transcode = TRANSCODE_MSGPACK;
+            }
+            else if (strcmp(optarg, "cbor") == 0) {
+                cfg_transcode = TRANSCODE_CBOR;
+            }
+            else {
+                fprintf(stderr, "Invalid -T,--transcode option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'R':
+            {
+                int fds[3];
+                int n = -1;
+                if (sscanf(optarg, "%d,%d,%d%n", &fds[0], &fds[1], &fds[2], &n) != 3 ||
+                        n != (int) strlen(optarg) ||
+                        fds[0] < 0 || fds[1] < 0 || fds[2] < 0) {
+                    fprintf(stderr, "Invalid -R,--ring option: %s\n", optarg);
+                    return ECODE_INVALID_ARGS;
+                }
+                cfg_ring_fd = fds[0];
+                cfg_ring_notify_fd = fds[1];
+                cfg_ring_wait_fd = fds[2];
+            }
+            break;
+        case 'Z':
+            if (parseSize(optarg, "-Z,--spool", &cfg_spool_size) < 0) {
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'l':
+            cfg_spill_dir = optarg;
+            break;
+        case 'M':
+            if (parseSize(optarg, "-M,--spill-size", &cfg_spill_size) < 0) {
+                return ECODE_INVALID_ARGS;
+            }
+            if (cfg_spill_size == 0) {
+                fprintf(stderr, "Invalid -M,--spill-size option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'z':
+            if (strcmp(optarg, "lz4") == 0) {
+                cfg_compress = COMPRESS_LZ4;
+            }
+            else {
+                fprintf(stderr, "Invalid -z,--compress option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'g':
+            {
+                char* endpos = NULL;
+                long v = strtol(optarg, &endpos, 10);
+                if (*endpos != '\0' || v < 1 || v > COMPRESS_LEVEL_MAX) {
+                    fprintf(stderr, "Invalid -g,--compress-level option: %s\n", optarg);
+                    return ECODE_INVALID_ARGS;
+                }
+                cfg_compress_level = (int) v;
+            }
+            break;
+        case 'b':
+            if (parseSize(optarg, "-b,--compress-block", &cfg_compress_block) < 0) {
+                return ECODE_INVALID_ARGS;
+            }
+            if (cfg_compress_block == 0 || cfg_compress_block > COMPRESS_BLOCK_MAX) {
+                fprintf(stderr, "Invalid -b,--compress-block option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
         case 'j':
             // Old wal2json doesn't support format-version option itself
             //addConfigParamArg(&cfg_plugin_params, "format-version=1");
@@ -1224,6 +8300,36 @@ int main(int argc, char** argv)
             cfg_write_header = true;
             cfg_create_slot_plugin = "wal2json";
             break;
+        case 'O':
+            // proto_version is added after parsing (see --pgoutput-streaming)
+            addConfigParam(&cfg_plugin_params, "publication_names", optarg);
+            cfg_write_header = true;
+            cfg_create_slot_plugin = "pgoutput";
+            cfg_pgoutput = true;
+            break;
+        case 'n':
+            cfg_pgoutput_streaming = true;
+            break;
+        case 'q':
+            cfg_direct_read = true;
+            break;
+        case 'f':
+            if (parseSize(optarg, "-f,--stream-threshold", &cfg_stream_threshold) < 0) {
+                return ECODE_INVALID_ARGS;
+            }
+            if (cfg_stream_threshold == 0) {
+                fprintf(stderr, "Invalid -f,--stream-threshold option: %s\n", optarg);
+                return ECODE_INVALID_ARGS;
+            }
+            break;
+        case 'Q':
+#ifdef USE_IO_URING
+            cfg_io_uring = true;
+            break;
+#else
+            fprintf(stderr, "--io-uring option is supported only on Linux.\n");
+            return ECODE_INVALID_ARGS;
+#endif
         case 'd':
             addConfigParam(&cfg_pq_params, "dbname", optarg);
             break;
@@ -1249,7 +8355,142 @@ int main(int argc, char** argv)
         }
     }
 
-    if (cfg_slot_name == NULL) {
+    if (cfg_pgoutput_streaming && !cfg_pgoutput) {
+        fprintf(stderr, "--pgoutput-streaming option requires --pgoutput.\n");
+        return ECODE_INVALID_ARGS;
+    }
+    if (cfg_pgoutput) {
+        addConfigParam(&cfg_plugin_params, "proto_version", cfg_pgoutput_streaming ? "2" : "1");
+        if (cfg_pgoutput_streaming) {
+            addConfigParam(&cfg_plugin_params, "streaming", "on");
+        }
+    }
+
+    if (cfg_shard_count > 0 && (cfg_slot_name != NULL || cfg_poll_mode || cfg_pgoutput)) {
+        fprintf(stderr, "--shard option can't be used with --slot, --poll-mode or --pgoutput.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_standby && (cfg_shard_count > 0 || cfg_poll_mode)) {
+        fprintf(stderr, "--standby option can't be used with --shard or --poll-mode.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_unordered_feedback && (cfg_auto_feedback || cfg_ring_fd >= 0)) {
+        fprintf(stderr, "--unordered-feedback option can't be used with --auto-feedback or --ring.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_partition_count > 0 && (cfg_unordered_feedback || cfg_auto_feedback || cfg_ring_fd >= 0)) {
+        fprintf(stderr, "--partition option can't be used with --unordered-feedback, --auto-feedback or --ring.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_partition_count > 0 && !cfg_pgoutput &&
+            !hasConfigParam(&cfg_plugin_params, "format-version", "2")) {
+        // Rows are routed by "schema" and "table" fields of a record
+        fprintf(stderr, "--partition option requires -o format-version=2 or --pgoutput.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_spool_size > 0 && (cfg_ring_fd >= 0 || cfg_poll_mode)) {
+        fprintf(stderr, "--spool option can't be used with --ring or --poll-mode.\n");
+        return ECODE_INVALID_ARGS;
+    }
+    if (cfg_spill_dir != NULL) {
+        if (cfg_spool_size == 0) {
+            fprintf(stderr, "--spill option requires --spool.\n");
+            return ECODE_INVALID_ARGS;
+        }
+        if (access(cfg_spill_dir, W_OK | X_OK) < 0) {
+            fprintf(stderr, "Invalid -l,--spill option: %s: %s\n", cfg_spill_dir, strerror(errno));
+            return ECODE_INVALID_ARGS;
+        }
+        if (cfg_spill_size < cfg_spill_segment_size) {
+            cfg_spill_segment_size = cfg_spill_size;
+        }
+    }
+    for (int i = 0; i < cfg_partition_count && cfg_spool_size > 0; i++) {
+        if (cfg_partitions[i].out_fd == cfg_partitions[i].cmd_fd) {
+            // The fd would be polled for both reading and writing
+            fprintf(stderr, "--spool option requires different OUT and CMD fds of --partition.\n");
+            return ECODE_INVALID_ARGS;
+        }
+    }
+
+    if (cfg_filter.enabled && !cfg_pgoutput &&
+            !hasConfigParam(&cfg_plugin_params, "format-version", "2")) {
+        // Records are filtered by "action", "schema" and "table" fields
+        fprintf(stderr, "--filter options require -o format-version=2 or --pgoutput.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_partition_key && (cfg_partition_count == 0 || cfg_pgoutput)) {
+        fprintf(stderr, "--partition-key option requires --partition and can't be used with --pgoutput.\n");
+        return ECODE_INVALID_ARGS;
+    }
+    if (cfg_partition_key && !hasConfigParam(&cfg_plugin_params, "include-pk", "1")) {
+        addConfigParam(&cfg_plugin_params, "include-pk", "1");
+    }
+
+    if (cfg_slot_lock && cfg_shard_count > 0) {
+        fprintf(stderr, "--slot-lock option can't be used with --shard.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_reconnect && (cfg_shard_count > 0 || cfg_poll_mode)) {
+        fprintf(stderr, "--reconnect option can't be used with --shard or --poll-mode.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if ((cfg_start_lsn != InvalidXLogRecPtr || cfg_checkpoint_path != NULL) &&
+            (cfg_shard_count > 0 || cfg_poll_mode)) {
+        fprintf(stderr, "--start-lsn and --checkpoint options can't be used with --shard or --poll-mode.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_reconnect && !cfg_write_header && !cfg_binary_header) {
+        // Restart markers are written as headers
+        fprintf(stderr, "--reconnect option requires --write-header or --binary-header.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_direct_read && (cfg_shard_count > 0 || cfg_poll_mode)) {
+        fprintf(stderr, "--direct-read option can't be used with --shard or --poll-mode.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_stream_threshold > 0) {
+        if (!cfg_direct_read) {
+            fprintf(stderr, "--stream-threshold option requires --direct-read.\n");
+            return ECODE_INVALID_ARGS;
+        }
+        // Records are written before they are complete. A record cut by a
+        // lost connection can't be replaced by a reconnection.
+        if (cfg_transcode != TRANSCODE_NONE || cfg_filter.enabled || cfg_partition_count > 0 ||
+                cfg_pgoutput || cfg_compress != COMPRESS_NONE || cfg_ring_fd >= 0 ||
+                cfg_spool_size > 0 || cfg_reconnect) {
+            fprintf(stderr, "--stream-threshold option can't be used with --transcode, --filter-*, "
+                    "--partition, --pgoutput, --compress, --ring, --spool or --reconnect.\n");
+            return ECODE_INVALID_ARGS;
+        }
+    }
+
+    if (cfg_io_uring && cfg_poll_mode) {
+        fprintf(stderr, "--io-uring option can't be used with --poll-mode.\n");
+        return ECODE_INVALID_ARGS;
+    }
+
+    if (cfg_metrics_path != NULL) {
+        if (cfg_poll_mode) {
+            fprintf(stderr, "--metrics option can't be used with --poll-mode.\n");
+            return ECODE_INVALID_ARGS;
+        }
+        s_metrics_tmp_path = malloc(strlen(cfg_metrics_path) + sizeof(".tmp"));
+        sprintf(s_metrics_tmp_path, "%s.tmp", cfg_metrics_path);
+    }
+
+    if (cfg_slot_name == NULL && cfg_shard_count == 0) {
         fprintf(stderr, "--slot NAME option must be set.\n");
         fprintf(stderr, "Use --help option to show usage.\n");
         return ECODE_INVALID_ARGS;
@@ -1257,7 +8498,14 @@ int main(int argc, char** argv)
 
     if (cfg_verbose) {
         fprintf(stderr, "Options:\n");
-        fprintf(stderr, "  slot=%s\n", cfg_slot_name);
+        if (cfg_shard_count > 0) {
+            for (int i = 0; i < cfg_shard_count; i++) {
+                fprintf(stderr, "  shard=%s\n", cfg_shards[i].slot_name);
+            }
+        }
+        else {
+            fprintf(stderr, "  slot=%s\n", cfg_slot_name);
+        }
         fprintf(stderr, "  create-slot=%s\n", (cfg_create_slot ? "true" : "false"));
         if (cfg_create_slot) {
             fprintf(stderr, "  create-slot-plugin=%s\n", cfg_create_slot_plugin);
@@ -1268,11 +8516,89 @@ int main(int argc, char** argv)
                 fprintf(stderr, "  poll-duration=%.3f\n", (cfg_poll_duration / 1000.0));
             }
             fprintf(stderr, "  poll-interval=%.3f\n", (cfg_poll_interval / 1000.0));
+            fprintf(stderr, "  slot-lock=%s\n", (cfg_slot_lock ? "true" : "false"));
         }
         else {
+            if (cfg_standby) {
+                fprintf(stderr, "  standby=true\n");
+                if (cfg_poll_has_duration) {
+                    fprintf(stderr, "  poll-duration=%.3f\n", (cfg_poll_duration / 1000.0));
+                }
+                fprintf(stderr, "  poll-interval=%.3f\n", (cfg_poll_interval / 1000.0));
+            }
+            if (cfg_slot_lock) {
+                fprintf(stderr, "  slot-lock=true\n");
+            }
             fprintf(stderr, "  feedback-interval=%.3f\n", (cfg_feedback_interval / 1000.0));
             fprintf(stderr, "  status-interval=%.3f\n", (cfg_standby_message_interval / 1000.0));
-            fprintf(stderr, "  output-fd=%d\n", cfg_out_fd);
+            if (cfg_reconnect) {
+                fprintf(stderr, "  reconnect=%.3f\n", (cfg_reconnect_timeout / 1000.0));
+            }
+            if (cfg_start_lsn != InvalidXLogRecPtr) {
+                fprintf(stderr, "  start-lsn=%X/%X\n", (uint32_t) (cfg_start_lsn >> 32), (uint32_t) cfg_start_lsn);
+            }
+            if (cfg_checkpoint_path != NULL) {
+                fprintf(stderr, "  checkpoint=%s\n", cfg_checkpoint_path);
+                fprintf(stderr, "  checkpoint-sync=%.3f\n", (cfg_checkpoint_interval / 1000.0));
+            }
+            if (cfg_metrics_path != NULL) {
+                fprintf(stderr, "  metrics=%s\n", cfg_metrics_path);
+                fprintf(stderr, "  metrics-interval=%.3f\n", (cfg_metrics_interval / 1000.0));
+            }
+            fprintf(stderr, "  binary-commands=%s\n", (cfg_binary_commands ? "true" : "false"));
+            fprintf(stderr, "  unordered-feedback=%s\n", (cfg_unordered_feedback ? "true" : "false"));
+            if (cfg_filter.enabled) {
+                for (size_t i = 0; i < cfg_filter.table_cap; i++) {
+                    const struct FilterTable* t = cfg_filter.tables[i];
+                    if (t == NULL) {
+                        continue;
+                    }
+                    fprintf(stderr, "  filter-table=%s%s", t->name, (t->included ? "" : " (not listed)"));
+                    for (int j = 0; j < t->ncolumns; j++) {
+                        fprintf(stderr, "%s%s", (j == 0 ? (t->exclude_columns ? " columns=-" : " columns=") : ","),
+                                t->columns[j]);
+                    }
+                    fprintf(stderr, "\n");
+                }
+                fprintf(stderr, "  filter-actions=%s%s%s%s\n",
+                        (cfg_filter.actions & FILTER_ACTION_INSERT ? "I" : ""),
+                        (cfg_filter.actions & FILTER_ACTION_UPDATE ? "U" : ""),
+                        (cfg_filter.actions & FILTER_ACTION_DELETE ? "D" : ""),
+                        (cfg_filter.actions & FILTER_ACTION_TRUNCATE ? "T" : ""));
+            }
+            if (cfg_ring_fd >= 0) {
+                fprintf(stderr, "  ring=%d,%d,%d\n", cfg_ring_fd, cfg_ring_notify_fd, cfg_ring_wait_fd);
+            }
+            else if (cfg_partition_count > 0) {
+                for (int i = 0; i < cfg_partition_count; i++) {
+                    fprintf(stderr, "  partition=%d,%d\n", cfg_partitions[i].out_fd, cfg_partitions[i].cmd_fd);
+                }
+                fprintf(stderr, "  partition-key=%s\n", (cfg_partition_key ? "true" : "false"));
+            }
+            else {
+                fprintf(stderr, "  output-fd=%d\n", cfg_out_fd);
+            }
+            if (cfg_spool_size > 0) {
+                fprintf(stderr, "  spool=%zu\n", cfg_spool_size);
+            }
+            if (cfg_spill_dir != NULL) {
+                fprintf(stderr, "  spill=%s\n", cfg_spill_dir);
+                fprintf(stderr, "  spill-size=%zu\n", cfg_spill_size);
+            }
+            if (cfg_direct_read) {
+                fprintf(stderr, "  direct-read=true\n");
+            }
+            if (cfg_stream_threshold > 0) {
+                fprintf(stderr, "  stream-threshold=%zu\n", cfg_stream_threshold);
+            }
+            if (cfg_io_uring) {
+                fprintf(stderr, "  io-uring=true\n");
+            }
+            if (cfg_compress != COMPRESS_NONE) {
+                fprintf(stderr, "  compress=lz4\n");
+                fprintf(stderr, "  compress-level=%d\n", cfg_compress_level);
+                fprintf(stderr, "  compress-block=%zu\n", cfg_compress_block);
+            }
             fprintf(stderr, "Plugin options:\n");
             for (int i = 0; i < cfg_plugin_params.count; i++) {
                 if (cfg_plugin_params.values[i] != NULL) {
@@ -1305,7 +8631,12 @@ int main(int argc, char** argv)
         // https://www.postgresql.org/docs/current/protocol-replication.html
         addConfigParamArg(&cfg_pq_params, "replication=database");
 
-        ecode = run();
+        if (cfg_shard_count > 0) {
+            ecode = runShards();
+        }
+        else {
+            ecode = run();
+        }
     }
 
     return ecode;
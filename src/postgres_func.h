@@ -74,7 +74,8 @@ int64_t feGetCurrentTimestamp(void)
 }
 
 // src/bin/pg_basebackup/streamutil.h
-static
+// (unused by the benchmark)
+static __attribute__((unused))
 bool feTimestampDifferenceExceeds(int64_t start_time, int64_t stop_time,
         int msec)
 {
@@ -83,23 +84,4 @@ bool feTimestampDifferenceExceeds(int64_t start_time, int64_t stop_time,
     return (diff >= msec * 1000);
 }
 
-// src/bin/pg_basebackup/streamutil.h
-static
-void feTimestampDifference(int64_t start_time, int64_t stop_time,
-        long *secs, int *microsecs)
-{
-    int64_t diff = stop_time - start_time;
-
-    if (diff <= 0)
-    {
-        *secs = 0;
-        *microsecs = 0;
-    }
-    else
-    {
-        *secs = (long) (diff / USECS_PER_SEC);
-        *microsecs = (int) (diff % USECS_PER_SEC);
-    }
-}
-
 #endif // POSTGRES_FUNC_H
@@ -115,6 +115,507 @@ RSpec.describe "pg_logical_cdc" do
     end
   end
 
+  it "writes binary headers" do
+    cmd(slot_name, "-N --wal2json2 --binary-header") do |c|
+      pg_exec "insert into #{table1} (name) values ('n1')"
+
+      # Begin ("B"), Insert ("I"), Commit ("C")
+      ["B", "I", "C"].each do |action|
+        lsn, wal_end, send_time, len, flags = c.stdout.read(32).unpack("Q<Q<q<L<L<")
+        r = c.stdout.read(len)
+
+        expect(lsn).to be > 0
+        expect(wal_end).to be >= lsn
+        expect(send_time / 1_000_000.0).to be_within(60).of(Time.now.to_f)
+        expect(flags & 1).to eq(1)
+        expect(r).to end_with("\n")
+
+        j = JSON.parse(r)
+        expect(j["action"]).to eq(action)
+      end
+    end
+  end
+
+  [["msgpack", :msgpack_decode], ["cbor", :cbor_decode]].each do |format, decoder|
+    it "transcodes records to #{format}" do
+      cmd(slot_name, "--wal2json2 --transcode #{format}") do |c|
+        pg_exec "insert into #{table1} (name) values ('n\u00e9\"1')"
+
+        records = 3.times.map do
+          h = c.stdout.gets
+          len = HEADER_REGEXP.match(h)[:len].to_i
+          data = c.stdout.read(len)
+          value, pos = send(decoder, data)
+          expect(pos).to eq(len)
+          value
+        end
+        expect(records.map {|r| r["action"] }).to eq(["B", "I", "C"])
+        expect(records[1]["table"]).to eq(table1)
+        expect(records[1]["columns"]).to eq([
+          {"name"=>"id", "type"=>"bigint", "value"=>1},
+          {"name"=>"name", "type"=>"text", "value"=>"n\u00e9\"1"},
+          {"name"=>"extra", "type"=>"bytea", "value"=>nil}
+        ])
+      end
+    end
+  end
+
+  it "reads binary commands" do
+    stat = cmd(slot_name, "-N --wal2json2 --binary-commands") do |c|
+      pg_exec "insert into #{table1} (name) values ('n1')"
+
+      # Begin ("B"), Insert ("I"), Commit ("C")
+      lsn = nil
+      3.times do
+        h = c.stdout.gets
+        c.stdout.gets
+        lsn = h.split(" ")[1]
+      end
+      hi, lo = lsn.split("/").map {|v| v.to_i(16) }
+
+      # Stats are written to STDERR
+      c.stdin.write(["F", (hi << 32) | lo].pack("a8Q<"))
+      c.stdin.write(["S", 0].pack("a8Q<"))
+      c.stdin.flush
+      sleep 0.5
+      expect(c.stderr).to include("acked=#{lsn}")
+
+      c.stdin.write(["q", 0].pack("a8Q<"))
+      c.stdin.flush
+      c.stdout.read
+    end
+    expect(stat.exitstatus).to eq(0)
+  end
+
+  it "confirms acknowledged prefix with unordered feedback" do
+    cmd(slot_name, "-N --wal2json2 --unordered-feedback") do |c|
+      pg_exec "insert into #{table1} (name) values ('n1'), ('n2')"
+
+      # Begin ("B"), Insert ("I"), Insert ("I"), Commit ("C")
+      lsns = 4.times.map do
+        h = c.stdout.gets
+        c.stdout.gets
+        h.split(" ")[1]
+      end
+
+      # Acknowledge all but the first record
+      lsns[1..-1].reverse.each {|lsn| c.stdin.puts "F #{lsn}" }
+      c.stdin.puts "S"
+      c.stdin.flush
+      sleep 0.5
+      expect(c.stderr).to include("acked=0/0")
+
+      # Acknowledging the first record confirms all
+      c.stdin.puts "F #{lsns[0]}"
+      c.stdin.puts "S"
+      c.stdin.flush
+      sleep 0.5
+      expect(c.stderr).to include("acked=#{lsns[3]}")
+
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  end
+
+  it "merges shards in commit order" do
+    pg_drop_slot(alt_slot_name) rescue nil
+    pg_create_slot(alt_slot_name)
+    acked_lsn = nil
+    begin
+      shards = "--shard #{slot_name}=public.#{table1} --shard #{alt_slot_name}=public.#{table2}"
+      stat = cmd(nil, "-N --wal2json2 #{shards}") do |c|
+        pg_exec "insert into #{table1} (name) values ('n1')"
+        pg_exec "insert into #{table2} (c_date) values ('2020-01-02')"
+        pg_exec "insert into #{table1} (name) values ('n2')"
+
+        records = 9.times.map do
+          h = c.stdout.gets
+          [HEADER_REGEXP.match(h)[:lsn], JSON.parse(c.stdout.gets)]
+        end
+        expect(records.map {|_, r| r["action"] }).to eq(%w[B I C B I C B I C])
+        expect(records.values_at(1, 4, 7).map {|_, r| r["table"] }).to eq([table1, table2, table1])
+        commit_lsns = records.values_at(2, 5, 8).map {|lsn, _| lsn.split("/").map {|v| v.to_i(16) } }
+        expect(commit_lsns).to eq(commit_lsns.sort)
+
+        # The commit of table2 is confirmed by both slots: slot_name has
+        # received a later commit, so its watermark passed the LSN
+        acked_lsn = records[5][0]
+        c.stdin.puts "F #{acked_lsn}"
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+      expect(stat.exitstatus).to eq(0)
+
+      r = pg_exec "select slot_name, confirmed_flush_lsn from pg_replication_slots where slot_name in ('#{slot_name}', '#{alt_slot_name}')"
+      expect(r.map {|row| row["confirmed_flush_lsn"] }).to eq([acked_lsn, acked_lsn])
+    ensure
+      pg_drop_slot(alt_slot_name) rescue nil
+    end
+  end
+
+  it "splits records to partitions" do
+    p0_out, p0_out_w = IO.pipe
+    p0_cmd_r, p0_cmd = IO.pipe
+    p1_out, p1_out_w = IO.pipe
+    p1_cmd_r, p1_cmd = IO.pipe
+    fds = {4=>p0_out_w, 5=>p0_cmd_r, 6=>p1_out_w, 7=>p1_cmd_r}
+    cmd(slot_name, "-N --wal2json2 --partition 4,5 --partition 6,7", fds) do |c|
+      pg_exec "insert into #{table1} (name) values ('n1')"
+
+      # Begin ("B") and Commit ("C") are written to both partitions, and
+      # Insert ("I") to one of them
+      actions = [p0_out, p1_out].map do |out|
+        records = []
+        while records.empty? || records.last[1]["action"] != "C"
+          h = out.gets
+          records << [h.split(" ")[1], JSON.parse(out.gets)]
+        end
+        records
+      end
+      expect(actions.map {|rs| rs.first[1]["action"] }).to eq(["B", "B"])
+      expect(actions.map {|rs| rs.count {|_, r| r["action"] == "I" } }.sum).to eq(1)
+      commit_lsn = actions[0].last[0]
+
+      # Commit is confirmed after both partitions acknowledge it
+      p0_cmd.puts "F #{commit_lsn}"
+      p0_cmd.flush
+      sleep 0.5
+      c.stdin.puts "S"
+      c.stdin.flush
+      sleep 0.5
+      expect(c.stderr).to include("acked=0/0")
+
+      p1_cmd.puts "F #{commit_lsn}"
+      p1_cmd.flush
+      sleep 0.5
+      c.stdin.puts "S"
+      c.stdin.flush
+      sleep 0.5
+      expect(c.stderr).to include("acked=#{commit_lsn}")
+
+      c.stdin.puts "q"
+      p0_out.read
+      p1_out.read
+    end
+  ensure
+    [p0_out, p0_cmd, p1_out, p1_cmd].each {|io| io.close unless io.closed? }
+  end
+
+  it "filters tables and columns" do
+    cmd(slot_name, "-N --wal2json2 --filter-tables public.#{table1} --filter-columns public.#{table1}=-extra") do |c|
+      # A transaction of table2 is dropped entirely
+      pg_exec "insert into #{table2} (c_date) values ('2020-01-02')"
+      pg_exec "insert into #{table1} (name, extra) values ('n1', 'x')"
+
+      records = 3.times.map do
+        c.stdout.gets
+        JSON.parse(c.stdout.gets)
+      end
+      expect(records.map {|r| r["action"] }).to eq(["B", "I", "C"])
+      expect(records[1]["table"]).to eq(table1)
+      expect(records[1]["columns"].map {|col| col["name"] }).to eq(["id", "name"])
+
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  end
+
+  it "spools output while the consumer is behind" do
+    cmd(slot_name, "-N --wal2json2 --spool 1K") do |c|
+      pg_exec "insert into #{table1} (name) select 'n' || i from generate_series(1, 1000) i"
+      # Don't read the output for a while
+      sleep 1
+
+      records = 1002.times.map do
+        c.stdout.gets
+        JSON.parse(c.stdout.gets)
+      end
+      expect(records.map {|r| r["action"] }.uniq).to eq(["B", "I", "C"])
+      expect(records[1000]["columns"][1]["value"]).to eq("n1000")
+
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  end
+
+  it "spills output to files while the consumer is behind" do
+    Dir.mktmpdir do |dir|
+      cmd(slot_name, "-N --wal2json2 --spool 1K --spill #{dir} --spill-size 64K") do |c|
+        pg_exec "insert into #{table1} (name) select 'n' || i from generate_series(1, 1000) i"
+        sleep 1
+
+        records = 1002.times.map do
+          c.stdout.gets
+          JSON.parse(c.stdout.gets)
+        end
+        expect(records.map {|r| r["action"] }.uniq).to eq(["B", "I", "C"])
+        expect(records[1000]["columns"][1]["value"]).to eq("n1000")
+        # Segment files are unlinked
+        expect(Dir.children(dir)).to eq([])
+
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+    end
+  end
+
+  it "writes output to a shared memory ring" do
+    Tempfile.create("ring") do |file|
+      # 4096 bytes of header and 16K of data, much less than the output
+      file.truncate(4096 + 16384)
+      ring = File.open(file.path, "r+b")
+      notify_r, notify_w = IO.pipe
+      wait_r, wait_w = IO.pipe
+      fds = {4=>file, 5=>notify_w, 6=>wait_r}
+      cmd(slot_name, "-N --wal2json2 --feedback-interval 0.1 --ring 4,5,6", fds) do |c|
+        pg_exec "insert into #{table1} (name) select 'n' || i from generate_series(1, 1000) i"
+        # Don't read the ring for a while
+        sleep 1
+
+        # Read the ring by polling write_pos, and wake up pg_logical_cdc
+        # if it waits for space
+        out = StringIO.new
+        read_pos = ring.pread(8, 128).unpack1("Q<")
+        while out.string.count("\n") < 1002 * 2
+          write_pos = ring.pread(8, 64).unpack1("Q<")
+          if write_pos == read_pos
+            sleep 0.01
+            next
+          end
+          offset = read_pos % 16384
+          n = [write_pos - read_pos, 16384 - offset].min
+          out.write(ring.pread(n, 4096 + offset))
+          read_pos += n
+          ring.pwrite([read_pos].pack("Q<"), 128)
+          if ring.pread(4, 196).unpack1("L<") != 0
+            ring.pwrite([0].pack("L<"), 196)
+            wait_w.write([1].pack("Q<"))
+          end
+        end
+
+        out.rewind
+        records = 1002.times.map do
+          h = out.gets
+          [h.split(" ")[1], JSON.parse(out.gets)]
+        end
+        expect(records.map {|_, r| r["action"] }.uniq).to eq(["B", "I", "C"])
+        expect(records[1000][1]["columns"][1]["value"]).to eq("n1000")
+
+        # ack_lsn of the header replaces F commands
+        commit_lsn = records.last[0]
+        hi, lo = commit_lsn.split("/").map {|x| x.to_i(16) }
+        ring.pwrite([(hi << 32) | lo].pack("q<"), 136)
+        sleep 0.5
+        c.stdin.puts "S"
+        c.stdin.flush
+        sleep 0.5
+        expect(c.stderr).to include("acked=#{commit_lsn}")
+
+        c.stdin.puts "q"
+      end
+    ensure
+      [notify_r, wait_w, ring].each {|io| io.close if io && !io.closed? }
+    end
+  end
+
+  it "compresses output in frames" do
+    cmd(slot_name, "-N --wal2json2 --compress lz4 --compress-level 4") do |c|
+      pg_exec "insert into #{table1} (name) select 'n' || i from generate_series(1, 100) i"
+
+      out = StringIO.new
+      lsns = []
+      rows = 0
+      while rows < 102
+        start_lsn, end_lsn, n, data = read_frame(c.stdout)
+        expect(start_lsn).to be <= end_lsn
+        lsns << end_lsn
+        rows += n
+        out << data
+      end
+      out.rewind
+
+      records = 102.times.map do
+        out.gets
+        JSON.parse(out.gets)
+      end
+      expect(records.map {|r| r["action"] }.uniq).to eq(["B", "I", "C"])
+      expect(records[100]["columns"][1]["value"]).to eq("n100")
+
+      # The highest LSN of a frame acknowledges its records
+      c.stdin.puts "F #{"%X/%X" % [lsns.last >> 32, lsns.last & 0xffffffff]}"
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  end
+
+  it "writes stats to --stats-fd" do
+    stats, stats_w = IO.pipe
+    cmd(slot_name, "-N --wal2json2 --stats-fd 4", {4=>stats_w}) do |c|
+      pg_exec "insert into #{table1} (name) values ('n1')"
+
+      h = nil
+      3.times do
+        h = c.stdout.gets
+        c.stdout.gets
+      end
+      lsn = HEADER_REGEXP.match(h)[:lsn]
+      c.stdin.puts "F #{lsn}"
+      c.stdin.puts "S"
+      c.stdin.flush
+
+      line = stats.gets
+      expect(line).to start_with("S ")
+      kv = Hash[line.split(" ")[1..].map {|s| s.split("=", 2) }]
+      expect(kv["rows"]).to eq("3")
+      expect(kv["received"]).to eq(lsn)
+      expect(kv["acked"]).to eq(lsn)
+      expect(kv["receive_to_write_us"]).to match(/^count:3,p50:[0-9]+,p90:[0-9]+,p99:[0-9]+,p999:[0-9]+,max:[0-9]+$/)
+      expect(kv["write_to_ack_us"]).to match(/^count:[1-9]/)
+      expect(c.stderr).not_to include("rows=")
+
+      # Histograms are reset by each S command
+      c.stdin.puts "S"
+      c.stdin.flush
+      kv = Hash[stats.gets.split(" ")[1..].map {|s| s.split("=", 2) }]
+      expect(kv["rows"]).to eq("3")
+      expect(kv["receive_to_write_us"]).to start_with("count:0,")
+
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  ensure
+    stats.close
+  end
+
+  it "rejects an invalid --stats-fd" do
+    ["4x", "", "-1", "0"].each do |fd|
+      stat = cmd(slot_name, "--stats-fd '#{fd}'") do |c|
+        c.stdout.read
+        sleep 0.1
+        expect(c.stderr).to include("Invalid -t,--stats-fd option")
+      end
+      expect(stat.exitstatus).to eq(1)
+    end
+  end
+
+  it "writes metrics" do
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "pg_logical_cdc.prom")
+      cmd(slot_name, "-N --wal2json2 --metrics #{path} --metrics-interval 0.1") do |c|
+        pg_exec "insert into #{table1} (name) values ('n1')"
+
+        h = nil
+        3.times do
+          h = c.stdout.gets
+          c.stdout.gets
+        end
+        c.stdin.puts "F #{HEADER_REGEXP.match(h)[:lsn]}"
+        sleep 1
+
+        metrics = File.read(path)
+        expect(metrics).to include("# TYPE pg_logical_cdc_received_records_total counter\n")
+        expect(metrics).to match(/^pg_logical_cdc_received_records_total 3$/)
+        expect(metrics).to match(/^pg_logical_cdc_written_records_total 3$/)
+        expect(metrics).to match(/^pg_logical_cdc_feedbacks_total\{reason="feedback_interval"\} [1-9]/)
+        expect(metrics).to match(/^pg_logical_cdc_wakeups_total [1-9]/)
+        expect(Dir.children(dir)).to eq(["pg_logical_cdc.prom"])
+
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+    end
+  end
+
+  it "writes metrics before exiting" do
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "pg_logical_cdc.prom")
+      cmd(slot_name, "-N --wal2json2 --metrics #{path} --metrics-interval 60") do |c|
+        pg_exec "insert into #{table1} (name) values ('n1')"
+        6.times { c.stdout.gets }
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+
+      metrics = File.read(path)
+      expect(metrics).to match(/^pg_logical_cdc_received_records_total 3$/)
+      expect(metrics).to match(/^pg_logical_cdc_written_records_total 3$/)
+    end
+  end
+
+  it "uses io_uring" do
+    cmd(slot_name, "-N --wal2json2 --io-uring --feedback-interval 0.1") do |c|
+      pg_exec "insert into #{table1} (name) values ('n1')"
+
+      records = 3.times.map do
+        h = c.stdout.gets
+        [HEADER_REGEXP.match(h)[:lsn], JSON.parse(c.stdout.gets)]
+      end
+      expect(records.map {|_, r| r["action"] }).to eq(["B", "I", "C"])
+
+      c.stdin.puts "F #{records.last[0]}"
+      c.stdin.flush
+      sleep 0.5
+      c.stdin.puts "S"
+      c.stdin.flush
+      sleep 0.5
+      expect(c.stderr).to include("acked=#{records.last[0]}")
+
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  end
+
+  it "reads the stream directly" do
+    cmd(slot_name, "-N --wal2json2 --direct-read --feedback-interval 0.1") do |c|
+      pg_exec "insert into #{table1} (name) values ('n1'), ('n2')"
+
+      records = 4.times.map do
+        h = c.stdout.gets
+        [HEADER_REGEXP.match(h)[:lsn], JSON.parse(c.stdout.gets)]
+      end
+      expect(records.map {|_, r| r["action"] }).to eq(["B", "I", "I", "C"])
+      expect(records[1][1]["columns"][1]["value"]).to eq("n1")
+
+      c.stdin.puts "F #{records.last[0]}"
+      c.stdin.flush
+      sleep 0.5
+      c.stdin.puts "S"
+      c.stdin.flush
+      sleep 0.5
+      expect(c.stderr).to include("acked=#{records.last[0]}")
+
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  end
+
+  it "streams records larger than --stream-threshold" do
+    cmd(slot_name, "-H -N --wal2json1 --direct-read --stream-threshold 1K --feedback-interval 0.1") do |c|
+      values = 100.times.map {|i| "('n#{i}')" }.join(", ")
+      pg_exec "insert into #{table1} (name) values #{values}"
+
+      h = c.stdout.gets
+      m = HEADER_REGEXP.match(h)
+      expect(m[:len].to_i).to be > 1024
+      r = c.stdout.read(m[:len].to_i)
+      expect(r[-1]).to eq("\n")
+      j = JSON.parse(r)
+      expect(j["change"].size).to eq(100)
+      expect(j["change"].last["columnvalues"][1]).to eq("n99")
+
+      c.stdin.puts "F #{m[:lsn]}"
+      c.stdin.flush
+      sleep 0.5
+      c.stdin.puts "S"
+      c.stdin.flush
+      sleep 0.5
+      expect(c.stderr).to include("acked=#{m[:lsn]}")
+
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  end
+
   it "capture deletes" do
     cmd(slot_name, "-N --wal2json2") do |c|
       pg_exec "insert into #{table1} (name) values ('n1'), ('n1')"
@@ -267,6 +768,157 @@ RSpec.describe "pg_logical_cdc" do
     end
   end
 
+  describe "with --pgoutput" do
+    let(:publication) do
+      "pg_logical_cdc_test_p1_#{suffix}"
+    end
+
+    let(:table3) do
+      "pg_logical_cdc_test_t3_#{suffix}"
+    end
+
+    before(:each) do
+      pg_exec "drop table if exists #{table3}"
+      pg_exec <<~SQL
+        create table #{table3} (
+          id integer primary key,
+          c_float float8,
+          c_numeric numeric(10,2),
+          c_timestamps timestamp[],
+          c_range int4range,
+          c_tsvector tsvector,
+          c_point point,
+          c_chars char(3)[],
+          c_dates date[]
+        )
+      SQL
+      pg_exec "drop publication if exists #{publication}"
+      pg_exec "create publication #{publication} for table #{table1}, #{table2}, #{table3}"
+      pg_drop_slot(alt_slot_name) rescue nil
+      pg_exec "select pg_create_logical_replication_slot('#{alt_slot_name}', 'pgoutput')"
+    end
+
+    after(:each) do
+      pg_drop_slot(alt_slot_name) rescue nil
+      pg_exec "drop publication if exists #{publication}"
+      pg_exec "drop table if exists #{table3}"
+    end
+
+    # Reads count records of the slot and returns them parsed
+    def read_records(slot, args, count)
+      records = nil
+      cmd(slot, args) do |c|
+        records = count.times.map do
+          c.stdout.gets
+          JSON.parse(c.stdout.gets)
+        end
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+      records
+    end
+
+    # Runs stmts then expects the same records from wal2json and pgoutput
+    def expect_same_records(count, *stmts)
+      stmts.each {|stmt| pg_exec stmt }
+      wal2json = read_records(slot_name, "-N --wal2json2", count)
+      pgoutput = read_records(alt_slot_name, "-N --pgoutput #{publication}", count)
+      expect(pgoutput).to eq(wal2json)
+      wal2json
+    end
+
+    it "writes inserts like wal2json" do
+      records = expect_same_records(4, "insert into #{table1} (name, extra) values ('n1', 'x'), ('n2', null)")
+      expect(records.map {|r| r["action"] }).to eq(["B", "I", "I", "C"])
+    end
+
+    it "writes updates like wal2json" do
+      records = expect_same_records(8,
+        "insert into #{table1} (name) values ('n1'), ('n1')",
+        "update #{table1} set name = 'n2' where name = 'n1'")
+      # The key didn't change, so identity is the key of the new tuple
+      expect(records[5]["identity"]).to eq([{"name"=>"id", "type"=>"bigint", "value"=>1}])
+    end
+
+    it "writes updates of the key like wal2json" do
+      expect_same_records(6,
+        "insert into #{table1} (name) values ('n1')",
+        "update #{table1} set id = 10, name = 'n2' where id = 1")
+    end
+
+    it "writes deletes like wal2json" do
+      expect_same_records(8,
+        "insert into #{table1} (name) values ('n1'), ('n1')",
+        "delete from #{table1} where name = 'n1'")
+    end
+
+    it "writes date and time like wal2json" do
+      expect_same_records(3,
+        "insert into #{table2} (c_date, c_timestamp, c_timestamptz) values ('2020-01-02', '2020-01-02 03:04:05.678', '2020-01-02 03:04:05.678 +0000')")
+    end
+
+    it "writes built-in types and NaN like wal2json" do
+      records = expect_same_records(5, <<~SQL)
+        insert into #{table3} values
+          (1, 'NaN', 'NaN', '{"2020-01-02 03:04:05"}', '[1,5)', 'a:1 b:2', '(1,2)', '{abc,de}', '{2020-01-02}'),
+          (2, '-Infinity', 1.5, null, 'empty', '', '(0,0)', '{}', null),
+          (3, 2.5, 12.34, null, null, null, null, null, null)
+      SQL
+      expect(records[1]["columns"].map {|col| col["type"] }).to eq([
+        "integer", "double precision", "numeric(10,2)", "timestamp without time zone[]",
+        "int4range", "tsvector", "point", "character(3)[]", "date[]"
+      ])
+      expect(records[1]["columns"][1]["value"]).to be_nil
+      expect(records[2]["columns"][1]["value"]).to be_nil
+      expect(records[3]["columns"][1]["value"]).to eq(2.5)
+    end
+
+    it "streams large transactions with the LSN written before the stream" do
+      # The walsender streams a transaction over logical_decoding_work_mem
+      args = "-N --pgoutput #{publication} --pgoutput-streaming --feedback-interval 0.1 " +
+        "-m 'options=-c logical_decoding_work_mem=64kB'"
+      cmd(alt_slot_name, args) do |c|
+        pg_exec "insert into #{table1} (name) values ('n0')"
+        before_lsn = nil
+        3.times do
+          before_lsn = HEADER_REGEXP.match(c.stdout.gets)[:lsn]
+          c.stdout.gets
+        end
+
+        pg_exec "insert into #{table1} (name) select repeat('x', 100) || i from generate_series(1, 5000) i"
+        streamed = []
+        while true
+          lsn = HEADER_REGEXP.match(c.stdout.gets)[:lsn]
+          j = JSON.parse(c.stdout.gets)
+          break if j["action"] == "C"
+          streamed << [lsn, j]
+        end
+        commit_lsn = lsn
+        expect(streamed.size).to eq(5000)
+        expect(streamed.map {|_, j| j["xid"] }.uniq.size).to eq(1)
+        expect(streamed.map {|lsn, _| lsn }.uniq).to eq([before_lsn])
+        expect(commit_lsn).not_to eq(before_lsn)
+
+        # Acknowledging streamed records doesn't move the slot
+        c.stdin.puts "F #{streamed.last[0]}"
+        c.stdin.flush
+        sleep 0.5
+        confirmed = pg_exec("select confirmed_flush_lsn from pg_replication_slots where slot_name = '#{alt_slot_name}'") {|r| r[0]["confirmed_flush_lsn"] }
+        expect(confirmed).to eq(before_lsn)
+
+        # The C record does
+        c.stdin.puts "F #{commit_lsn}"
+        c.stdin.flush
+        sleep 0.5
+        confirmed = pg_exec("select confirmed_flush_lsn from pg_replication_slots where slot_name = '#{alt_slot_name}'") {|r| r[0]["confirmed_flush_lsn"] }
+        expect(confirmed).to eq(commit_lsn)
+
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+    end
+  end
+
   it "resumes" do
     cmd(slot_name, "-N --wal2json2") do |c|
       pg_exec "insert into #{table1} (name) values ('n1'), ('n2')"
@@ -317,6 +969,54 @@ RSpec.describe "pg_logical_cdc" do
     end
   end
 
+  it "starts from the checkpoint" do
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "checkpoint")
+      commit_lsn = nil
+
+      cmd(slot_name, "-N --wal2json2") do |c|
+        pg_exec "insert into #{table1} (name) values ('n1')"
+
+        # Begin ("B"), Insert ("I") and Commit ("C")
+        3.times do
+          h = c.stdout.gets
+          c.stdout.gets
+          commit_lsn = HEADER_REGEXP.match(h)[:lsn]
+        end
+
+        # Quit without sending feedback
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+
+      # The consumer acknowledged the commit in a previous run
+      File.write(path, "#{commit_lsn}\n")
+
+      cmd(slot_name, "-N --wal2json2 --checkpoint #{path}") do |c|
+        expect(c.stdout.gets).to eq("r #{commit_lsn} 0\n")
+
+        pg_exec "insert into #{table1} (name) values ('n2')"
+
+        c.stdout.gets
+        expect(JSON.parse(c.stdout.gets)["action"]).to eq("B")
+        h = c.stdout.gets
+        j = JSON.parse(c.stdout.gets)
+        expect(j["action"]).to eq("I")
+        expect(j["columns"][1]["value"]).to eq("n2")
+        h = c.stdout.gets
+        expect(JSON.parse(c.stdout.gets)["action"]).to eq("C")
+
+        c.stdin.puts "F #{HEADER_REGEXP.match(h)[:lsn]}"
+        c.stdin.puts "q"
+        c.stdout.read
+        commit_lsn = HEADER_REGEXP.match(h)[:lsn]
+      end
+
+      # Written before exit
+      expect(File.read(path).strip).to eq(commit_lsn)
+    end
+  end
+
   it "sends feedback" do
     lsn_before_feedback = nil
     lsn_after_feedback = nil
@@ -436,6 +1136,112 @@ RSpec.describe "pg_logical_cdc" do
     end
   end
 
+  it "takes over crashed node immediately using poll mode with slot lock" do
+    # Node 1 - sleep 2 then exit
+    node1 = Thread.new do
+      cmd(slot_name, "-N --wal2json2 --slot-lock -v") do |c|
+        sleep 2
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+    end
+
+    begin
+      # Node 2 - poll-interval=10 is not used while node1 holds the lock
+      # sleep 0.5 to wait for starting node1
+      sleep 0.5
+      poll_started = Time.now
+      stat = cmd(slot_name, "--poll-mode --poll-interval 10 --slot-lock") do |c|
+        c.stdout.read
+      end
+      poll_duration = Time.now - poll_started
+
+      expect(poll_duration).to be < 3.0
+
+      # Exit code is SUCCESS.
+      expect(stat.exitstatus).to eq(0)
+
+    ensure
+      node1.join
+    end
+  end
+
+  it "starts replication when the slot becomes available using standby" do
+    # Node 1 - sleep 2 then exit
+    node1 = Thread.new do
+      cmd(slot_name, "-N --wal2json2 --slot-lock -v") do |c|
+        sleep 2
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+    end
+
+    begin
+      # Node 2 - starts replication after node1 exits
+      # sleep 0.5 to wait for starting node1
+      sleep 0.5
+      started = Time.now
+      cmd(slot_name, "-N --wal2json2 --standby --slot-lock") do |c|
+        # wait until node1 exits then insert a row
+        node1.join
+        pg_exec "insert into #{table1} (name) values ('n1')"
+
+        h = c.stdout.gets
+        r = c.stdout.gets
+        j = JSON.parse(r)
+        expect(j["action"]).to eq("B")
+        expect(Time.now - started).to be < 5.0
+
+        c.stdin.puts "q"
+        c.stdout.read
+      end
+
+    ensure
+      node1.join
+    end
+  end
+
+  it "reconnects when the walsender is terminated" do
+    cmd(slot_name, "-N --wal2json2 --reconnect 10 --slot-lock") do |c|
+      pg_exec "insert into #{table1} (name) values ('n1')"
+      commit_lsn = nil
+      3.times do
+        commit_lsn = HEADER_REGEXP.match(c.stdout.gets)[:lsn]
+        c.stdout.gets
+      end
+      c.stdin.puts "F #{commit_lsn}"
+      c.stdin.flush
+
+      pg_exec "insert into #{table1} (name) values ('n2')"
+      records = 3.times.map do
+        c.stdout.gets
+        JSON.parse(c.stdout.gets)
+      end
+      expect(records[1]["columns"][1]["value"]).to eq("n2")
+      sleep 0.5
+
+      old_pid = pg_exec("select active_pid from pg_replication_slots where slot_name = '#{slot_name}'") {|r| r[0]["active_pid"] }
+      pg_exec "select pg_terminate_backend(#{old_pid})"
+
+      # The unacknowledged transaction is sent again after a restart marker
+      expect(c.stdout.gets).to eq("r #{commit_lsn} 0\n")
+      replayed = 3.times.map do
+        c.stdout.gets
+        JSON.parse(c.stdout.gets)
+      end
+      expect(replayed).to eq(records)
+
+      # The new walsender holds the slot lock again
+      new_pid = pg_exec("select active_pid from pg_replication_slots where slot_name = '#{slot_name}'") {|r| r[0]["active_pid"] }
+      expect(new_pid).not_to eq(old_pid)
+      locks = pg_exec("select count(*) from pg_locks where locktype = 'advisory' and granted and pid = #{new_pid}") {|r| r[0]["count"] }
+      expect(locks).to eq("1")
+
+      c.stdin.puts "q"
+      c.stdout.read
+    end
+  end
+
   it "times out poll-mode" do
     # Node 1 - sleep 3 then exit
     node1 = Thread.new do
@@ -1,5 +1,7 @@
 require 'rspec'
 require 'pg'
+require 'tmpdir'
+require 'tempfile'
 
 # Set libpq time zone to UTC
 ENV['PGTZ'] = 'UTC'
@@ -26,8 +28,118 @@ def pg_exec(stmt)
   end
 end
 
-def cmd(slot_name, args="", &block)
-  cmd = TestCommand.new(slot_name, args)
+# Decompresses an LZ4 block written by --compress
+def lz4_decompress(src)
+  src = src.bytes
+  out = []
+  i = 0
+  while i < src.size
+    token = src[i]
+    i += 1
+    lit = token >> 4
+    if lit == 15
+      begin
+        b = src[i]
+        i += 1
+        lit += b
+      end while b == 255
+    end
+    out.concat(src[i, lit])
+    i += lit
+    break if i >= src.size
+    offset = src[i] | (src[i + 1] << 8)
+    i += 2
+    len = token & 15
+    if len == 15
+      begin
+        b = src[i]
+        i += 1
+        len += b
+      end while b == 255
+    end
+    (len + 4).times { out << out[-offset] }
+  end
+  out.pack("C*")
+end
+
+# Reads a frame of --compress and returns [start_lsn, end_lsn, rows, data]
+def read_frame(io)
+  start_lsn, end_lsn, rows, raw_len, len, method = io.read(32).unpack("Q<Q<L<L<L<L<")
+  data = io.read(len)
+  data = lz4_decompress(data) if method == 1
+  raise "invalid frame" if data.bytesize != raw_len
+  [start_lsn, end_lsn, rows, data]
+end
+
+# Decodes a MessagePack value written by --transcode msgpack at pos of
+# data (a binary string) and returns [value, next_pos]
+def msgpack_decode(data, pos=0)
+  b = data.getbyte(pos)
+  pos += 1
+  str = ->(n, off) { [data.byteslice(pos + off, n).force_encoding("UTF-8"), pos + off + n] }
+  seq = lambda do |n, off, pairs|
+    pos += off
+    items = (n * (pairs ? 2 : 1)).times.map { v, pos = msgpack_decode(data, pos); v }
+    [pairs ? Hash[*items] : items, pos]
+  end
+  case b
+  when 0x00..0x7f then [b, pos]
+  when 0x80..0x8f then seq.(b & 0x0f, 0, true)
+  when 0x90..0x9f then seq.(b & 0x0f, 0, false)
+  when 0xa0..0xbf then str.(b & 0x1f, 0)
+  when 0xc0 then [nil, pos]
+  when 0xc2 then [false, pos]
+  when 0xc3 then [true, pos]
+  when 0xcb then [data.byteslice(pos, 8).unpack1("G"), pos + 8]
+  when 0xcc then [data.getbyte(pos), pos + 1]
+  when 0xcd then [data.byteslice(pos, 2).unpack1("n"), pos + 2]
+  when 0xce then [data.byteslice(pos, 4).unpack1("N"), pos + 4]
+  when 0xcf then [data.byteslice(pos, 8).unpack1("Q>"), pos + 8]
+  when 0xd0 then [data.byteslice(pos, 1).unpack1("c"), pos + 1]
+  when 0xd1 then [data.byteslice(pos, 2).unpack1("s>"), pos + 2]
+  when 0xd2 then [data.byteslice(pos, 4).unpack1("l>"), pos + 4]
+  when 0xd3 then [data.byteslice(pos, 8).unpack1("q>"), pos + 8]
+  when 0xd9 then str.(data.getbyte(pos), 1)
+  when 0xda then str.(data.byteslice(pos, 2).unpack1("n"), 2)
+  when 0xdb then str.(data.byteslice(pos, 4).unpack1("N"), 4)
+  when 0xdc then seq.(data.byteslice(pos, 2).unpack1("n"), 2, false)
+  when 0xdd then seq.(data.byteslice(pos, 4).unpack1("N"), 4, false)
+  when 0xde then seq.(data.byteslice(pos, 2).unpack1("n"), 2, true)
+  when 0xdf then seq.(data.byteslice(pos, 4).unpack1("N"), 4, true)
+  when 0xe0..0xff then [b - 0x100, pos]
+  else raise "unexpected msgpack type 0x%02x" % b
+  end
+end
+
+# Decodes a CBOR value written by --transcode cbor at pos of data and
+# returns [value, next_pos]
+def cbor_decode(data, pos=0)
+  b = data.getbyte(pos)
+  pos += 1
+  major = b >> 5
+  info = b & 0x1f
+  return [data.byteslice(pos, 8).unpack1("G"), pos + 8] if b == 0xfb
+  return [{0xf4 => false, 0xf5 => true, 0xf6 => nil}.fetch(b), pos] if major == 7
+  n = case info
+      when 0..23 then info
+      when 24 then data.getbyte(pos).tap { pos += 1 }
+      when 25 then data.byteslice(pos, 2).unpack1("n").tap { pos += 2 }
+      when 26 then data.byteslice(pos, 4).unpack1("N").tap { pos += 4 }
+      when 27 then data.byteslice(pos, 8).unpack1("Q>").tap { pos += 8 }
+      else raise "unexpected cbor head 0x%02x" % b
+      end
+  case major
+  when 0 then [n, pos]
+  when 1 then [-1 - n, pos]
+  when 3 then [data.byteslice(pos, n).force_encoding("UTF-8"), pos + n]
+  when 4 then [n.times.map { v, pos = cbor_decode(data, pos); v }, pos]
+  when 5 then [Hash[*(n * 2).times.map { v, pos = cbor_decode(data, pos); v }], pos]
+  else raise "unexpected cbor type 0x%02x" % b
+  end
+end
+
+def cmd(slot_name, args="", fds={}, &block)
+  cmd = TestCommand.new(slot_name, args, fds)
   stat = nil
   begin
     block.call(cmd)
@@ -38,16 +150,21 @@ def cmd(slot_name, args="", &block)
 end
 
 class TestCommand
-  def initialize(slot_name, args="")
-    cmd = "#{ENV['EXE']} --slot #{slot_name} -D 3 #{args}"
+  # fds maps extra file descriptor numbers of the command to IOs, which
+  # are closed after spawn
+  def initialize(slot_name, args="", fds={})
+    # slot_name is nil with --shard options
+    slot = slot_name ? "--slot #{slot_name} " : ""
+    cmd = "#{ENV['EXE']} #{slot}-D 3 #{args}"
 
     stdin_r, @stdin = IO.pipe
     @stdout, stdout_w = IO.pipe
     @stderr_pipe, stderr_w = IO.pipe
-    @pid = Process.spawn(cmd, 0=>stdin_r, 1=>stdout_w, 2=>stderr_w, 3=>stdout_w)
+    @pid = Process.spawn(cmd, {0=>stdin_r, 1=>stdout_w, 2=>stderr_w, 3=>stdout_w}.merge(fds))
     stdin_r.close
     stdout_w.close
     stderr_w.close
+    fds.each_value(&:close)
 
     @stderr = ""
 